@@ -7,6 +7,8 @@
 
 #include "VFS.h"
 
+std::vector<std::string> parseInput(const std::string& input);
+
 class CommandLineInterface {
 private:
     VFSManager* vfs;
@@ -19,4 +21,7 @@ public:
     }
     std::string createPath(ClientSession* session);
 	std::string runCLI(std::string buffer, ClientSession* session);
+	std::string runCommand(const std::vector<std::string>& args, ClientSession* session);
+	bool isStreamed(const std::vector<std::string>& args);
+	bool streamCLI(const std::vector<std::string>& args, const ReadStream& stream, ClientSession* session);
 };
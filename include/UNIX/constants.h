@@ -2,4 +2,9 @@
 
 #define SOCKET_NAME "./socketCommunication"
 #define BUFFER_SIZE 4096
-#define MAX_CLIENT_SUPPORT 10
\ No newline at end of file
+#define MAX_CLIENT_SUPPORT 4096
+#define MAX_REQUEST_SIZE (64 * BUFFER_SIZE)	// Largest request body; a larger one closes the connection
+#define SERVER_WORKERS 0	// Threads running client commands; 0 means one per core (at least 4)
+#define EPOLL_EVENTS_PER_WAIT 256
+#define MAX_PENDING_OUTPUT (16384 * BUFFER_SIZE)	// Response bytes queued for a client that is not reading
+#define SEND_TIMEOUT_MS 30000	// How long a worker waits for such a client before dropping it
\ No newline at end of file
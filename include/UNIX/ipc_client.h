@@ -6,5 +6,6 @@
 #include <signal.h>
 
 #include "constants.h"
+#include "protocol.h"
 
-void run_client();
\ No newline at end of file
+void run_client(bool batch = false);
\ No newline at end of file
@@ -1,19 +1,31 @@
 #pragma once
 
 #include <iostream>
+#include <cerrno>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <signal.h>
-#include <map>
 #include <thread>
 
 #include "constants.h"
+#include "protocol.h"
 #include "system.h"
 #include "CLI.h"
 #include "structs.h"
 
 void cleanup();
 bool is_server_running();
-void run_server();
+void run_server(const MountOptions& options = MountOptions());
 
 extern FileSystemInterface* fs;
\ No newline at end of file
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Binary framing between client and server. A request is a RequestHeader
+// followed by argCount arguments, each a uint32_t length and its bytes; a
+// response is a ResponseHeader followed by length bytes of payload. Fields are
+// in host byte order, as both ends run on the same machine.
+// Responses carry the id of their request and come back in request order, so
+// a client may send any number of requests before reading the responses.
+
+struct RequestHeader {
+	uint32_t requestId;
+	uint16_t opcode;
+	uint16_t argCount;
+	uint32_t length; // Bytes of arguments after the header
+};
+
+struct ResponseHeader {
+	uint32_t requestId;
+	uint16_t status;
+	uint16_t reserved;
+	uint64_t length; // Bytes of payload after the header
+};
+
+static_assert(sizeof(RequestHeader) == 12, "RequestHeader must not be padded");
+static_assert(sizeof(ResponseHeader) == 16, "ResponseHeader must not be padded");
+
+#define RESPONSE_OK 0
+#define RESPONSE_BAD_REQUEST 1
+
+#define OPCODE_PATH 0	// The prompt path; every other opcode is a command
+#define OPCODE_UNKNOWN 0xFFFF	// A command name the client does not know; the server says so
+
+// Opcodes index this table. The server runs the command by name with the
+// arguments exactly as sent, so it never tokenizes text.
+inline const char* const OPCODE_NAMES[] = {
+	"path", "help", "ls", "cd", "mkdir", "rmdir", "create", "write", "append", "read",
+	"rm", "rename", "stat", "open", "close", "hread", "hwrite", "hstat", "chmod", "chown",
+	"chgrp", "whoami", "login", "useradd", "showusr", "showgrp", "tree", "cachestat", "grow", "btree",
+	"show", "exit"
+};
+inline constexpr uint16_t OPCODE_COUNT = sizeof(OPCODE_NAMES) / sizeof(OPCODE_NAMES[0]);
+
+uint16_t opcodeFor(const std::string& command);
+std::string encodeRequest(uint32_t requestId, uint16_t opcode, const std::vector<std::string>& args);
+bool decodeArgs(const char* data, size_t length, uint16_t argCount, std::vector<std::string>& args);
+
+bool readFull(int fd, void* data, size_t length);
+bool writeFull(int fd, const void* data, size_t length);
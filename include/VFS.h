@@ -33,12 +33,21 @@ public:
 	// void format();
 	// void load();
 	bool create(const std::string& path, ClientSession* session);
-	bool create(const std::string& path, const int& fileSize, ClientSession* session);
+	bool create(const std::string& path, const int64_t& fileSize, ClientSession* session);
 	std::string read(const std::string& path, ClientSession* session);
+	std::string read(const std::string& path, int64_t offset, int64_t length, ClientSession* session);
 	bool write(const std::string& path, const std::string& data, ClientSession* session);
+	bool write(const std::string& path, int64_t offset, const std::string& data, ClientSession* session);
 	bool append(const std::string& path, const std::string& data, ClientSession* session);
 	bool remove(const std::string& path, ClientSession* session);
 	bool rename(const std::string& oldName, const std::string& newName, ClientSession* session);
+	bool readStream(const std::string& path, const ReadStream& stream, ClientSession* session);
+	int open(const std::string& path, ClientSession* session);
+	bool close(int handle, ClientSession* session);
+	void closeAll(ClientSession* session);
+	std::string hread(int handle, int64_t offset, int64_t length, ClientSession* session);
+	bool hwrite(int handle, int64_t offset, const std::string& data, ClientSession* session);
+	void hstat(int handle, ClientSession* session);
 	bool mkdir(const std::string& path, ClientSession* session);
 	bool rmdir(const std::string& path, ClientSession* session);
 	bool rmrdir(const std::string& path, ClientSession* session);
@@ -54,6 +63,8 @@ public:
 	void showUsers(ClientSession* session);
 	void showGroups(ClientSession* session);
 	void tree(ClientSession* session, const std::string& path = "/", int depth = 0, const std::string& prefix = "");
+	void cacheStats(ClientSession* session);
+	bool grow(int newSizeMB, ClientSession* session);
 
 	// LOGS
 	void bTree();
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "define.h"
+
+// Block allocation bitmap packed into 64-bit words, bit i of the map being
+// bit (i % 64) of words[i / 64]. The on-disk bitmap uses the same layout
+// (little-endian words), so load/save are a straight copy of data().
+// Changes are tracked per BLOCK_SIZE page of that layout so only the pages
+// touched since the last flush need to be written back.
+// Callers may modify bits concurrently only if they never share a 64-bit word
+// (System's allocation groups are word aligned); the counters are atomic.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "Bitmap::data() is the on-disk layout only on little-endian hosts");
+class Bitmap {
+	private:
+		std::vector<uint64_t> words;
+		size_t bitCount = 0;
+		std::atomic<size_t> usedCount{0};
+		std::vector<std::atomic<bool>> dirtyPages;
+
+		static constexpr size_t PAGE_BITS = static_cast<size_t>(BLOCK_SIZE) * 8;
+		void clearTail();
+
+	public:
+		static constexpr size_t npos = static_cast<size_t>(-1);
+
+		Bitmap() = default;
+		explicit Bitmap(size_t bits) { assign(bits); }
+
+		void assign(size_t bits);
+		void grow(size_t bits);
+		size_t size() const { return bitCount; }
+		size_t used() const { return usedCount; }
+		size_t available() const { return bitCount - usedCount; }
+
+		bool test(size_t index) const { return (words[index >> 6] >> (index & 63)) & 1; }
+		bool operator[](size_t index) const { return test(index); }
+		void set(size_t index);
+		void reset(size_t index);
+		void setRange(size_t from, size_t to);
+
+		size_t find(size_t from, size_t to, bool value) const;
+		size_t findFree(size_t from, size_t to) const { return find(from, to, false); }
+		size_t findUsed(size_t from, size_t to) const { return find(from, to, true); }
+
+		char* data() { return reinterpret_cast<char*>(words.data()); }
+		const char* data() const { return reinterpret_cast<const char*>(words.data()); }
+		size_t byteSize() const { return words.size() * sizeof(uint64_t); }
+		// Call after data() has been overwritten from disk
+		void recount();
+
+		size_t pageCount() const { return dirtyPages.size(); }
+		std::vector<size_t> takeDirtyPages();
+		void markPageDirty(size_t page) { dirtyPages[page] = true; }
+		void markAllDirty();
+		void reverseByteBits();
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <sys/types.h>
+
+#include "define.h"
+#include "bufferCache.h"
+
+// Single descriptor on the disk image, opened once per mount.
+// All I/O is positional (pread/pwrite), so concurrent callers never share a
+// stream position and need no locking around the descriptor itself.
+// When a BufferCache is enabled, readAt/writeAt are served from it and
+// commit() writes its dirty blocks back.
+// In mapped mode the whole image is mmap'ed and readAt/writeAt are plain
+// copies to/from the mapping; the cache is not used and commit() msyncs the
+// range written since the previous commit.
+class BlockDevice {
+	private:
+		int fd = -1;
+		std::string path;
+		std::unique_ptr<BufferCache> cache;
+		char* mapping = nullptr;
+		size_t mappingSize = 0;
+		std::shared_mutex mappingMutex; // Exclusive only while resize() remaps
+		std::mutex dirtyMutex;
+		off_t dirtyStart = -1; // Byte range written through the mapping since the last commit
+		off_t dirtyEnd = -1;
+
+		void markDirty(off_t offset, size_t length);
+		void unmap();
+
+		friend class BufferCache;
+		bool rawReadAt(off_t offset, size_t length, char* buffer);
+		bool rawWriteAt(off_t offset, size_t length, const char* buffer);
+
+	public:
+		BlockDevice() = default;
+		~BlockDevice();
+		BlockDevice(const BlockDevice&) = delete;
+		BlockDevice& operator=(const BlockDevice&) = delete;
+
+		bool create(const std::string& diskPath, off_t size);
+		bool open(const std::string& diskPath);
+		void close();
+		bool isOpen() const { return fd != -1; }
+		int getFD() const { return fd; }
+		explicit operator bool() const { return isOpen(); }
+
+		bool readBlocks(int64_t block, int64_t count, char* buffer);
+		bool writeBlocks(int64_t block, int64_t count, const char* buffer);
+		bool readAt(off_t offset, size_t length, char* buffer);
+		bool writeAt(off_t offset, size_t length, const char* buffer);
+		bool sync();
+		bool commit();
+		bool discard(int64_t block, int64_t count);
+		bool resize(off_t size);
+		int directReadFd(off_t offset, size_t length);
+
+		void enableCache(size_t capacityBlocks, size_t shardCount);
+		CacheStats cacheStats();
+
+		bool enableMapping();
+		bool isMapped() const { return mapping != nullptr; }
+};
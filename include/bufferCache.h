@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+
+#include "define.h"
+
+class BlockDevice;
+
+struct CacheStats {
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	uint64_t evictions = 0;
+	uint64_t writebacks = 0;
+	size_t cachedBlocks = 0;
+	size_t dirtyBlocks = 0;
+	size_t capacity = 0;
+};
+
+// Sharded write-back LRU cache of BLOCK_SIZE blocks in front of the disk image.
+// Dirty blocks reach the image on eviction, from the background flusher, or on flush().
+class BufferCache {
+	private:
+		struct CachedBlock {
+			std::vector<char> data;
+			bool dirty = false;
+			std::list<int64_t>::iterator lruPosition;
+		};
+		struct Shard {
+			std::mutex lock;
+			std::list<int64_t> lru; // Most recently used at the front
+			std::unordered_map<int64_t, CachedBlock> blocks;
+			size_t dirtyCount = 0;
+		};
+
+		BlockDevice& device;
+		std::vector<Shard> shards;
+		size_t shardCapacity;
+		std::atomic<uint64_t> hits{0};
+		std::atomic<uint64_t> misses{0};
+		std::atomic<uint64_t> evictions{0};
+		std::atomic<uint64_t> writebacks{0};
+
+		std::thread flusher;
+		std::mutex flusherMutex;
+		std::condition_variable flusherCV;
+		bool stopFlusher = false;
+
+		Shard& shardFor(int64_t block);
+		CachedBlock* getBlock(Shard& shard, int64_t block, bool load);
+		bool writeBack(int64_t block, CachedBlock& entry);
+		bool evict(Shard& shard);
+		bool flushShard(Shard& shard);
+		void flusherLoop();
+
+	public:
+		BufferCache(BlockDevice& device, size_t capacityBlocks, size_t shardCount);
+		~BufferCache();
+		BufferCache(const BufferCache&) = delete;
+		BufferCache& operator=(const BufferCache&) = delete;
+
+		bool read(off_t offset, size_t length, char* buffer);
+		bool write(off_t offset, size_t length, const char* buffer);
+		bool flush();
+		void invalidate(int64_t block, int64_t count);
+		bool writeBackRange(int64_t block, int64_t count);
+		CacheStats stats();
+};
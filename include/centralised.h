@@ -4,6 +4,9 @@
 #include <fstream>
 #include <vector>
 #include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <thread>
 
 #include "system.h"
 
@@ -10,25 +10,22 @@
 #include <unordered_map>
 #include <vector>
 
-#define DISK_SIZE 104857600	// 100MB
-#define BLOCK_SIZE 4096	// 4KB (MINIMUM: 400)
+#define BLOCK_SIZE 4096	// 4KB (MINIMUM: 400); recorded in the superblock, images must match
 #define FILE_NAME_LENGTH 32
-#define MAX_EXTENTS 5
-#define ORDER 5 // 30 MAX due to block size
-#define MAX_FILES 3000
+#define INLINE_EXTENTS 5	// Extent tree root held in each directory entry
+#define EXTENT_DEPTH_INLINE 0xFF	// Entry holds the file's data instead of an extent tree root
 
-#define TOTAL_BLOCKS (DISK_SIZE / BLOCK_SIZE)
-#define SUPER_BLOCKS (1)
-#define BITMAP_BLOCKS ((((TOTAL_BLOCKS + 7)/ 8) + BLOCK_SIZE - 1) / BLOCK_SIZE)
-#define BPLUS_LEAF_NODES ((MAX_FILES + ORDER - 2) / (ORDER - 1))
-#define BPLUS_TREE_BLOCKS (BPLUS_LEAF_NODES + BPLUS_INTERNAL_NODES)
-#define ROOT_DIR_BLOCKS ((MAX_FILES + ORDER - 1) / (ORDER - 1))
+// Format-time defaults. The geometry of an image lives in its superblock.
+#define DEFAULT_DISK_SIZE 104857600	// 100MB
+#define DEFAULT_GROWTH_FACTOR 8	// Bitmap reserved for growing the image this many times over
+#define DEFAULT_ORDER 5 // Upper bound set by BLOCK_SIZE, see Superblock::maxOrder()
+#define DEFAULT_MAX_FILES 3000
 
+#define SUPERBLOCK_MAGIC 0x31534656	// "VFS1"
+#define INDEX_MAGIC 0x58444e49	// "INDX", page 0 of the B+ tree region
+#define SUPERBLOCK_VERSION 7
 #define SUPER_BLOCK_START (0)
-#define BITMAP_START (SUPER_BLOCK_START + SUPER_BLOCKS)
-#define BPLUS_TREE_START (BITMAP_START + BITMAP_BLOCKS)
-#define ROOT_DIR_START (BPLUS_TREE_START + BPLUS_TREE_BLOCKS)
-#define DATA_START (ROOT_DIR_START + ROOT_DIR_BLOCKS)
+#define SUPER_BLOCKS (1)
 
 #define PERMISSION_READ 0b100
 #define PERMISSION_WRITE 0b010
@@ -44,6 +41,15 @@
 
 #define USER_NAME_LENGTH 15
 
+#define CACHE_BLOCKS 4096	// 16MB of cached blocks
+#define CACHE_SHARDS 16
+#define CACHE_FLUSH_INTERVAL_MS 1000
+#define SENDFILE_MIN_BYTES (16 * BLOCK_SIZE)	// Smaller extent ranges of a streamed read are copied instead
+#define INDEX_POOL_PAGES 256	// Metadata index pages kept in memory
+
+#define DELAYED_APPEND_FLUSH_BYTES (64 * BLOCK_SIZE)	// Buffered appends per file before blocks are chosen
+#define ALLOCATION_GROUP_BLOCKS 4096	// 16MB per group, a multiple of 64 so groups never share a bitmap word
+
 namespace pr{
     constexpr int computeInternalNodes(int leafNodes, int order) {
         int total = 0, current = leafNodes;
@@ -55,6 +61,5 @@ namespace pr{
         return total;
     }
 }
-constexpr int BPLUS_INTERNAL_NODES = pr::computeInternalNodes(BPLUS_LEAF_NODES, ORDER);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "system.h"
+#include "filesystem.h"
+#include "journaling.h"
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "system.h"
+
+#define EXTENT_NODE_MAGIC 0x31545845	// "EXT1"
+
+// Header of an extent tree node block. Depth 0 nodes hold the file's extents;
+// deeper nodes hold (node block, file blocks covered) pairs, also as Extents.
+struct ExtentNodeHeader {
+	uint32_t magic;
+	uint16_t depth;
+	uint16_t count;
+};
+
+constexpr int EXTENTS_PER_NODE = static_cast<int>((BLOCK_SIZE - sizeof(ExtentNodeHeader)) / sizeof(Extent));
@@ -18,12 +18,23 @@ class FileSystemInterface {
 		
 		// File & Directory Management
 		virtual bool create(const std::string& path, ClientSession* session) = 0;
-		virtual bool create(const std::string& path, const int& fileSize, ClientSession* session) = 0;
+		virtual bool create(const std::string& path, const int64_t& fileSize, ClientSession* session) = 0;
 		virtual std::string read(const std::string& path, ClientSession* session) = 0;
+		virtual std::string read(const std::string& path, int64_t offset, int64_t length, ClientSession* session) = 0;
 		virtual bool write(const std::string& path, const std::string& data, ClientSession* session) = 0;
+		virtual bool write(const std::string& path, int64_t offset, const std::string& data, ClientSession* session) = 0;
 		virtual bool append(const std::string& path, const std::string& data, ClientSession* session) = 0;
 		virtual bool remove(const std::string& path, ClientSession* session) = 0;
 		virtual bool rename(const std::string& oldName, const std::string& newName, ClientSession* session) = 0;
+		virtual bool readStream(const std::string& path, const ReadStream& stream, ClientSession* session) = 0;
+
+		// Open files: the handle caches the lookup and the permission checks
+		virtual int open(const std::string& path, ClientSession* session) = 0;
+		virtual bool close(int handle, ClientSession* session) = 0;
+		virtual void closeAll(ClientSession* session) = 0;
+		virtual std::string hread(int handle, int64_t offset, int64_t length, ClientSession* session) = 0;
+		virtual bool hwrite(int handle, int64_t offset, const std::string& data, ClientSession* session) = 0;
+		virtual void hstat(int handle, ClientSession* session) = 0;
 	
 		virtual bool mkdir(const std::string& path, ClientSession* session) = 0;
 		virtual bool rmdir(const std::string& path, ClientSession* session) = 0;
@@ -52,6 +63,10 @@ class FileSystemInterface {
 		// File Tree
 		virtual void tree(ClientSession* session, const std::string& path, int depth, const std::string& prefix) = 0;
 
+		// Block cache
+		virtual void cacheStats(ClientSession* session) = 0;
+		virtual bool grow(int newSizeMB, ClientSession* session) = 0;
+
 		// LOGS
 		virtual void show() = 0;
 		virtual void bTree() = 0;
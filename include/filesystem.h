@@ -7,6 +7,7 @@
 #include <chrono>
 #include <algorithm>
 #include <cstdint>
+#include <functional>
 
 #include "define.h"
 #include "rollback.h"
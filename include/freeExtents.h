@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "bitmap.h"
+
+// Free space of the data region as maximal runs of clear bitmap bits, indexed
+// both by start block (for coalescing) and by (length, start) (for best fit).
+// Mirrors FATTABLE and is guarded by the same lock.
+class FreeExtentIndex {
+	private:
+		std::map<int64_t, int64_t> byStart; // start -> length
+		std::set<std::pair<int64_t, int64_t>> byLength; // (length, start)
+		int64_t freeBlocks = 0;
+
+		void add(int64_t start, int64_t length);
+		void erase(std::map<int64_t, int64_t>::iterator it);
+		void take(std::map<int64_t, int64_t>::iterator it, int64_t count, std::vector<int64_t>& blocks);
+
+	public:
+		void build(const Bitmap& bitmap, int64_t floor, int64_t limit);
+		void clear();
+
+		// Smallest run that holds count blocks; otherwise the largest runs
+		// first so the request spans as few extents as possible.
+		bool allocate(int64_t count, std::vector<int64_t>& blocks);
+		void release(int64_t start, int64_t length);
+		void release(const std::vector<int64_t>& blocks);
+
+		int64_t available() const { return freeBlocks; }
+		const std::map<int64_t, int64_t>& runs() const { return byStart; } // start -> length
+		size_t extentCount() const { return byStart.size(); }
+		int64_t largestExtent() const { return byLength.empty() ? 0 : byLength.rbegin()->first; }
+};
+
+// Slice of the data region with its own lock and free-run index, so
+// allocations that land in different groups do not contend.
+struct AllocationGroup {
+	std::mutex lock;
+	int64_t start = 0;
+	int64_t end = 0;
+	FreeExtentIndex freeExtents;
+};
@@ -5,4 +5,5 @@
 #include <stdint.h>
 
 std::vector<uint8_t> sha256(const std::string& input);
-int hashFileName(const std::string& fileName);
\ No newline at end of file
+int hashPassword(const std::string& password);
+uint64_t hashName(const std::string& name);
\ No newline at end of file
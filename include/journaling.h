@@ -13,6 +13,7 @@
 
 #define OP_WRITE "WRITE"
 #define OP_WRITE_APPEND "WRITEA"
+#define OP_WRITE_AT "WRITEAT"
 #define OP_CREATE "CREATE"
 #define OP_DELETE_DIR "DELETE DIR"
 #define OP_DELETE_FILE "DELETE FILE"
@@ -27,16 +28,18 @@ struct FileJournaling {
 	std::string fileName;
 	std::string newFileName;
 	int directory;
-	uint32_t fileSize;
+	uint64_t fileSize;
 	std::string data;
 	bool check;
 	bool committed;
+	int64_t offset = 0; // OP_WRITE_AT only
 
 	std::string serialise() const {
 		return user + "|" + std::to_string(timestamp) + "|" +
 		operation + "|" + fileName + "|" + newFileName + "|" +
 		std::to_string(directory) + "|" +
 		data + "|" + std::to_string(fileSize) + "|" +
+		std::to_string(offset) + "|" +
 		(check ? "1" : "0") + "|" +
 		(committed ? "1" : "0");
 	}
@@ -50,7 +53,9 @@ struct FileJournaling {
 			start = pos + 1;
 		}
 		tokens.push_back(line.substr(start));
-		if (tokens.size() != 10)	throw std::runtime_error("Malformed journal entry");
+		// Entries written before offsets were journaled have no offset field
+		if (tokens.size() != 10 && tokens.size() != 11)	throw std::runtime_error("Malformed journal entry");
+		const bool hasOffset = tokens.size() == 11;
 
 		journal.user = tokens[0];
 		journal.timestamp = std::stoull(tokens[1]);
@@ -59,9 +64,10 @@ struct FileJournaling {
 		journal.newFileName = tokens[4];
 		journal.directory = std::stoi(tokens[5]);
 		journal.data = tokens[6];
-		journal.fileSize = std::stoul(tokens[7]);
-		journal.check = (tokens[8] == "1");
-		journal.committed = (tokens[9] == "1");
+		journal.fileSize = std::stoull(tokens[7]);
+		if (hasOffset)	journal.offset = std::stoll(tokens[8]);
+		journal.check = (tokens[hasOffset ? 9 : 8] == "1");
+		journal.committed = (tokens[hasOffset ? 10 : 9] == "1");
 
 		return journal;
 	}
@@ -86,7 +92,7 @@ class JournalManager {
 			journalFilePath = path;
 		};
 		void loadJournal();
-		uint64_t logOperation(std::string user, const std::string& op, const std::string& fileName, const std::string& newFileName, const std::string& data, uint32_t fileSize, const int currentDir);
+		uint64_t logOperation(std::string user, const std::string& op, const std::string& fileName, const std::string& newFileName, const std::string& data, uint64_t fileSize, const int currentDir, int64_t offset = 0);
 		void markCommitted(uint64_t timestamp);
 		void recoverUncommitedOperations(std::string user, ClientSession* session);
 };
@@ -5,37 +5,45 @@
 
 class System;
 
+// The index needs no lock here: BPlusTree latches its own nodes.
 class MetadataManager {
 private:
     System* system;
     BPlusTree bptree;
 
+    // Names are stored truncated, so the key is built from what is stored.
+    static IndexKey keyFor(const std::string& name) {
+        IndexKey key{};
+        strncpy(key.name, name.c_str(), FILE_NAME_LENGTH - 1);
+        key.hash = hashName(key.name);
+        return key;
+    }
+
 public:
-    MetadataManager(System* system, int treeOrder) : system(system), bptree(treeOrder) {};
+    explicit MetadataManager(System* system) : system(system) {};
 
-    int insertFileEntry(const std::string& fileName, const int metaIndex) {
-        int key = hashFileName(fileName);
-        bptree.insert(key, metaIndex);
-        return key;
+    bool insertFileEntry(const std::string& fileName, const int metaIndex) {
+        IndexKey key = keyFor(fileName);
+        return bptree.insert(key, metaIndex);
     }
 
     bool updateIdx(const std::string& fileName, int idx) {
-        int key = hashFileName(fileName);
+        IndexKey key = keyFor(fileName);
         return bptree.update(key, idx);
     }
 
     int getFile(const std::string& fileName) {
-        int key = hashFileName(fileName);
-        return bptree.searchFile(key);
+        IndexKey key = keyFor(fileName);
+        return bptree.search(key);
     }
 
     int getDir(const std::string& dirName) {
-        int key = hashFileName(dirName);
-        return bptree.searchDir(key);
+        IndexKey key = keyFor(dirName);
+        return bptree.search(key);
     }
 
     void removeFileEntry(const std::string& fileName) {
-        int key = hashFileName(fileName);
+        IndexKey key = keyFor(fileName);
         bptree.remove(key);
     }
 
@@ -43,15 +51,25 @@ public:
         bptree.printTree();
     }
 
-    bool loadBPlusTree(std::fstream& disk) {
-        return bptree.loadBPlusTree(disk);
+    bool createIndex(BlockDevice& disk, int64_t startBlock, int64_t blockCount) {
+        return bptree.create(disk, startBlock, blockCount);
+    }
+
+    bool openIndex(BlockDevice& disk, int64_t startBlock, int64_t blockCount) {
+        return bptree.open(disk, startBlock, blockCount);
     }
 
-    void saveBPlusTree(std::fstream& disk) {
-        bptree.saveBPlusTree(disk);
+    // Replaces the index with one built from (name, metadata index) pairs.
+    bool bulkLoadIndex(const std::vector<std::pair<std::string, int>>& names) {
+        std::vector<std::pair<IndexKey, int32_t>> entries;
+        entries.reserve(names.size());
+        for (const auto& [name, metaIndex] : names) {
+            entries.emplace_back(keyFor(name), metaIndex);
+        }
+        return bptree.bulkLoad(entries);
     }
 
-    void deleteBPlusTree() {
-        bptree.deleteTree();
+    bool closeIndex() {
+        return bptree.close();
     }
 };
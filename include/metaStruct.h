@@ -1,58 +1,107 @@
 #pragma once
 
-#include <fstream>
+#include <atomic>
 #include <vector>
-#include <functional>
+#include <string>
+#include <cstdint>
 #include <iostream>
 #include <queue>
-#include <unordered_set>
 #include <cstring>
 #include <algorithm>
+#include <utility>
 #include "define.h"
+#include "blockDevice.h"
+#include "nodePool.h"
 
-struct BPlusTreeNode{
-	int nodeID;
-	bool isLeaf;
-	std::vector<int> keys;
-	BPlusTreeNode* parent;
+// Index key: a 64-bit hash of the name, and the name itself (NUL padded, as
+// in a directory entry) so that names whose hashes collide stay distinct.
+// Keys order by hash, then by name.
+struct IndexKey {
+	uint64_t hash;
+	char name[FILE_NAME_LENGTH];
+};
+
+// Nodes are one block each and hold as many keys as fit, so the tree order of
+// the superblock only shapes the directory table. Each array is contiguous,
+// and the hashes come first so a search reads only the cache lines of one
+// array.
+struct IndexPageHeader {
+	uint16_t isLeaf;
+	uint16_t count;
+	int32_t next; // Next leaf, or -1
+};
 
-	std::vector<BPlusTreeNode*> children;
+constexpr int LEAF_KEYS = (BLOCK_SIZE - sizeof(IndexPageHeader)) / (sizeof(uint64_t) + sizeof(int32_t) + FILE_NAME_LENGTH);
+constexpr int INTERNAL_KEYS = (BLOCK_SIZE - sizeof(IndexPageHeader) - sizeof(int32_t)) / (sizeof(uint64_t) + sizeof(int32_t));
 
-	std::vector<int> values;
-	BPlusTreeNode* nextLeaf;
+// Maps count keys to metadata indexes. Names sharing a hash are kept in one
+// leaf, ordered by name.
+struct LeafPage : IndexPageHeader {
+	uint64_t hashes[LEAF_KEYS];
+	int32_t slots[LEAF_KEYS];
+	char names[LEAF_KEYS][FILE_NAME_LENGTH];
+};
+
+// count separator hashes and count + 1 child pages; a hash equal to a
+// separator belongs to the child on its right.
+struct InternalPage : IndexPageHeader {
+	uint64_t hashes[INTERNAL_KEYS];
+	int32_t children[INTERNAL_KEYS + 1];
+};
+static_assert(sizeof(LeafPage) <= BLOCK_SIZE && sizeof(InternalPage) <= BLOCK_SIZE, "An index page must fit in a block");
 
-	BPlusTreeNode() : isLeaf(false), parent(nullptr), nextLeaf(nullptr) {}
+// Page 0 of the region. Pages after it are handed out in order and are not
+// reused until the index is rebuilt.
+struct IndexHeader {
+	uint32_t magic;
+	uint32_t clean; // Set by an orderly shutdown; cleared while mounted
+	int32_t root;
+	int32_t pageCount; // Pages in use, this one included
 };
 
+// Safe to call from many threads at once, through optimistic lock coupling
+// on the version latch of each node's frame. Readers take no latch: they note
+// a node's version, read the node, and start over if the version has moved.
+// Writers latch only the leaf they change, and its parent when it splits;
+// full internal nodes are split on the way down, so a split never climbs.
+// create, open, flush and close run with no other callers.
 class BPlusTree {
 	private:
-		int order;
-		int nodes = 0;
-		BPlusTreeNode* root;
-		
-		BPlusTreeNode* findLeafNode(int key);
-
-		void splitLeafNode(BPlusTreeNode* leaf);
-		void insertInternal(int middleKey, BPlusTreeNode* leftChild, BPlusTreeNode* rightChild);
-		void splitInternalNode(BPlusTreeNode* parent);
-		
-		void handleLeafUnderflow(BPlusTreeNode* leaf);
-		void mergeLeafNodes(BPlusTreeNode* leaf);
-		void handleInternalUnderflow(BPlusTreeNode* node);
-	
+		enum class Outcome { Done, Restart, Failed };
+		enum class LeafChange { Update, Remove };
+		class PageRef;
+
+		NodePool pool;
+		BlockDevice* disk = nullptr;
+		int64_t startBlock = 0;
+		int64_t blockCount = 0;
+		uint32_t clean = 0;
+		std::atomic<int32_t> root{1};
+		std::atomic<int32_t> pageCount{0};
+		std::atomic<uint64_t> rootLatch{0}; // Stands in for the parent of the root node
+
+		int32_t allocatePage();
+		bool writeHeader();
+		Outcome descend(uint64_t hash, PageRef& leaf, uint64_t& version);
+		Outcome tryInsert(const IndexKey& key, int32_t metaIndex);
+		Outcome tryChange(const IndexKey& key, LeafChange change, int32_t metaIndex, bool& found);
+		Outcome trySearch(const IndexKey& key, int& result);
+		Outcome splitLeaf(PageRef& parent, PageRef& node, const IndexKey& key, int32_t metaIndex);
+		Outcome splitInternal(PageRef& parent, PageRef& node);
+		bool addSeparator(PageRef& parent, int32_t newRoot, int32_t left, uint64_t separator, int32_t right);
+
 	public:
-		explicit BPlusTree(int order);
-		// ~BPlusTree();
-	
-		int saveBPlusTree(std::fstream &disk);
-		int loadBPlusTree(std::fstream &disk);
-
-		void insert(int key, const int metaIndex);
-		bool update(int key, int idx);
-		int searchFile(int key);
-		int searchDir(int key);
-		void remove(int key);
+		BPlusTree();
+
+		bool create(BlockDevice& disk, int64_t startBlock, int64_t blockCount);
+		bool open(BlockDevice& disk, int64_t startBlock, int64_t blockCount);
+		bool flush();
+		bool close();
+		bool bulkLoad(std::vector<std::pair<IndexKey, int32_t>>& entries);
+
+		bool insert(const IndexKey& key, const int metaIndex);
+		bool update(const IndexKey& key, int idx);
+		int search(const IndexKey& key);
+		bool remove(const IndexKey& key);
 		void printTree();
-		
-		void deleteTree();
 };
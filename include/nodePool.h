@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "define.h"
+
+class BlockDevice;
+
+// A pinned page: its frame's bytes and the version latch guarding them.
+struct PinnedPage {
+	char* data = nullptr;
+	std::atomic<uint64_t>* latch = nullptr;
+};
+
+// Fixed set of BLOCK_SIZE frames holding pages of one region of the image.
+// A page stays put while pinned; unpinned pages are evicted least recently
+// used first, and a dirty page is written back when evicted or on flush().
+// Each frame carries a version latch for its users; the pool never takes it.
+class NodePool {
+	private:
+		struct Frame {
+			alignas(8) char data[BLOCK_SIZE];
+			std::atomic<uint64_t> latch{0};
+			int64_t page = -1;
+			bool dirty = false;
+			int pins = 0;
+			std::list<size_t>::iterator lruPosition;
+		};
+
+		BlockDevice* device = nullptr;
+		int64_t firstBlock = 0;
+		size_t frameCount;
+		std::unique_ptr<Frame[]> frames;
+		std::vector<size_t> freeFrames;
+		std::unordered_map<int64_t, size_t> pageTable;
+		std::list<size_t> lru; // Unpinned frames, most recently used at the front
+		std::mutex lock;
+
+		bool writeBack(Frame& frame);
+		bool evict();
+
+	public:
+		explicit NodePool(size_t capacity);
+		NodePool(const NodePool&) = delete;
+		NodePool& operator=(const NodePool&) = delete;
+
+		void attach(BlockDevice& device, int64_t firstBlock);
+		PinnedPage pin(int64_t page, bool load);
+		void unpin(int64_t page, bool dirty);
+		bool flush();
+		void clear();
+};
@@ -1,33 +1,92 @@
 #pragma once
 
 #include "define.h"
+#include <functional>
 #include <sstream>
+#include <sys/types.h>
 
+// Geometry chosen when a new image is formatted; ignored for existing images.
+struct FormatOptions{
+	uint64_t diskSize = DEFAULT_DISK_SIZE;
+	uint64_t maxDiskSize = 0; // Largest size the image can grow to; 0 means DEFAULT_GROWTH_FACTOR * diskSize
+	int maxFiles = DEFAULT_MAX_FILES;
+	int order = DEFAULT_ORDER;
+};
+// Region starts and lengths are in blocks.
 struct Superblock{
+	uint32_t magic;
+	uint32_t version;
+	int blockSize;
+	int maxFiles;
+	int order;
+	int64_t totalBlocks;
+	int64_t freeBlocks;
+	int64_t maxBlocks; // Growth limit: blocks the bitmap region can describe
+	int64_t bitmapStart;
+	int64_t bitmapBlocks;
+	int64_t bplusTreeStart;
+	int64_t bplusTreeBlocks;
+	int64_t rootDirStart;
+	int64_t rootDirBlocks;
+	int64_t dataStart;
+
+	bool layout(const FormatOptions& options, std::string& error);
+	static int maxOrder();
+	int entriesPerDirBlock() const { return order - 1; }
+	size_t dirSlotSize() const;
+	int64_t inlineDataCapacity() const;
+};
+// Version 1 superblock, with 32-bit block numbers.
+struct SuperblockV1{
+	uint32_t magic;
+	uint32_t version;
+	int blockSize;
+	int totalBlocks;
+	int freeBlocks;
+	int maxBlocks;
+	int maxFiles;
+	int order;
+	int bitmapStart;
+	int bitmapBlocks;
+	int bplusTreeStart;
+	int bplusTreeBlocks;
+	int rootDirStart;
+	int rootDirBlocks;
+	int dataStart;
+};
+// Superblock written before the geometry was recorded; users follow it directly.
+struct LegacySuperblock{
 	int totalBlocks;
 	int freeBlocks;
 	int blockSize;
 	int fatStart;
 	int dataStart;
 };
+// Per-mount choices made when the server starts.
+struct MountOptions{
+	bool mapImage = false; // mmap the image instead of pread/pwrite through the block cache
+	size_t cacheBlocks = CACHE_BLOCKS;
+	size_t cacheShards = CACHE_SHARDS;
+	FormatOptions format;
+};
 struct Extent{
-	int startBlock;
-	int length;
+	int64_t startBlock;
+	int64_t length;
 
 	Extent(){
-		for (int i = 0; i < MAX_EXTENTS; i++){
-			startBlock = -1;
-			length = 0;
-		}
+		startBlock = -1;
+		length = 0;
 	}
+	Extent(int64_t startBlock, int64_t length) : startBlock(startBlock), length(length) {}
 };
 
 struct SerializableFileEntry;
+struct SerializableFileEntryV1;
 struct FileEntry{
 	char fileName[FILE_NAME_LENGTH];
-	int fileSize;
-	int numExtents;
-	Extent extents[MAX_EXTENTS];
+	int64_t fileSize;
+	std::vector<Extent> extents; // Every extent of the file in file order; change through the block helpers below
+	std::vector<int64_t> extentStarts; // First file block of each extent, for binary search
 	bool isDirectory;
 	int parentIndex;
 	int dirID;
@@ -40,30 +99,56 @@ struct FileEntry{
 	uint32_t group_id;
     uint16_t permissions;
 	uint8_t attributes;
+	bool unwritten = false; // In memory only: blocks allocated by create and never written read as zeros
+	bool hasInlineData = false; // Contents live in inlineData, inside the directory entry; no blocks
+	std::string inlineData;
+
+	// Extent tree as last stored: the inline root of the directory entry and the
+	// index blocks under it, leaves first, level by level. Brought up to date
+	// from extents on save when extentsDirty.
+	uint8_t extentDepth = 0;
+	int rootCount = 0;
+	Extent extentRoot[INLINE_EXTENTS];
+	std::vector<int64_t> extentIndexBlocks;
+	bool extentsDirty = false;
+	int storedExtents = 0; // Extents the stored tree holds
+	int dirtyExtent = 0; // First extent changed since the tree was stored
 
 	std::mutex lockMutex;
 	int readerCount = 0;
 	bool isWriteLocked = false;
 	int writersWaiting = 0;
-	int openCount = 0;
+	int openCount = 0; // Operations and handles that have the entry open
+	int handleCount = 0; // Of openCount, the opens held by file handles; only these block a delete
+	bool deleting = false; // Set under lockMutex by a delete that claimed the entry; nothing may open it after
 	std::condition_variable readerCV;
     std::condition_variable writerCV;
 
-	FileEntry() : fileSize(0), numExtents(0), extents(), isDirectory(false), parentIndex(-1), dirID(-1), created_at(0), modified_at(0), accessed_at(0),
+	FileEntry() : fileSize(0), isDirectory(false), parentIndex(-1), dirID(-1), created_at(0), modified_at(0), accessed_at(0),
 		owner_id(-1), group_id(-1), permissions(0640), attributes(0) {
 			fileName[0] = '\0';
 		}
-	FileEntry(const std::string &name) : fileSize(0), numExtents(0), isDirectory(false), parentIndex(-1), dirID(-1), created_at(0), modified_at(0), accessed_at(0),
+	FileEntry(const std::string &name) : fileSize(0), isDirectory(false), parentIndex(-1), dirID(-1), created_at(0), modified_at(0), accessed_at(0),
 		owner_id(-1), group_id(-1), permissions(0640), attributes(0) {
 			strncpy(fileName, name.c_str(), sizeof(fileName));
 			fileName[sizeof(fileName) - 1] = '\0';
-			for (int i = 0; i < MAX_EXTENTS; ++i)	extents[i] = Extent();
 		}
 	explicit FileEntry(const SerializableFileEntry& file);
+	explicit FileEntry(const SerializableFileEntryV1& file);
+
+	int numExtents() const { return static_cast<int>(extents.size()); }
+	int64_t blockCount() const { return extents.empty() ? 0 : extentStarts.back() + extents.back().length; }
+	int64_t lastBlock() const { return extents.empty() ? -1 : extents.back().startBlock + extents.back().length - 1; }
+	size_t findExtent(int64_t fileBlock) const;
+	int64_t physicalBlock(int64_t fileBlock) const;
+	void setExtents(std::vector<Extent> newExtents);
+	void addBlocks(const std::vector<int64_t>& blocks);
+	std::vector<int64_t> truncateBlocks(int64_t keepBlocks);
+	std::vector<int64_t> allBlocks() const;
 };
 struct SerializableFileEntry {
 	char fileName[FILE_NAME_LENGTH];
-	int size;
+	int64_t size;
 	int created_at;
 	int modified_at;
 	int accessed_at;
@@ -71,18 +156,40 @@ struct SerializableFileEntry {
 	uint32_t group_id;
     uint16_t permissions;
 	uint8_t attributes;
+	uint8_t extentDepth; // 0: extents are the file's own; EXTENT_DEPTH_INLINE: data; otherwise they point at extent tree nodes
 	int extentCount;
 	bool isDirectory;
 	int parentIndex;
 	int dirID;
-	Extent extents[MAX_EXTENTS];
+	Extent extents[INLINE_EXTENTS]; // Inline data starts here and runs to the end of the directory slot
 
-	SerializableFileEntry() : size(0), created_at(0), modified_at(0), accessed_at(0), owner_id(-1), group_id(-1), permissions(0640), attributes(0), extentCount(0), isDirectory(false), parentIndex(-1), dirID(-1), extents() {
+	SerializableFileEntry() : size(0), created_at(0), modified_at(0), accessed_at(0), owner_id(-1), group_id(-1), permissions(0640), attributes(0), extentDepth(0), extentCount(0), isDirectory(false), parentIndex(-1), dirID(-1), extents() {
 		fileName[0] = '\0';
 	};
 
 	explicit SerializableFileEntry(const FileEntry& file);
 };
+// Root directory entry of version 0 and 1 images, read only to upgrade them.
+struct SerializableFileEntryV1 {
+	struct Extent{
+		int startBlock;
+		int length;
+	};
+	char fileName[FILE_NAME_LENGTH];
+	int size;
+	int created_at;
+	int modified_at;
+	int accessed_at;
+	uint32_t owner_id;
+	uint32_t group_id;
+    uint16_t permissions;
+	uint8_t attributes;
+	int extentCount;
+	bool isDirectory;
+	int parentIndex;
+	int dirID;
+	Extent extents[INLINE_EXTENTS];
+};
 
 struct User {
     char userName[USER_NAME_LENGTH];
@@ -97,12 +204,32 @@ struct User {
 	}
 };
 
+// An open file: resolved once by open, then used without a lookup.
+struct FileHandle {
+	FileEntry* file = nullptr;
+	int fileIndex = -1;
+	bool canRead = false;
+	bool canWrite = false;
+};
+
+// Receives a streamed read: start() once with the total length, then write()
+// with the data in order. Returning false from any of them stops the read.
+// When sendFile is set, large contiguous ranges are handed to it as a range
+// of the image file instead of being copied through write().
+struct ReadStream {
+	std::function<bool(int64_t total)> start;
+	std::function<bool(const char* data, size_t length)> write;
+	std::function<bool(int fd, off_t offset, size_t length)> sendFile;
+};
+
 struct ClientSession {
 	bool active;
 	User user;
 	int currentDirectory;
 	std::string msg;
 	std::ostringstream oss;
+	std::unordered_map<int, FileHandle> handles; // Open files, by handle number
+	int nextHandle = 1;
 
 	ClientSession() {
 		active = true;
@@ -9,6 +9,9 @@
 
 #include "structs.h"
 #include "define.h"
+#include "blockDevice.h"
+#include "bitmap.h"
+#include "freeExtents.h"
 #include "journaling.h"
 #include "metaDataManager.h"
 
@@ -16,6 +19,15 @@ class JournalManager;
 class MetadataManager;
 struct FileJournaling;
 
+// Appended data not yet given blocks. The space is reserved up front and the
+// journal entries stay uncommitted until the data reaches the image.
+struct DelayedAppend {
+	FileEntry* file = nullptr;
+	std::string data;
+	int64_t reservedBlocks = 0;
+	std::vector<uint64_t> timestamps;
+};
+
 class System final : public FileSystemInterface {
 private:
 	std::shared_mutex FATMutex;
@@ -30,9 +42,17 @@ private:
 	std::shared_mutex metaIndexMutex;
 
 	std::string DISK_PATH;
-	std::vector<bool> FATTABLE; // Shared
+	BlockDevice device; // Shared, open for the lifetime of the mount
+	Bitmap FATTABLE; // Shared
+	std::vector<std::unique_ptr<AllocationGroup>> allocationGroups; // Shared, word-aligned slices of FATTABLE
 	std::vector<FileEntry*> metaDataTable; // Shared
 	Superblock superblock; // Shared
+	FormatOptions formatOptions; // Used only if the image has to be formatted
+	off_t usersOffset = sizeof(Superblock); // User table position within the superblock block
+	uint32_t imageVersion = SUPERBLOCK_VERSION; // Format of the image as found on disk
+	std::mutex delayedMutex;
+	std::unordered_map<int, DelayedAppend> delayedAppends; // Shared, keyed by metaDataTable index
+	std::atomic<int64_t> reservedBlocks{0}; // Shared, held by delayedAppends
 	std::vector<User*> userDatabase; // Shared
 	std::unordered_map<uint32_t, std::string> userTable; // Shared
 	std::unordered_map<uint32_t, std::string> groupTable; // Shared
@@ -48,23 +68,33 @@ private:
 	int availableDirEntry = 1; // Shared
 	int metaIndex = 0; // Shared
 
-	friend void createFile(System& fs, ClientSession* session, std::fstream &disk, const std::string &fileName, const int &fileSize,  FileEntry* newFile, const int& index, uint16_t permissions);
-	friend void writeFileData(System& fs, ClientSession* session, std::fstream &disk, FileEntry* file, const int fileIndex, const std::string &fileContent, bool append);
-	std::string readFileData(std::fstream &disk, FileEntry* file, ClientSession* session);
-	friend void deleteFile(System& fs, ClientSession* session, std::fstream &disk, FileEntry* file, const int fileInd);
+	friend void createFile(System& fs, ClientSession* session, BlockDevice &disk, const std::string &fileName, const int64_t &fileSize,  FileEntry* newFile, const int& index, uint16_t permissions);
+	friend void writeFileData(System& fs, ClientSession* session, BlockDevice &disk, FileEntry* file, const int fileIndex, const std::string &fileContent, bool append, int64_t reserved);
+	friend void writeFileRange(System& fs, ClientSession* session, BlockDevice &disk, FileEntry* file, const int fileIndex, const int64_t offset, const std::string &data);
+	std::string readFileData(BlockDevice &disk, FileEntry* file, ClientSession* session);
+	bool readFileRange(BlockDevice &disk, FileEntry* file, int64_t offset, int64_t length, std::string &content, ClientSession* session);
+	bool streamFileData(BlockDevice &disk, FileEntry* file, const ReadStream &stream, ClientSession* session);
+	friend void deleteFile(System& fs, ClientSession* session, BlockDevice &disk, FileEntry* file, const int fileInd);
 	
-	bool loadBitMap(std::fstream &disk);
-	int saveBitMap(std::fstream &disk);
-	std::vector<int> allocateBitMapBlocks(std::fstream &disk, int numBlocks, ClientSession* session);
-	void freeBitMapBlocks(std::fstream &disk, const std::vector<int> &blocks);
-	bool loadDirectoryTable(std::fstream &disk);
-	int saveDirectoryTable(std::fstream &disk, int index, ClientSession* session);
-	int saveDirectoryTableEntire(std::fstream &disk);
-	bool loadSuperblock(std::fstream &disk);
-	int saveSuperblock(std::fstream &disk);
-	int saveUsers(std::fstream& disk);
-	bool loadUsers(std::fstream& disk);
+	bool loadBitMap(BlockDevice &disk);
+	int saveBitMap(BlockDevice &disk);
+	int flushBitMap(BlockDevice &disk);
+	void buildAllocationGroups();
+	std::vector<int64_t> allocateBitMapBlocks(int64_t numBlocks, ClientSession* session, int groupHint = -1);
+	int groupOf(int64_t block) const { return static_cast<int>(block / ALLOCATION_GROUP_BLOCKS - superblock.dataStart / ALLOCATION_GROUP_BLOCKS); }
+	int64_t freeBitMapBlocks(const std::vector<int64_t> &blocks);
+	bool discardFreeBlocks();
+	bool loadExtentTree(BlockDevice &disk, FileEntry* file);
+	bool storeExtentTree(BlockDevice &disk, FileEntry* file, ClientSession* session, std::vector<int64_t> &staleBlocks);
+	bool loadDirectoryTable(BlockDevice &disk, bool* entriesMoved = nullptr);
+	int saveDirectoryTable(BlockDevice &disk, int index, ClientSession* session);
+	int saveDirectoryTableEntire(BlockDevice &disk);
+	bool loadSuperblock(BlockDevice &disk);
+	int saveSuperblock(BlockDevice &disk);
+	int saveUsers(BlockDevice& disk);
+	bool loadUsers(BlockDevice& disk);
 	
+	friend bool initialiseDisk(System& fs, const std::string& diskName);
 	friend bool initialiseSuperblock(System& fs);
 	friend bool initialiseFAT(System& fs);
 	friend bool initialiseFileEntries(System& fs);
@@ -75,7 +105,7 @@ private:
 	void saveInDisk();
 
 	bool createDirectory(const std::string &directoryName, ClientSession* session);
-	FileEntry* resolvePath(std::fstream &disk, const std::string &path, ClientSession* session);
+	FileEntry* resolvePath(BlockDevice &disk, const std::string &path, ClientSession* session);
 	bool changeDirectory(const std::string &dirName, ClientSession* session);
 	std::string createPathM(ClientSession* session);
 
@@ -91,25 +121,48 @@ private:
 	void showGroupsM(ClientSession* session);
 	void treeM(ClientSession* session, const std::string& path = "/", int depth = 0, const std::string& prefix = "");
 	std::vector<FileEntry*> getDirectoryEntries(FileEntry* dir, ClientSession* session);
+	void cacheStatsM(ClientSession* session);
+	bool growM(int newSizeMB, ClientSession* session);
 	
 	// friend bool hasPermission(System& fs, const FileEntry& file, uint32_t user_id, uint32_t group_id, int permission_type);
-	friend int setAttributes(System& fs, std::fstream& disk, const std::string& fileName, int attribute, ClientSession* session);
-	friend int clearAttributes(System& fs, std::fstream& disk, const std::string& fileName, int attribute, ClientSession* session);
+	friend int setAttributes(System& fs, BlockDevice& disk, const std::string& fileName, int attribute, ClientSession* session);
+	friend int clearAttributes(System& fs, BlockDevice& disk, const std::string& fileName, int attribute, ClientSession* session);
 	// friend std::string getAttributeString(System& fs, const FileEntry* file);
 	// friend std::string permissionToString(System& fs, FileEntry* entry);
 	
 	std::string readData(const std::string& fileName, ClientSession* session);
+	std::string readDataAt(const std::string& fileName, int64_t offset, int64_t length, ClientSession* session);
 	bool writeData(const std::string &fileName, const std::string &fileContent, bool append, ClientSession* session, const bool check = false, uint64_t timestamp = 0, FileJournaling* entry = nullptr);
+	bool writeDataAt(const std::string &fileName, int64_t offset, const std::string &fileContent, ClientSession* session, const bool check = false, uint64_t timestamp = 0, FileJournaling* entry = nullptr);
 	bool deleteDataFile(const std::string &fileName, ClientSession* session, const bool check = false, uint64_t timestamp = 0, FileJournaling* entry = nullptr);
 	bool deleteDataDir(const std::string &fileName, ClientSession* session, const bool check = false, uint64_t timestamp = 0, FileJournaling* entry = nullptr);
-	bool createFiles(const std::string& fileName, ClientSession* session, const int& fileSize = BLOCK_SIZE, uint16_t permissions = 0644, const bool check = false, uint64_t timestamp = 0, FileJournaling* entry = nullptr);
+	bool createFiles(const std::string& fileName, ClientSession* session, const int64_t& fileSize = 0, uint16_t permissions = 0644, const bool check = false, uint64_t timestamp = 0, FileJournaling* entry = nullptr);
+	bool readDataStream(const std::string& fileName, const ReadStream& stream, ClientSession* session);
+	int openHandle(const std::string& fileName, ClientSession* session);
+	bool closeHandle(int handle, ClientSession* session);
+	void closeAllHandles(ClientSession* session);
+	std::string readHandle(int handle, int64_t offset, int64_t length, ClientSession* session);
+	bool writeHandle(int handle, int64_t offset, const std::string& data, ClientSession* session);
+	void statHandle(int handle, ClientSession* session);
+	FileHandle* findHandle(int handle, ClientSession* session);
+	void describeFile(FileEntry* entry, ClientSession* session);
 	bool renameFiles(const std::string &fileName, const std::string &newName, ClientSession* session, const bool check = false, uint64_t timestamp = 0, FileJournaling* entry = nullptr);
 	bool recursiveDelete(const std::string& filename, ClientSession* session);
 	void list(ClientSession* session);
 	void fileMetadata(const std::string& fileName, ClientSession* session);
 
-	void rollbackMetadataIndex(std::fstream &disk, Superblock &originalSuperblock, int orgIndex, std::vector<int> &newlyAllocatedBlocks);
-	void rollbackMetadataOrg(std::fstream &disk, Superblock &originalSuperblock, FileEntry* orgFileEntry, int orgIndex, std::vector<int> &newlyAllocatedBlocks);
+	int64_t availableBlocks();
+	void adjustFreeBlocks(int64_t delta);
+	bool bufferAppend(int fileIndex, FileEntry* file, const std::string& data, uint64_t timestamp, ClientSession* session);
+	size_t pendingBytes(int fileIndex);
+	size_t pendingBytes(const FileEntry* file);
+	bool flushDelayedAppend(int fileIndex, FileEntry* file, ClientSession* session);
+	void discardDelayedAppend(int fileIndex);
+	void flushAllDelayedAppends();
+
+	void releaseRolledBackBlocks(bool blocksCounted, std::vector<int64_t> &newlyAllocatedBlocks);
+	void rollbackMetadataIndex(BlockDevice &disk, bool blocksCounted, int orgIndex, std::vector<int64_t> &newlyAllocatedBlocks);
+	void rollbackMetadataOrg(BlockDevice &disk, bool blocksCounted, FileEntry* orgFileEntry, int orgIndex, std::vector<int64_t> &newlyAllocatedBlocks);
 
 	int extractPath(const std::string& path, int& currentIndex, ClientSession* session);
 
@@ -117,7 +170,7 @@ public:
 	JournalManager* journalManager;
 	MetadataManager* Entries;
 
-    explicit System(const std::string& diskPath);
+    explicit System(const std::string& diskPath, const MountOptions& options = MountOptions());
     ~System();
 	
 	std::string createPath(ClientSession* session) override;
@@ -125,12 +178,21 @@ public:
     // void format() override;
 	bool load() override;
 	bool create(const std::string& path, ClientSession* session) override;
-	bool create(const std::string& path, const int& fileSize, ClientSession* session) override;
+	bool create(const std::string& path, const int64_t& fileSize, ClientSession* session) override;
 	std::string read(const std::string& path, ClientSession* session) override;
+	std::string read(const std::string& path, int64_t offset, int64_t length, ClientSession* session) override;
 	bool write(const std::string& path, const std::string& data, ClientSession* session) override;
+	bool write(const std::string& path, int64_t offset, const std::string& data, ClientSession* session) override;
 	bool append(const std::string& path, const std::string& data, ClientSession* session) override;
 	bool remove(const std::string& path, ClientSession* session) override;
 	bool rename(const std::string& oldName, const std::string& newName, ClientSession* session) override;
+	bool readStream(const std::string& path, const ReadStream& stream, ClientSession* session) override;
+	int open(const std::string& path, ClientSession* session) override;
+	bool close(int handle, ClientSession* session) override;
+	void closeAll(ClientSession* session) override;
+	std::string hread(int handle, int64_t offset, int64_t length, ClientSession* session) override;
+	bool hwrite(int handle, int64_t offset, const std::string& data, ClientSession* session) override;
+	void hstat(int handle, ClientSession* session) override;
 	bool mkdir(const std::string& path, ClientSession* session) override;
 	bool rmdir(const std::string& path, ClientSession* session) override;
 	bool rmrdir(const std::string& path, ClientSession* session) override;
@@ -146,6 +208,8 @@ public:
 	void showUsers(ClientSession* session) override;
 	void showGroups(ClientSession* session) override;
 	void tree(ClientSession* session, const std::string& path = "/", int depth = 0, const std::string& prefix = "") override;
+	void cacheStats(ClientSession* session) override;
+	bool grow(int newSizeMB, ClientSession* session) override;
 
 	// LOGS
 	void show() override;
@@ -44,14 +44,18 @@ CommandLineInterface::CommandLineInterface(VFSManager* filesys, const std::strin
 }
 
 std::string CommandLineInterface::runCLI(std::string buffer, ClientSession* session) {
-	std::string input = buffer;
+	return runCommand(parseInput(buffer), session);
+}
+
+// args[0] is the command name. Requests arrive from the client already split
+// into arguments, so they skip parseInput.
+std::string CommandLineInterface::runCommand(const std::vector<std::string>& args, ClientSession* session) {
 	// std::string path = vfs->createPath();
 	// while (true) {
 	// path = vfs->createPath();
 	// int del = path.find(')');
 	// std::string newPath = path.substr(0, del) + '@' + FSName + path.substr(del);
 	// std::cout << newPath << " > ";
-	auto args = parseInput(input);
 	if (args.empty())	return "";
 
 	const std::string& cmd = args[0];
@@ -83,13 +87,14 @@ std::string CommandLineInterface::runCLI(std::string buffer, ClientSession* sess
 		// return vfs->get_msg();
 	}
 	else if (cmd == "create" && args.size() == 3) {
-		vfs->create(args[1], std::stoi(args[2]), session);
+		vfs->create(args[1], std::stoll(args[2]), session);
 		// return vfs->get_msg();
 	}
     else if (cmd == "write" && args.size() == 3) {
 		vfs->write(args[1], args[2], session);
 		// return vfs->get_msg();
 	}
+	else if (cmd == "write" && args.size() == 4)	vfs->write(args[1], std::stoll(args[2]), args[3], session);
     else if (cmd == "append" && args.size() == 3) {
 		vfs->append(args[1], args[2], session);
 		// return vfs->get_msg();
@@ -97,6 +102,21 @@ std::string CommandLineInterface::runCLI(std::string buffer, ClientSession* sess
     else if (cmd == "read" && args.size() == 2) {
 		return vfs->read(args[1], session);
 	}
+	else if (cmd == "read" && args.size() == 4) {
+		std::string content = vfs->read(args[1], std::stoll(args[2]), std::stoll(args[3]), session);
+		if (!content.empty())	return content + '\n';
+	}
+	else if (cmd == "open" && args.size() == 2) {
+		int handle = vfs->open(args[1], session);
+		if (handle != -1)	return "Handle: " + std::to_string(handle) + '\n';
+	}
+	else if (cmd == "close" && args.size() == 2)	vfs->close(std::stoi(args[1]), session);
+	else if (cmd == "hread" && args.size() == 4) {
+		std::string content = vfs->hread(std::stoi(args[1]), std::stoll(args[2]), std::stoll(args[3]), session);
+		if (!content.empty())	return content + '\n';
+	}
+	else if (cmd == "hwrite" && args.size() == 4)	vfs->hwrite(std::stoi(args[1]), std::stoll(args[2]), args[3], session);
+	else if (cmd == "hstat" && args.size() == 2)	vfs->hstat(std::stoi(args[1]), session);
 	else if (cmd == "rm" && args.size() == 2) {
 		vfs->remove(args[1], session);
 		// vfs->get_msg();
@@ -122,6 +142,8 @@ std::string CommandLineInterface::runCLI(std::string buffer, ClientSession* sess
 	else if (cmd == "showusr" && args.size() == 1)	vfs->showUsers(session);
 	else if (cmd == "showgrp" && args.size() == 1)	vfs->showGroups(session);
 	else if (cmd == "tree" && args.size() == 1)	vfs->tree(session);
+	else if (cmd == "cachestat" && args.size() == 1)	vfs->cacheStats(session);
+	else if (cmd == "grow" && args.size() == 2)	vfs->grow(std::stoi(args[1]), session);
 	else if (cmd == "btree" && args.size() == 1)	vfs->bTree();
 	else if (cmd == "show" && args.size() == 1) {
 		vfs->show();
@@ -133,3 +155,13 @@ std::string CommandLineInterface::runCLI(std::string buffer, ClientSession* sess
 	// }
 	return "";
 }
+
+// Whole-file reads are streamed to the client instead of going through runCommand.
+bool CommandLineInterface::isStreamed(const std::vector<std::string>& args) {
+	return args.size() == 2 && args[0] == "read";
+}
+
+bool CommandLineInterface::streamCLI(const std::vector<std::string>& args, const ReadStream& stream, ClientSession* session) {
+	if (!isStreamed(args))	return false;
+	return vfs->readStream(args[1], stream, session);
+}
@@ -1,14 +1,96 @@
 #include "UNIX/ipc_client.h"
 #include "UNIX/ipc_server.h"
-#include <limits>
+#include <thread>
 
-void run_client() {
+// Prints a response's payload as it arrives, so long reads show up at once.
+static bool print_response(int data_socket, uint32_t expectedId) {
+	ResponseHeader header;
+	if (!readFull(data_socket, &header, sizeof(header)))	return false;
+	if (header.requestId != expectedId)
+		std::cerr << "Warning: expected the response to request " << expectedId << ", got " << header.requestId << ".\n";
+
+	std::vector<char> buffer(BUFFER_SIZE);
+	uint64_t received = 0;
+	while (received < header.length) {
+		const size_t chunk = static_cast<size_t>(std::min<uint64_t>(BUFFER_SIZE, header.length - received));
+		ssize_t bytes = read(data_socket, buffer.data(), chunk);
+		if (bytes == -1 && errno == EINTR)	continue;
+		if (bytes <= 0)	return false;
+		std::cout.write(buffer.data(), bytes);
+		received += static_cast<uint64_t>(bytes);
+	}
+	std::cout.flush();
+	return true;
+}
+
+static std::string encode_line(uint32_t requestId, const std::string& line) {
+	std::vector<std::string> args = parseInput(line);
+	const uint16_t opcode = opcodeFor(args.front());
+	args.erase(args.begin());
+	return encodeRequest(requestId, opcode, args);
+}
+
+// Each command goes out together with the request for the next prompt, so a
+// command costs one round trip.
+static void run_interactive(int data_socket) {
+	uint32_t nextId = 0;
+	std::string frame = encodeRequest(nextId, OPCODE_PATH, {});
+	if (!writeFull(data_socket, frame.data(), frame.size()) || !print_response(data_socket, nextId++)) {
+		perror("read");
+		exit(EXIT_FAILURE);
+	}
+
+	std::string line;
+	while (true) {
+		std::cout << " >> ";
+		std::cout.flush();
+		if (!std::getline(std::cin, line) || line == "exit")	break;
+
+		frame.clear();
+		const bool command = !parseInput(line).empty();
+		const uint32_t commandId = nextId;
+		if (command)	frame = encode_line(nextId++, line);
+		const uint32_t pathId = nextId++;
+		frame += encodeRequest(pathId, OPCODE_PATH, {});
+		if (!writeFull(data_socket, frame.data(), frame.size())) {
+			perror("write");
+			exit(EXIT_FAILURE);
+		}
+		if ((command && !print_response(data_socket, commandId)) || !print_response(data_socket, pathId)) {
+			std::cerr << "Connection to the server lost.\n";
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// Batch mode: every line of stdin is sent without waiting for earlier
+// replies. Replies are printed as they arrive, which is the order of the lines.
+static void run_batch(int data_socket) {
+	std::thread sender([data_socket] {
+		uint32_t nextId = 0;
+		std::string line;
+		while (std::getline(std::cin, line) && line != "exit") {
+			if (parseInput(line).empty())	continue;
+			const std::string frame = encode_line(nextId++, line);
+			if (!writeFull(data_socket, frame.data(), frame.size())) {
+				perror("write");
+				break;
+			}
+		}
+		shutdown(data_socket, SHUT_WR); // The server closes once it has answered everything
+	});
+
+	uint32_t expectedId = 0;
+	while (print_response(data_socket, expectedId))	expectedId++;
+	sender.join();
+}
+
+void run_client(bool batch) {
 	struct sockaddr_un addr;
-	
+
 	int data_socket;
 	int ret;
-	std::string buffer;
-	
+
 	data_socket = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (data_socket == -1) {
 		perror("socket");
@@ -26,68 +108,8 @@ void run_client() {
 		exit(EXIT_FAILURE);
 	}
 
-	int last = 0;
-	while(true) {
-		buffer = "requestPath";
-		ret = write(data_socket, buffer.data(), BUFFER_SIZE);
-		if (ret == -1) {
-			perror("write");
-			exit(EXIT_FAILURE);
-		}
-		int total;
-		ret = read(data_socket, &total, sizeof(total));
-		if (ret == -1) {
-			perror("write");
-			exit(EXIT_FAILURE);
-		}
-		int track = 0;
-		while (track < total) {
-			int chunk = std::min(BUFFER_SIZE, static_cast<int>(total - track));
-			buffer.resize(chunk);
-			int bytes = read(data_socket, buffer.data(), chunk);
-			if (bytes == -1) {
-				perror("read data");
-				exit(EXIT_FAILURE);
-			}
-			std::cout.write(buffer.data(), bytes);
-			std::cout.flush();
-			track += chunk;
-		}
-		std::cout << " >> ";
-		buffer.clear();
-		std::cin.clear();
-		std::getline(std::cin, buffer);
-		if (buffer == "exit") {
-			shutdown(data_socket, SHUT_RD);
-			last = 1;
-		}
-		else {
-			ret = write(data_socket, buffer.data(), buffer.length());
-			if (ret == -1) {
-				perror("write");
-				exit(EXIT_FAILURE);
-			}
-		}
-		ret = read(data_socket, &total, sizeof(total));
-		if (ret == -1) {
-			perror("read size");
-			exit(EXIT_FAILURE);
-		}
-		int received = 0;
-		while (received < total) {
-			int chunk = std::min(BUFFER_SIZE, static_cast<int>(total - received));
-			buffer.resize(chunk);
-			int bytes = read(data_socket, buffer.data(), chunk);
-			if (bytes == -1) {
-				perror("read data");
-				exit(EXIT_FAILURE);
-			}
-			std::cout.write(buffer.data(), bytes);
-			std::cout.flush();
-			received += chunk;
-		}
-		if (last)	break;
-	}
+	if (batch)	run_batch(data_socket);
+	else	run_interactive(data_socket);
 
 	close(data_socket);
-}
\ No newline at end of file
+}
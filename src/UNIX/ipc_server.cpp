@@ -1,69 +1,102 @@
 #include "UNIX/ipc_server.h"
 
-// std::vector<int> fd_socket(MAX_CLIENT_SUPPORT, -1);
-std::map<int, ClientSession*> sessions;
+// One accepted client. Its socket is registered EPOLLONESHOT, so at most one
+// worker serves it at a time and the buffers and session need no locking.
+struct Connection {
+	int fd;
+	ClientSession* session;
+	std::vector<char> buffer; // Bytes of requests not yet complete
+	std::vector<char> outbox; // Response bytes the socket has not taken yet
+	size_t outboxSent = 0; // Prefix of outbox already sent
+
+	size_t pending() const { return outbox.size() - outboxSent; }
+};
+
+std::unordered_map<int, Connection*> connections;
+std::mutex connectionsMutex;
 int connected = 0;
 
-ClientSession* get_fd_socket(int data_socket) {
-	if (sessions.find(data_socket) != sessions.end())	return sessions.find(data_socket)->second;
-	return nullptr;
+static int epoll_fd = -1;
+static int connection_socket = -1;
+static volatile sig_atomic_t stopping = 0;
+
+// Connections with pending input, waiting for a worker
+static std::deque<Connection*> readyQueue;
+static std::mutex readyMutex;
+static std::condition_variable readyCV;
+
+static void on_sigint(int signal) {
+	(void)signal;
+	stopping = 1;
+}
+
+// While output is queued the socket waits for room to write and new requests
+// stay unread, which holds back a client that does not read its answers.
+static bool arm_fd_socket(Connection* conn, int op) {
+	epoll_event event{};
+	event.events = (conn->pending() > 0 ? EPOLLOUT : EPOLLIN | EPOLLRDHUP) | EPOLLET | EPOLLONESHOT;
+	event.data.ptr = conn;
+	if (epoll_ctl(epoll_fd, op, conn->fd, &event) == -1) {
+		perror("epoll_ctl");
+		return false;
+	}
+	return true;
 }
 
 static void add_fd_socket(int sock_fd) {
-	if (sock_fd >= FD_SETSIZE) {
-        std::cerr << "[ERROR] File descriptor " << sock_fd << " exceeds FD_SETSIZE limit (" << FD_SETSIZE << ")\n";
-        close(sock_fd);
-        return;
-    }
-	
+	std::unique_lock<std::mutex> lock(connectionsMutex);
 	if (connected >= MAX_CLIENT_SUPPORT) {
 		close(sock_fd);
 		std::cerr << "Maximum client limit reached. Socket closed.\n";
 		return;
 	}
-	
-	if (sessions.find(sock_fd) == sessions.end()) {
-		ClientSession* clientSession = new ClientSession();
-	    sessions.insert({sock_fd, clientSession});
-	    connected++;
-	    return;
-	}
-}
 
-static void remove_fd_socket(int sock_fd) {
-	if (sessions.find(sock_fd) != sessions.end()) {
-		delete sessions.find(sock_fd)->second;
-		sessions.find(sock_fd)->second = nullptr;
-		sessions.erase(sock_fd);
-		connected--;
-	}
-}
+	Connection* conn = new Connection();
+	conn->fd = sock_fd;
+	conn->session = new ClientSession();
+	connections.insert({sock_fd, conn});
+	connected++;
+	lock.unlock();
 
-static void refresh_fd_socket(fd_set* fd_set_ptr) {
-	FD_ZERO(fd_set_ptr);
-	for (auto it = sessions.begin(); it != sessions.end(); it++) {
-		if (it->first >= FD_SETSIZE)	continue;
-		FD_SET(it->first, fd_set_ptr);
+	if (!arm_fd_socket(conn, EPOLL_CTL_ADD)) {
+		lock.lock();
+		connections.erase(sock_fd);
+		connected--;
+		lock.unlock();
+		delete conn->session;
+		delete conn;
+		close(sock_fd);
 	}
 }
 
-static int get_max_fd() {
-	int max = -1;
-	for (auto it = sessions.begin(); it != sessions.end(); it++) {
-		if (max < it->first) {
-			max = it->first;
-		}
+static void remove_fd_socket(Connection* conn) {
+	{
+		std::unique_lock<std::mutex> lock(connectionsMutex);
+		if (connections.erase(conn->fd) == 0)	return;
+		connected--;
 	}
-	return max;
+	if (fs)	fs->closeAll(conn->session); // Drop the client's open file handles
+	delete conn->session;
+	close(conn->fd); // Also removes it from the epoll set
+	delete conn;
 }
 
 void cleanup() {
-	for (auto it = sessions.begin(); it != sessions.end();) {
-		delete it->second;
-		it->second = nullptr;
-		close(it->first);
-		it = sessions.erase(it);
+	{
+		std::unique_lock<std::mutex> lock(connectionsMutex);
+		for (auto it = connections.begin(); it != connections.end();) {
+			if (fs)	fs->closeAll(it->second->session);
+			delete it->second->session;
+			close(it->first);
+			delete it->second;
+			it = connections.erase(it);
+		}
+		connected = 0;
 	}
+	if (connection_socket != -1)	close(connection_socket);
+	connection_socket = -1;
+	if (epoll_fd != -1)	close(epoll_fd);
+	epoll_fd = -1;
 	unlink(SOCKET_NAME);
 
 	if (fs)	delete fs;
@@ -77,127 +110,340 @@ bool is_server_running() {
 MountManager mountManager;
 FileSystemInterface* fs = nullptr;
 
-int ret;
-fd_set readfds;
-char buffer[BUFFER_SIZE];
-std::string command;
-
-void handle_client(int data_socket, ClientSession* session, CommandLineInterface cli) {
-	while (session->active){
-		memset(buffer, 0, BUFFER_SIZE);
-		ret = read(data_socket, buffer, BUFFER_SIZE);
-		command = std::string(buffer);
-		if (ret == -1) {
-			perror("read");
-			break;
-		} else if (ret == 0) {
-			remove_fd_socket(data_socket);
-			break;
+// Sockets are non-blocking. Output the socket cannot take is queued on the
+// connection and sent by a later worker once the reactor sees it writable.
+static bool flush_outbox(Connection* conn) {
+	while (conn->pending() > 0) {
+		ssize_t sent = send(conn->fd, conn->outbox.data() + conn->outboxSent, conn->pending(), MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR)	continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)	return true;
+			perror("write");
+			return false;
 		}
-		if (command.empty())	continue;
-		else if (command == "requestPath") {
-			std::string response = cli.createPath(session);
-			int total = response.size();
-			ret = write(data_socket, &total, sizeof(total));
-			if (ret == -1) {
-				perror("write");
-				break;
-			}
+		conn->outboxSent += static_cast<size_t>(sent);
+	}
+	conn->outbox.clear();
+	conn->outboxSent = 0;
+	return true;
+}
 
-			int done = 0;
-			while (done < total) {
-				int chunk = std::min(BUFFER_SIZE, static_cast<int>(total - done));
-				ret = write(data_socket, response.data() + done, chunk);
-				if (ret == -1) {
+// Waits for room in the send buffer when the queue is full, giving up after
+// SEND_TIMEOUT_MS so a client that stopped reading cannot hold a worker.
+static bool wait_writable(int sock_fd) {
+	pollfd entry{};
+	entry.fd = sock_fd;
+	entry.events = POLLOUT;
+	int ready;
+	while ((ready = poll(&entry, 1, SEND_TIMEOUT_MS)) == -1) {
+		if (errno != EINTR)	return false;
+	}
+	if (ready == 0) {
+		std::cerr << "[Server] Client is not reading its responses; closing the connection.\n";
+		return false;
+	}
+	return (entry.revents & (POLLERR | POLLHUP | POLLNVAL)) == 0;
+}
+
+// Sends what the socket takes now and queues the rest, keeping responses in
+// order. Only past MAX_PENDING_OUTPUT queued bytes does the worker wait.
+static bool send_all(Connection* conn, const char* data, size_t length) {
+	while (length > 0) {
+		if (conn->pending() == 0) {
+			ssize_t sent = send(conn->fd, data, length, MSG_NOSIGNAL);
+			if (sent == -1) {
+				if (errno == EINTR)	continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
 					perror("write");
-					exit(EXIT_FAILURE);
+					return false;
 				}
-				done += chunk;
-			}
-		} 
-		else {
-			std::string content = cli.runCLI(command, session);
-			std::string response = session->msg;
-			if (content != "")	response = content;
-			int total = response.size();
-			ret = write(data_socket, &total, sizeof(total));
-			if (ret == -1) {
-				perror("write");
-				break;
+				sent = 0;
 			}
+			data += sent;
+			length -= static_cast<size_t>(sent);
+			if (sent > 0)	continue;
+		}
+		if (conn->outboxSent > 0) {
+			conn->outbox.erase(conn->outbox.begin(), conn->outbox.begin() + conn->outboxSent);
+			conn->outboxSent = 0;
+		}
+		const size_t room = conn->outbox.size() < MAX_PENDING_OUTPUT ? MAX_PENDING_OUTPUT - conn->outbox.size() : 0;
+		const size_t queued = std::min(room, length);
+		conn->outbox.insert(conn->outbox.end(), data, data + queued);
+		data += queued;
+		length -= queued;
+		if (length > 0 && (!wait_writable(conn->fd) || !flush_outbox(conn)))	return false;
+	}
+	return true;
+}
 
-			int done = 0;
-			while (done < total) {
-				int chunk = std::min(BUFFER_SIZE, static_cast<int>(total - done));
-				ret = write(data_socket, response.data() + done, chunk);
-				if (ret == -1) {
-					perror("write");
-					break;
+// Copies length bytes of the image at offset into the output, for when the
+// socket is too full for sendfile.
+static bool send_file_copy(Connection* conn, int imageFd, off_t offset, size_t length) {
+	char chunk[4 * BUFFER_SIZE];
+	while (length > 0) {
+		ssize_t bytes = pread(imageFd, chunk, std::min(length, sizeof(chunk)), offset);
+		if (bytes == -1 && errno == EINTR)	continue;
+		if (bytes <= 0)	return false; // Short image
+		if (!send_all(conn, chunk, static_cast<size_t>(bytes)))	return false;
+		offset += bytes;
+		length -= static_cast<size_t>(bytes);
+	}
+	return true;
+}
+
+static bool send_header(Connection* conn, uint32_t requestId, uint16_t status, uint64_t length) {
+	ResponseHeader header;
+	header.requestId = requestId;
+	header.status = status;
+	header.reserved = 0;
+	header.length = length;
+	return send_all(conn, reinterpret_cast<const char*>(&header), sizeof(header));
+}
+
+static bool send_response(Connection* conn, uint32_t requestId, uint16_t status, const std::string& response) {
+	return send_header(conn, requestId, status, response.size()) && send_all(conn, response.data(), response.size());
+}
+
+// Answers one request. Returns false when the connection has to be dropped.
+static bool handle_request(Connection* conn, const RequestHeader& request, std::vector<std::string>& args, CommandLineInterface& cli) {
+	const int data_socket = conn->fd;
+	ClientSession* session = conn->session;
+	if (request.opcode == OPCODE_PATH)	return send_response(conn, request.requestId, RESPONSE_OK, cli.createPath(session));
+	args.insert(args.begin(), OPCODE_NAMES[request.opcode]);
+
+	std::string response;
+	bool started = false;
+	try {
+		if (cli.isStreamed(args)) {
+			// The response header goes out first, then each block as it is read
+			ReadStream stream;
+			stream.start = [&](int64_t length) {
+				started = true;
+				return send_header(conn, request.requestId, RESPONSE_OK, static_cast<uint64_t>(length));
+			};
+			stream.write = [&](const char* data, size_t length) {
+				return send_all(conn, data, length);
+			};
+			// Large extents go from the image to the socket without a user-space
+			// copy; once the socket is full the rest is copied into the queue
+			stream.sendFile = [&](int imageFd, off_t offset, size_t length) {
+				while (length > 0 && conn->pending() == 0) {
+					ssize_t sent = sendfile(data_socket, imageFd, &offset, length);
+					if (sent == -1) {
+						if (errno == EINTR)	continue;
+						if (errno == EAGAIN)	break;
+						perror("sendfile");
+						return false;
+					}
+					if (sent == 0)	return false; // Short image
+					length -= static_cast<size_t>(sent);
 				}
-				done += chunk;
+				return send_file_copy(conn, imageFd, offset, length);
+			};
+			if (cli.streamCLI(args, stream, session))	return true;
+			if (started) {
+				// The client was promised more bytes than it got; drop it
+				std::cerr << "[Server] Streamed read failed part way; closing the connection.\n";
+				return false;
 			}
+			response = session->msg;
 		}
+		else {
+			std::string content = cli.runCommand(args, session);
+			response = session->msg;
+			if (content != "")	response = content;
+		}
+	}
+	catch (const std::exception& e) {
+		// Arguments that do not parse, e.g. "read f x 10", fail only this request
+		std::cerr << "[Server] Request '" << args[0] << "' failed: " << e.what() << '\n';
+		if (started)	return false;
+		return send_response(conn, request.requestId, RESPONSE_BAD_REQUEST, "Error: Invalid arguments for '" + args[0] + "'. Type 'help' for available commands.\n");
+	}
+	return send_response(conn, request.requestId, RESPONSE_OK, response);
+}
+
+// Answers every complete request in the buffer, in order; a partial one is
+// left for the next read. Pipelined requests are therefore answered in the
+// order they were sent. Once output is queued the rest wait until it is sent.
+static bool handle_frames(Connection* conn, CommandLineInterface& cli) {
+	size_t used = 0;
+	bool check = true;
+	std::vector<std::string> args;
+	while (check && conn->pending() == 0 && conn->buffer.size() - used >= sizeof(RequestHeader)) {
+		RequestHeader request;
+		memcpy(&request, conn->buffer.data() + used, sizeof(request));
+		if (request.length > MAX_REQUEST_SIZE) {
+			std::cerr << "[Server] Request too large; closing the connection.\n";
+			return false;
+		}
+		if (conn->buffer.size() - used < sizeof(request) + request.length)	break;
+		const char* body = conn->buffer.data() + used + sizeof(request);
+		used += sizeof(request) + request.length;
+
+		if (request.opcode == OPCODE_UNKNOWN)
+			check = send_response(conn, request.requestId, RESPONSE_BAD_REQUEST, "Unknown command. Type 'help' for available commands.\n");
+		else if (request.opcode >= OPCODE_COUNT || !decodeArgs(body, request.length, request.argCount, args))
+			check = send_response(conn, request.requestId, RESPONSE_BAD_REQUEST, "Error: Malformed request.\n");
+		else
+			check = handle_request(conn, request, args, cli);
+	}
+	conn->buffer.erase(conn->buffer.begin(), conn->buffer.begin() + used);
+	return check;
+}
+
+// Sends queued output, then drains the socket (it is edge-triggered),
+// answering requests as they complete. Reading stops while output is queued;
+// re-arming the socket reports the unread requests later.
+static bool serve_connection(Connection* conn, CommandLineInterface& cli) {
+	if (!flush_outbox(conn))	return false;
+	if (conn->pending() > 0)	return true;
+	if (!handle_frames(conn, cli))	return false; // Requests held back by earlier output
+	char chunk[4 * BUFFER_SIZE];
+	while (conn->pending() == 0) {
+		ssize_t bytes = read(conn->fd, chunk, sizeof(chunk));
+		if (bytes > 0) {
+			conn->buffer.insert(conn->buffer.end(), chunk, chunk + bytes);
+			if (!handle_frames(conn, cli))	return false;
+			continue;
+		}
+		if (bytes == 0)	return false; // Client disconnected
+		if (errno == EINTR)	continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)	break;
+		perror("read");
+		return false;
+	}
+	return true;
+}
+
+static void worker_loop(CommandLineInterface& cli) {
+	while (true) {
+		Connection* conn;
+		{
+			std::unique_lock<std::mutex> lock(readyMutex);
+			readyCV.wait(lock, [] { return stopping || !readyQueue.empty(); });
+			if (stopping)	return;
+			conn = readyQueue.front();
+			readyQueue.pop_front();
+		}
+		if (!serve_connection(conn, cli) || !arm_fd_socket(conn, EPOLL_CTL_MOD))	remove_fd_socket(conn);
+	}
+}
+
+static void accept_clients() {
+	while (true) {
+		int data_socket = accept4(connection_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (data_socket == -1) {
+			if (errno == EINTR)	continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)	perror("accept");
+			return;
+		}
+		add_fd_socket(data_socket);
 	}
 }
 
-void run_server() {
+// Thousands of clients need more descriptors than the usual soft limit.
+static void raise_fd_limit() {
+	rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur >= limit.rlim_max)	return;
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+}
+
+// A single reactor thread waits on every socket with epoll and queues ready
+// connections for a fixed pool of workers, which run the commands.
+void run_server(const MountOptions& options) {
 
 	sockaddr_un name;
-	
-	int connection_socket;
+	int ret;
 
 	unlink(SOCKET_NAME);
-	
-	connection_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	connection_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 	if (connection_socket == -1) {
 		perror("socket");
 		exit(EXIT_FAILURE);
 	}
-	
+
 	memset(&name, 0, sizeof(sockaddr_un));
 	name.sun_family = AF_UNIX;
 	strncpy(name.sun_path, SOCKET_NAME, sizeof(name.sun_path) - 1);
 	name.sun_path[sizeof(name.sun_path) - 1] = '\0';
-	
+
 	ret = bind(connection_socket, (const sockaddr*)&name, sizeof(sockaddr_un));
 	if (ret == -1) {
 		perror("bind");
 		exit(EXIT_FAILURE);
 	}
-	
-	ret = listen(connection_socket, 10);
+
+	ret = listen(connection_socket, SOMAXCONN);
 	if (ret == -1) {
 		perror("listen");
 		exit(EXIT_FAILURE);
 	}
-		
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+	epoll_event listenEvent{};
+	listenEvent.events = EPOLLIN | EPOLLET;
+	listenEvent.data.ptr = nullptr; // Marks the listening socket
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection_socket, &listenEvent) == -1) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	}
+	raise_fd_limit();
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, on_sigint);
+
 	try{
-		add_fd_socket(connection_socket);
-		
-		fs = new System("./disks/myDisk.img");
+		fs = new System("./disks/myDisk.img", options);
 		VFSManager* vfsManager = new VFSManager();
-		vfsManager->mount(fs); 
+		vfsManager->mount(fs);
 		mountManager.mount("/dir1", "/disks/myDisk.img", "rootFS", vfsManager);
 		std::cout << "-----------------------------------------------------\n";
 		CommandLineInterface cli(mountManager.getCurrentVFS(), mountManager.getCurrentFSName());
-		
-		while (true) {
-			refresh_fd_socket(&readfds);
-			int data_socket = accept(connection_socket, NULL, NULL);
-			if (data_socket == -1) {
-				perror("accept");
-				exit(EXIT_FAILURE);
-			}
 
-			add_fd_socket(data_socket);
-			std::thread(handle_client, data_socket, get_fd_socket(data_socket), std::ref(cli)).detach();
+		// Workers block SIGINT so that it interrupts the reactor's epoll_wait
+		sigset_t blocked, previous;
+		sigemptyset(&blocked);
+		sigaddset(&blocked, SIGINT);
+		pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+		const unsigned int workerCount = SERVER_WORKERS > 0 ? SERVER_WORKERS : std::max(4u, std::thread::hardware_concurrency());
+		std::vector<std::thread> workers;
+		for (unsigned int i = 0; i < workerCount; i++)	workers.emplace_back(worker_loop, std::ref(cli));
+		pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+
+		epoll_event events[EPOLL_EVENTS_PER_WAIT];
+		while (!stopping) {
+			int ready = epoll_wait(epoll_fd, events, EPOLL_EVENTS_PER_WAIT, -1);
+			if (ready == -1) {
+				if (errno == EINTR)	continue;
+				perror("epoll_wait");
+				break;
+			}
+			for (int i = 0; i < ready; i++) {
+				if (events[i].data.ptr == nullptr) {
+					accept_clients();
+					continue;
+				}
+				{
+					std::unique_lock<std::mutex> lock(readyMutex);
+					readyQueue.push_back(static_cast<Connection*>(events[i].data.ptr));
+				}
+				readyCV.notify_one();
+			}
 		}
-		remove_fd_socket(connection_socket);
-		close(connection_socket);
-		unlink(SOCKET_NAME);
+
+		stopping = 1;
+		readyCV.notify_all();
+		for (auto& worker : workers)	worker.join();
 	}
 	catch (const std::exception& e){
 		std::cout << e.what() << '\n';
 	}
 	cleanup();
-}
\ No newline at end of file
+}
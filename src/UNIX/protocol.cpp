@@ -0,0 +1,75 @@
+#include "UNIX/protocol.h"
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+uint16_t opcodeFor(const std::string& command) {
+	for (uint16_t opcode = OPCODE_PATH + 1; opcode < OPCODE_COUNT; opcode++) {
+		if (command == OPCODE_NAMES[opcode])	return opcode;
+	}
+	return OPCODE_UNKNOWN;
+}
+
+std::string encodeRequest(uint32_t requestId, uint16_t opcode, const std::vector<std::string>& args) {
+	RequestHeader header;
+	header.requestId = requestId;
+	header.opcode = opcode;
+	header.argCount = static_cast<uint16_t>(args.size());
+	header.length = 0;
+	for (const auto& arg : args)	header.length += static_cast<uint32_t>(sizeof(uint32_t) + arg.size());
+
+	std::string frame(reinterpret_cast<const char*>(&header), sizeof(header));
+	frame.reserve(sizeof(header) + header.length);
+	for (const auto& arg : args) {
+		const uint32_t size = static_cast<uint32_t>(arg.size());
+		frame.append(reinterpret_cast<const char*>(&size), sizeof(size));
+		frame.append(arg);
+	}
+	return frame;
+}
+
+// Fails unless the arguments fill the body exactly.
+bool decodeArgs(const char* data, size_t length, uint16_t argCount, std::vector<std::string>& args) {
+	args.clear();
+	args.reserve(argCount);
+	size_t used = 0;
+	for (uint16_t i = 0; i < argCount; i++) {
+		uint32_t size;
+		if (length - used < sizeof(size))	return false;
+		memcpy(&size, data + used, sizeof(size));
+		used += sizeof(size);
+		if (length - used < size)	return false;
+		args.emplace_back(data + used, size);
+		used += size;
+	}
+	return used == length;
+}
+
+// Blocking helpers for the client; they retry short transfers.
+bool readFull(int fd, void* data, size_t length) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t bytes = read(fd, static_cast<char*>(data) + done, length - done);
+		if (bytes == -1) {
+			if (errno == EINTR)	continue;
+			return false;
+		}
+		if (bytes == 0)	return false;
+		done += static_cast<size_t>(bytes);
+	}
+	return true;
+}
+
+bool writeFull(int fd, const void* data, size_t length) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t bytes = write(fd, static_cast<const char*>(data) + done, length - done);
+		if (bytes == -1) {
+			if (errno == EINTR)	continue;
+			return false;
+		}
+		done += static_cast<size_t>(bytes);
+	}
+	return true;
+}
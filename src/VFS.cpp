@@ -36,7 +36,7 @@ bool VFSManager::create(const std::string& path, ClientSession* session) {
     return isMounted() ? fs->create(path, session) : false;
 }
 
-bool VFSManager::create(const std::string& path, const int& fileSize, ClientSession* session) {
+bool VFSManager::create(const std::string& path, const int64_t& fileSize, ClientSession* session) {
     return isMounted() ? fs->create(path, fileSize, session) : false;
 }
 
@@ -44,10 +44,18 @@ std::string VFSManager::read(const std::string& path, ClientSession* session) {
     return isMounted() ? fs->read(path, session) : "";
 }
 
+std::string VFSManager::read(const std::string& path, int64_t offset, int64_t length, ClientSession* session) {
+    return isMounted() ? fs->read(path, offset, length, session) : "";
+}
+
 bool VFSManager::write(const std::string& path, const std::string& data, ClientSession* session) {
     return isMounted() ? fs->write(path, data, session) : false;
 }
 
+bool VFSManager::write(const std::string& path, int64_t offset, const std::string& data, ClientSession* session) {
+    return isMounted() ? fs->write(path, offset, data, session) : false;
+}
+
 bool VFSManager::append(const std::string& path, const std::string& data, ClientSession* session) {
     return isMounted() ? fs->append(path, data, session) : false;
 }
@@ -60,6 +68,34 @@ bool VFSManager::rename(const std::string& oldName, const std::string& newName,
     return isMounted() ? fs->rename(oldName, newName, session) : false;
 }
 
+bool VFSManager::readStream(const std::string& path, const ReadStream& stream, ClientSession* session) {
+    return isMounted() ? fs->readStream(path, stream, session) : false;
+}
+
+int VFSManager::open(const std::string& path, ClientSession* session) {
+    return isMounted() ? fs->open(path, session) : -1;
+}
+
+bool VFSManager::close(int handle, ClientSession* session) {
+    return isMounted() ? fs->close(handle, session) : false;
+}
+
+void VFSManager::closeAll(ClientSession* session) {
+    if (isMounted())    fs->closeAll(session);
+}
+
+std::string VFSManager::hread(int handle, int64_t offset, int64_t length, ClientSession* session) {
+    return isMounted() ? fs->hread(handle, offset, length, session) : "";
+}
+
+bool VFSManager::hwrite(int handle, int64_t offset, const std::string& data, ClientSession* session) {
+    return isMounted() ? fs->hwrite(handle, offset, data, session) : false;
+}
+
+void VFSManager::hstat(int handle, ClientSession* session) {
+    if (isMounted())    fs->hstat(handle, session);
+}
+
 bool VFSManager::mkdir(const std::string& path, ClientSession* session) {
     return isMounted() ? fs->mkdir(path, session) : false;
 }
@@ -124,6 +160,14 @@ void VFSManager::tree(ClientSession* session, const std::string& path, int depth
     if (isMounted()) fs->tree(session, path, depth, prefix);
 }
 
+void VFSManager::cacheStats(ClientSession* session) {
+    if (isMounted()) fs->cacheStats(session);
+}
+
+bool VFSManager::grow(int newSizeMB, ClientSession* session) {
+    return isMounted() ? fs->grow(newSizeMB, session) : false;
+}
+
 // LOGS
 void VFSManager::bTree() {
     if (isMounted()) fs->bTree();
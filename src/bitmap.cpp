@@ -0,0 +1,98 @@
+#include "bitmap.h"
+
+#include <algorithm>
+
+void Bitmap::assign(size_t bits) {
+	bitCount = bits;
+	words.assign((bits + 63) / 64, 0);
+	std::vector<std::atomic<bool>> pages((bits + PAGE_BITS - 1) / PAGE_BITS);
+	dirtyPages.swap(pages);
+	usedCount = 0;
+}
+
+// New bits start clear; the pages they live in are marked dirty.
+void Bitmap::grow(size_t bits) {
+	if (bits <= bitCount)	return;
+	const size_t oldPage = bitCount / PAGE_BITS;
+	bitCount = bits;
+	words.resize((bits + 63) / 64, 0);
+	std::vector<std::atomic<bool>> pages((bits + PAGE_BITS - 1) / PAGE_BITS);
+	for (size_t page = 0; page < dirtyPages.size(); page++)	pages[page] = dirtyPages[page].load();
+	for (size_t page = oldPage; page < pages.size(); page++)	pages[page] = true;
+	dirtyPages.swap(pages);
+}
+
+void Bitmap::clearTail() {
+	if (bitCount % 64)	words.back() &= (uint64_t(1) << (bitCount % 64)) - 1;
+}
+
+void Bitmap::set(size_t index) {
+	uint64_t& word = words[index >> 6];
+	const uint64_t mask = uint64_t(1) << (index & 63);
+	if (word & mask)	return;
+	word |= mask;
+	usedCount++;
+	dirtyPages[index / PAGE_BITS] = true;
+}
+
+void Bitmap::reset(size_t index) {
+	uint64_t& word = words[index >> 6];
+	const uint64_t mask = uint64_t(1) << (index & 63);
+	if (!(word & mask))	return;
+	word &= ~mask;
+	usedCount--;
+	dirtyPages[index / PAGE_BITS] = true;
+}
+
+void Bitmap::setRange(size_t from, size_t to) {
+	for (size_t i = from; i < to; i++)	set(i);
+}
+
+// First bit in [from, to) equal to value, or npos.
+size_t Bitmap::find(size_t from, size_t to, bool value) const {
+	to = std::min(to, bitCount);
+	if (from >= to)	return npos;
+	const uint64_t flip = value ? 0 : ~uint64_t(0);
+	size_t wordIndex = from >> 6;
+	uint64_t bits = (words[wordIndex] ^ flip) & (~uint64_t(0) << (from & 63));
+	while (true) {
+		if (bits) {
+			const size_t index = (wordIndex << 6) + static_cast<size_t>(__builtin_ctzll(bits));
+			return index < to ? index : npos;
+		}
+		if (++wordIndex << 6 >= to)	return npos;
+		bits = words[wordIndex] ^ flip;
+	}
+}
+
+void Bitmap::recount() {
+	clearTail();
+	usedCount = 0;
+	for (const uint64_t word : words)	usedCount += static_cast<size_t>(__builtin_popcountll(word));
+	std::fill(dirtyPages.begin(), dirtyPages.end(), false);
+}
+
+// Older images stored the bitmap MSB-first within each byte.
+void Bitmap::reverseByteBits() {
+	unsigned char* bytes = reinterpret_cast<unsigned char*>(words.data());
+	for (size_t i = 0; i < byteSize(); i++) {
+		unsigned char b = bytes[i];
+		b = static_cast<unsigned char>((b & 0xF0) >> 4 | (b & 0x0F) << 4);
+		b = static_cast<unsigned char>((b & 0xCC) >> 2 | (b & 0x33) << 2);
+		b = static_cast<unsigned char>((b & 0xAA) >> 1 | (b & 0x55) << 1);
+		bytes[i] = b;
+	}
+	recount();
+}
+
+std::vector<size_t> Bitmap::takeDirtyPages() {
+	std::vector<size_t> pages;
+	for (size_t page = 0; page < dirtyPages.size(); page++) {
+		if (dirtyPages[page].exchange(false))	pages.push_back(page);
+	}
+	return pages;
+}
+
+void Bitmap::markAllDirty() {
+	std::fill(dirtyPages.begin(), dirtyPages.end(), true);
+}
@@ -0,0 +1,214 @@
+#include "blockDevice.h"
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+BlockDevice::~BlockDevice() {
+	close();
+}
+
+bool BlockDevice::open(const std::string& diskPath) {
+	close();
+	fd = ::open(diskPath.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd == -1)	return false;
+	path = diskPath;
+	return true;
+}
+
+// New images are sparse: blocks take host space only once written.
+bool BlockDevice::create(const std::string& diskPath, off_t size) {
+	close();
+	fd = ::open(diskPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)	return false;
+	path = diskPath;
+	if (::ftruncate(fd, size) == -1) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void BlockDevice::close() {
+	if (fd == -1)	return;
+	cache.reset(); // Writes back dirty blocks
+	unmap();
+	::close(fd);
+	fd = -1;
+	path.clear();
+}
+
+bool BlockDevice::readAt(off_t offset, size_t length, char* buffer) {
+	if (mapping) {
+		std::shared_lock<std::shared_mutex> lock(mappingMutex);
+		if (offset < 0 || static_cast<size_t>(offset) + length > mappingSize)	return false;
+		memcpy(buffer, mapping + offset, length);
+		return true;
+	}
+	if (cache)	return cache->read(offset, length, buffer);
+	return rawReadAt(offset, length, buffer);
+}
+
+bool BlockDevice::writeAt(off_t offset, size_t length, const char* buffer) {
+	if (mapping) {
+		std::shared_lock<std::shared_mutex> lock(mappingMutex);
+		if (offset < 0 || static_cast<size_t>(offset) + length > mappingSize)	return false;
+		memcpy(mapping + offset, buffer, length);
+		markDirty(offset, length);
+		return true;
+	}
+	if (cache)	return cache->write(offset, length, buffer);
+	return rawWriteAt(offset, length, buffer);
+}
+
+bool BlockDevice::rawReadAt(off_t offset, size_t length, char* buffer) {
+	if (fd == -1)	return false;
+	size_t done = 0;
+	while (done < length) {
+		ssize_t ret = ::pread(fd, buffer + done, length - done, offset + static_cast<off_t>(done));
+		if (ret == -1) {
+			if (errno == EINTR)	continue;
+			return false;
+		}
+		if (ret == 0)	return false; // Short image
+		done += static_cast<size_t>(ret);
+	}
+	return true;
+}
+
+bool BlockDevice::rawWriteAt(off_t offset, size_t length, const char* buffer) {
+	if (fd == -1)	return false;
+	size_t done = 0;
+	while (done < length) {
+		ssize_t ret = ::pwrite(fd, buffer + done, length - done, offset + static_cast<off_t>(done));
+		if (ret == -1) {
+			if (errno == EINTR)	continue;
+			return false;
+		}
+		done += static_cast<size_t>(ret);
+	}
+	return true;
+}
+
+bool BlockDevice::readBlocks(int64_t block, int64_t count, char* buffer) {
+	if (block < 0 || count < 0)	return false;
+	return readAt(static_cast<off_t>(block) * BLOCK_SIZE, static_cast<size_t>(count) * BLOCK_SIZE, buffer);
+}
+
+bool BlockDevice::writeBlocks(int64_t block, int64_t count, const char* buffer) {
+	if (block < 0 || count < 0)	return false;
+	return writeAt(static_cast<off_t>(block) * BLOCK_SIZE, static_cast<size_t>(count) * BLOCK_SIZE, buffer);
+}
+
+bool BlockDevice::sync() {
+	if (fd == -1)	return false;
+	if (mapping) {
+		{
+			std::unique_lock<std::mutex> lock(dirtyMutex);
+			dirtyStart = dirtyEnd = -1;
+		}
+		return ::msync(mapping, mappingSize, MS_SYNC) == 0;
+	}
+	if (cache && !cache->flush())	return false;
+	return ::fdatasync(fd) == 0;
+}
+
+// Called when an operation is marked committed: its writes must have left the
+// process before the journal says so. In buffered mode the cache's dirty
+// blocks are written back to the kernel; mapped mode msyncs what changed.
+bool BlockDevice::commit() {
+	if (!mapping)	return !cache || cache->flush();
+	off_t start, end;
+	{
+		std::unique_lock<std::mutex> lock(dirtyMutex);
+		if (dirtyStart == -1)	return true;
+		start = dirtyStart;
+		end = dirtyEnd;
+		dirtyStart = dirtyEnd = -1;
+	}
+	const off_t pageSize = static_cast<off_t>(sysconf(_SC_PAGESIZE));
+	start -= start % pageSize;
+	return ::msync(mapping + start, static_cast<size_t>(end - start), MS_SYNC) == 0;
+}
+
+// Hands the blocks' storage back to the host filesystem; afterwards they read
+// as zeros. Falls back to writing zeros where hole punching is unsupported.
+bool BlockDevice::discard(int64_t block, int64_t count) {
+	if (fd == -1 || block < 0 || count <= 0)	return false;
+	const off_t offset = static_cast<off_t>(block) * BLOCK_SIZE;
+	const off_t length = static_cast<off_t>(count) * BLOCK_SIZE;
+	if (cache)	cache->invalidate(block, count);
+	if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0)	return true;
+	const std::vector<char> zeros(BLOCK_SIZE, 0);
+	for (int64_t i = 0; i < count; i++) {
+		if (!writeBlocks(block + i, 1, zeros.data()))	return false;
+	}
+	return true;
+}
+
+// Extends the image (sparsely). A mapped image is remapped at the new size.
+bool BlockDevice::resize(off_t size) {
+	if (fd == -1)	return false;
+	std::unique_lock<std::shared_mutex> lock(mappingMutex);
+	if (::ftruncate(fd, size) == -1)	return false;
+	if (!mapping)	return true;
+	void* addr = ::mremap(mapping, mappingSize, static_cast<size_t>(size), MREMAP_MAYMOVE);
+	if (addr == MAP_FAILED)	return false;
+	mapping = static_cast<char*>(addr);
+	mappingSize = static_cast<size_t>(size);
+	return true;
+}
+
+// Returns the descriptor for reading [offset, offset + length) straight from
+// the host file (sendfile), after writing back any newer copy held in the
+// cache. A mapping needs nothing: it shares the page cache with the file.
+int BlockDevice::directReadFd(off_t offset, size_t length) {
+	if (fd == -1 || offset < 0)	return -1;
+	const int64_t first = offset / BLOCK_SIZE;
+	const int64_t last = (offset + static_cast<off_t>(length) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (cache && !cache->writeBackRange(first, last - first))	return -1;
+	return fd;
+}
+
+void BlockDevice::markDirty(off_t offset, size_t length) {
+	std::unique_lock<std::mutex> lock(dirtyMutex);
+	const off_t end = offset + static_cast<off_t>(length);
+	if (dirtyStart == -1 || offset < dirtyStart)	dirtyStart = offset;
+	if (end > dirtyEnd)	dirtyEnd = end;
+}
+
+bool BlockDevice::enableMapping() {
+	if (fd == -1)	return false;
+	if (mapping)	return true;
+	struct stat st;
+	if (::fstat(fd, &st) == -1 || st.st_size <= 0)	return false;
+	void* addr = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)	return false;
+	cache.reset(); // Reads must not see blocks older than the mapping
+	mapping = static_cast<char*>(addr);
+	mappingSize = static_cast<size_t>(st.st_size);
+	return true;
+}
+
+void BlockDevice::unmap() {
+	if (!mapping)	return;
+	::msync(mapping, mappingSize, MS_SYNC);
+	::munmap(mapping, mappingSize);
+	mapping = nullptr;
+	mappingSize = 0;
+	dirtyStart = dirtyEnd = -1;
+}
+
+void BlockDevice::enableCache(size_t capacityBlocks, size_t shardCount) {
+	if (fd == -1 || mapping || capacityBlocks == 0)	return;
+	cache = std::make_unique<BufferCache>(*this, capacityBlocks, shardCount);
+}
+
+CacheStats BlockDevice::cacheStats() {
+	if (!cache)	return CacheStats();
+	return cache->stats();
+}
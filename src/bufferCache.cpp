@@ -0,0 +1,187 @@
+#include "bufferCache.h"
+#include "blockDevice.h"
+
+#include <algorithm>
+#include <chrono>
+
+BufferCache::BufferCache(BlockDevice& device, size_t capacityBlocks, size_t shardCount) : device(device), shards(std::max<size_t>(shardCount, 1)) {
+	shardCapacity = std::max<size_t>(capacityBlocks / shards.size(), 1);
+	flusher = std::thread(&BufferCache::flusherLoop, this);
+}
+
+BufferCache::~BufferCache() {
+	{
+		std::unique_lock<std::mutex> lock(flusherMutex);
+		stopFlusher = true;
+	}
+	flusherCV.notify_all();
+	if (flusher.joinable())	flusher.join();
+	flush();
+}
+
+BufferCache::Shard& BufferCache::shardFor(int64_t block) {
+	return shards[static_cast<size_t>(block) % shards.size()];
+}
+
+// Caller holds shard.lock. With load == false the block is about to be fully
+// overwritten, so a miss does not read it from the image.
+BufferCache::CachedBlock* BufferCache::getBlock(Shard& shard, int64_t block, bool load) {
+	auto it = shard.blocks.find(block);
+	if (it != shard.blocks.end()) {
+		hits++;
+		shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lruPosition);
+		return &it->second;
+	}
+	misses++;
+
+	while (shard.blocks.size() >= shardCapacity) {
+		if (!evict(shard))	return nullptr;
+	}
+	CachedBlock entry;
+	entry.data.resize(BLOCK_SIZE);
+	if (load && !device.rawReadAt(static_cast<off_t>(block) * BLOCK_SIZE, BLOCK_SIZE, entry.data.data()))	return nullptr;
+	shard.lru.push_front(block);
+	entry.lruPosition = shard.lru.begin();
+	return &shard.blocks.emplace(block, std::move(entry)).first->second;
+}
+
+bool BufferCache::writeBack(int64_t block, CachedBlock& entry) {
+	if (!device.rawWriteAt(static_cast<off_t>(block) * BLOCK_SIZE, BLOCK_SIZE, entry.data.data()))	return false;
+	entry.dirty = false;
+	writebacks++;
+	return true;
+}
+
+bool BufferCache::evict(Shard& shard) {
+	if (shard.lru.empty())	return false;
+	const int64_t victim = shard.lru.back();
+	CachedBlock& entry = shard.blocks[victim];
+	if (entry.dirty) {
+		if (!writeBack(victim, entry))	return false;
+		shard.dirtyCount--;
+	}
+	shard.lru.pop_back();
+	shard.blocks.erase(victim);
+	evictions++;
+	return true;
+}
+
+bool BufferCache::read(off_t offset, size_t length, char* buffer) {
+	size_t done = 0;
+	while (done < length) {
+		const off_t position = offset + static_cast<off_t>(done);
+		const int64_t block = position / BLOCK_SIZE;
+		const size_t inBlock = static_cast<size_t>(position % BLOCK_SIZE);
+		const size_t chunk = std::min(length - done, static_cast<size_t>(BLOCK_SIZE) - inBlock);
+
+		Shard& shard = shardFor(block);
+		std::unique_lock<std::mutex> lock(shard.lock);
+		CachedBlock* entry = getBlock(shard, block, true);
+		if (!entry)	return false;
+		memcpy(buffer + done, entry->data.data() + inBlock, chunk);
+		done += chunk;
+	}
+	return true;
+}
+
+bool BufferCache::write(off_t offset, size_t length, const char* buffer) {
+	size_t done = 0;
+	while (done < length) {
+		const off_t position = offset + static_cast<off_t>(done);
+		const int64_t block = position / BLOCK_SIZE;
+		const size_t inBlock = static_cast<size_t>(position % BLOCK_SIZE);
+		const size_t chunk = std::min(length - done, static_cast<size_t>(BLOCK_SIZE) - inBlock);
+
+		Shard& shard = shardFor(block);
+		std::unique_lock<std::mutex> lock(shard.lock);
+		CachedBlock* entry = getBlock(shard, block, chunk != BLOCK_SIZE);
+		if (!entry)	return false;
+		memcpy(entry->data.data() + inBlock, buffer + done, chunk);
+		if (!entry->dirty) {
+			entry->dirty = true;
+			shard.dirtyCount++;
+		}
+		done += chunk;
+	}
+	return true;
+}
+
+bool BufferCache::flushShard(Shard& shard) {
+	std::unique_lock<std::mutex> lock(shard.lock);
+	if (shard.dirtyCount == 0)	return true;
+	std::vector<int64_t> dirtyBlocks;
+	for (auto& [block, entry] : shard.blocks) {
+		if (entry.dirty)	dirtyBlocks.push_back(block);
+	}
+	std::sort(dirtyBlocks.begin(), dirtyBlocks.end());
+	bool check = true;
+	for (const int64_t block : dirtyBlocks) {
+		if (writeBack(block, shard.blocks[block]))	shard.dirtyCount--;
+		else	check = false;
+	}
+	return check;
+}
+
+bool BufferCache::flush() {
+	bool check = true;
+	for (auto& shard : shards) {
+		if (!flushShard(shard))	check = false;
+	}
+	return check;
+}
+
+void BufferCache::flusherLoop() {
+	std::unique_lock<std::mutex> lock(flusherMutex);
+	while (!stopFlusher) {
+		flusherCV.wait_for(lock, std::chrono::milliseconds(CACHE_FLUSH_INTERVAL_MS));
+		if (stopFlusher)	break;
+		lock.unlock();
+		if (!flush())	std::cerr << "[Cache] Error: Background write-back failed.\n";
+		lock.lock();
+	}
+}
+
+// Drops cached copies without writing them back; used when the blocks are
+// discarded from the image underneath the cache.
+void BufferCache::invalidate(int64_t block, int64_t count) {
+	for (int64_t i = block; i < block + count; i++) {
+		Shard& shard = shardFor(i);
+		std::unique_lock<std::mutex> lock(shard.lock);
+		auto it = shard.blocks.find(i);
+		if (it == shard.blocks.end())	continue;
+		if (it->second.dirty)	shard.dirtyCount--;
+		shard.lru.erase(it->second.lruPosition);
+		shard.blocks.erase(it);
+	}
+}
+
+// Writes back dirty cached copies of the blocks in [block, block + count) so
+// the image file itself is current; used before reading it with sendfile.
+bool BufferCache::writeBackRange(int64_t block, int64_t count) {
+	bool check = true;
+	for (int64_t i = block; i < block + count; i++) {
+		Shard& shard = shardFor(i);
+		std::unique_lock<std::mutex> lock(shard.lock);
+		if (shard.dirtyCount == 0)	continue;
+		auto it = shard.blocks.find(i);
+		if (it == shard.blocks.end() || !it->second.dirty)	continue;
+		if (writeBack(i, it->second))	shard.dirtyCount--;
+		else	check = false;
+	}
+	return check;
+}
+
+CacheStats BufferCache::stats() {
+	CacheStats result;
+	result.hits = hits;
+	result.misses = misses;
+	result.evictions = evictions;
+	result.writebacks = writebacks;
+	result.capacity = shardCapacity * shards.size();
+	for (auto& shard : shards) {
+		std::unique_lock<std::mutex> lock(shard.lock);
+		result.cachedBlocks += shard.blocks.size();
+		result.dirtyBlocks += shard.dirtyCount;
+	}
+	return result;
+}
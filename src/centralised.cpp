@@ -3,114 +3,229 @@
 // BITMAP FAT Table
 // std::vector<bool> FATTABLE(TOTAL_BLOCKS, false);
 
-bool System::loadBitMap(std::fstream &disk){
+bool System::loadBitMap(BlockDevice &disk){
 	std::unique_lock<std::shared_mutex> lock(FATMutex);
-	std::vector<char> buffer(TOTAL_BLOCKS / 8, 0);
-	disk.seekg(BITMAP_START * BLOCK_SIZE, std::ios::beg);
-	disk.read(buffer.data(), static_cast<int>(buffer.size()));
-	if (disk.fail())	return false;
-	for (size_t i = 0; i < TOTAL_BLOCKS; i++)	FATTABLE[i] = (buffer[i / 8] >> (7 - (i % 8))) & 1;
+	FATTABLE.assign(superblock.totalBlocks);
+	if (!disk.readAt(static_cast<off_t>(superblock.bitmapStart) * BLOCK_SIZE, FATTABLE.byteSize(), FATTABLE.data()))	return false;
+	FATTABLE.recount();
+	// Metadata blocks are always in use, so a gap there means the old bit order
+	if (FATTABLE.findFree(0, superblock.dataStart) != Bitmap::npos){
+		FATTABLE.reverseByteBits();
+		if (FATTABLE.findFree(0, superblock.dataStart) != Bitmap::npos)	return false;
+		FATTABLE.markAllDirty();
+		std::cout << "\tConverted bitmap to word layout.\n";
+	}
+	buildAllocationGroups();
 	return true;
 }
-int System::saveBitMap(std::fstream &disk){
-	std::unique_lock<std::shared_mutex> lock(FATMutex);
-	std::vector<char> buffer(TOTAL_BLOCKS / 8, 0);
-	for (int i = 0; i < TOTAL_BLOCKS; i++){
-		buffer[i / 8] |= FATTABLE[i] << (7 - (i % 8));
+// Caller holds FATMutex exclusively.
+void System::buildAllocationGroups(){
+	const int64_t totalBlocks = static_cast<int64_t>(FATTABLE.size());
+	allocationGroups.clear();
+	for (int64_t start = superblock.dataStart; start < totalBlocks;){
+		auto group = std::make_unique<AllocationGroup>();
+		group->start = start;
+		group->end = std::min<int64_t>(totalBlocks, (start / ALLOCATION_GROUP_BLOCKS + 1) * ALLOCATION_GROUP_BLOCKS);
+		group->freeExtents.build(FATTABLE, group->start, group->end);
+		start = group->end;
+		allocationGroups.push_back(std::move(group));
 	}
-
-	disk.seekp(BITMAP_START * BLOCK_SIZE, std::ios::beg);
-	disk.write(buffer.data(), buffer.size());
-	if (disk.fail()){
+}
+int System::saveBitMap(BlockDevice &disk){
+	std::unique_lock<std::shared_mutex> lock(FATMutex);
+	if (!disk.writeAt(static_cast<off_t>(superblock.bitmapStart) * BLOCK_SIZE, FATTABLE.byteSize(), FATTABLE.data())){
 		std::cerr << "\tError: Cannot save bitmap to disk.\n";
-		disk.clear();
 		return 0;
 	}
-	disk.flush();
+	FATTABLE.takeDirtyPages();
 	// loadBitMap(disk);
 	std::cout << "\tSuccessfully saved bitmap to disk.\n";
 	return 1;
 }
-std::vector<int> System::allocateBitMapBlocks(std::fstream &disk, int numBlocks, ClientSession* session){
+// Writes back only the bitmap pages changed since the last flush. Called once
+// per operation (on journal commit) instead of after every allocate/free.
+int System::flushBitMap(BlockDevice &disk){
 	std::unique_lock<std::shared_mutex> lock(FATMutex);
-	std::vector<int> allocatedBlocks;
-	for (size_t i = DATA_START; i < TOTAL_BLOCKS; i++){
-		if (!FATTABLE[i]){
-			allocatedBlocks.push_back(i);
-			if (static_cast<int>(allocatedBlocks.size()) == numBlocks){
-				for (const int block : allocatedBlocks)	FATTABLE[block] = true;
-				// std::cerr << "\tAllocated all requested blocks.\n";
-				lock.unlock();
-				int save = saveBitMap(disk);
-				lock.lock();
-				if (save == 0){
-					for (const int block : allocatedBlocks)	FATTABLE[block] = false;
-					return {};
-				}
-				const std::vector<char> buffer(BLOCK_SIZE, 0);
-				for (const int block : allocatedBlocks) {
-					disk.seekp(block * BLOCK_SIZE, std::ios::beg);
-					disk.write(buffer.data(), BLOCK_SIZE);
-				}
-				return allocatedBlocks;
-			}
+	int check = 1;
+	for (const size_t page : FATTABLE.takeDirtyPages()){
+		const size_t offset = page * BLOCK_SIZE;
+		const size_t length = std::min<size_t>(BLOCK_SIZE, FATTABLE.byteSize() - offset);
+		if (!disk.writeAt(static_cast<off_t>(superblock.bitmapStart + page) * BLOCK_SIZE, length, FATTABLE.data() + offset)){
+			FATTABLE.markPageDirty(page);
+			check = 0;
 		}
 	}
-	if (static_cast<int>(allocatedBlocks.size()) != numBlocks){
-		for (const int block : allocatedBlocks)	FATTABLE[block] = false;
-		std::string msg("Error: Cannot allocate all requested blocks.\n");
-		session->msg.insert(session->msg.end(), msg.begin(), msg.end());;
-		return {};
+	if (check == 0)	std::cerr << "\tError: Cannot save bitmap to disk.\n";
+	return check;
+}
+// FATMutex is only taken shared here; each allocation group has its own lock.
+// The request is served from a single group when possible, starting with the
+// hinted one (parent directory or, without a hint, the calling thread).
+// Free blocks always read as zeros (see freeBitMapBlocks), so nothing is
+// written to the new blocks here.
+std::vector<int64_t> System::allocateBitMapBlocks(int64_t numBlocks, ClientSession* session, int groupHint){
+	std::shared_lock<std::shared_mutex> lock(FATMutex);
+	std::vector<int64_t> allocatedBlocks;
+	if (numBlocks <= 0 || allocationGroups.empty())	return {};
+	const size_t groups = allocationGroups.size();
+	const size_t preferred = (groupHint >= 0 ? static_cast<size_t>(groupHint) : std::hash<std::thread::id>{}(std::this_thread::get_id())) % groups;
+	auto takeFrom = [&](AllocationGroup& group, int64_t count){
+		const size_t first = allocatedBlocks.size();
+		group.freeExtents.allocate(count, allocatedBlocks);
+		for (size_t i = first; i < allocatedBlocks.size(); i++)	FATTABLE.set(allocatedBlocks[i]);
+	};
+
+	// First a group with one run large enough, then any group with enough space
+	for (int pass = 0; pass < 2 && allocatedBlocks.empty(); pass++){
+		for (size_t i = 0; i < groups; i++){
+			AllocationGroup& group = *allocationGroups[(preferred + i) % groups];
+			std::unique_lock<std::mutex> groupLock(group.lock);
+			const int64_t room = pass == 0 ? group.freeExtents.largestExtent() : group.freeExtents.available();
+			if (room < numBlocks)	continue;
+			takeFrom(group, numBlocks);
+			break;
+		}
 	}
-	return {};
+	if (allocatedBlocks.empty()){
+		// Spans groups; lock them all, in index order, so the total is stable
+		std::vector<std::unique_lock<std::mutex>> groupLocks;
+		int64_t available = 0;
+		for (auto& group : allocationGroups){
+			groupLocks.emplace_back(group->lock);
+			available += group->freeExtents.available();
+		}
+		if (available < numBlocks){
+			std::string msg("Error: Cannot allocate all requested blocks.\n");
+			if (session)	session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+			return {};
+		}
+		int64_t remaining = numBlocks;
+		for (size_t i = 0; i < groups && remaining > 0; i++){
+			AllocationGroup& group = *allocationGroups[(preferred + i) % groups];
+			const int64_t count = std::min(remaining, group.freeExtents.available());
+			takeFrom(group, count);
+			remaining -= count;
+		}
+		std::sort(allocatedBlocks.begin(), allocatedBlocks.end());
+	}
+	return allocatedBlocks;
 }
-void System::freeBitMapBlocks(std::fstream &disk, const std::vector<int> &blocks){
-	{
-		std::unique_lock<std::shared_mutex> lock(FATMutex);
-		if (blocks.empty())	return;
-		for (const int block : blocks){
-			if (block >= 0 && block < static_cast<int>(FATTABLE.size()))	FATTABLE[block] = false;
+// Returns how many blocks were released. A run that cannot be discarded stays
+// marked in use: handed out again, it would show its old contents.
+int64_t System::freeBitMapBlocks(const std::vector<int64_t> &blocks){
+	std::shared_lock<std::shared_mutex> lock(FATMutex);
+	int64_t released = 0;
+	std::vector<int64_t> sorted(blocks);
+	std::sort(sorted.begin(), sorted.end());
+	size_t i = 0;
+	while (i < sorted.size()){
+		if (sorted[i] < superblock.dataStart || sorted[i] >= static_cast<int64_t>(FATTABLE.size())){
+			i++;
+			continue;
+		}
+		AllocationGroup& group = *allocationGroups[groupOf(sorted[i])];
+		std::unique_lock<std::mutex> groupLock(group.lock);
+		std::vector<int64_t> freed;
+		for (; i < sorted.size() && sorted[i] < group.end; i++){
+			if (FATTABLE.test(sorted[i]) && (freed.empty() || freed.back() != sorted[i]))	freed.push_back(sorted[i]);
 		}
+		// Punch the runs out of the image before the blocks can be handed out again
+		std::vector<int64_t> discarded;
+		for (size_t start = 0; start < freed.size();){
+			size_t end = start + 1;
+			while (end < freed.size() && freed[end] == freed[end - 1] + 1)	end++;
+			if (device.discard(freed[start], static_cast<int64_t>(end - start)))	discarded.insert(discarded.end(), freed.begin() + start, freed.begin() + end);
+			else	std::cerr << "\tError: Cannot discard freed blocks " << freed[start] << " to " << freed[end - 1] << "; they stay allocated.\n";
+			start = end;
+		}
+		for (const int64_t block : discarded)	FATTABLE.reset(block);
+		group.freeExtents.release(discarded);
+		released += static_cast<int64_t>(discarded.size());
 	}
-	saveBitMap(disk);
 	// std::cout << "\tBitmap blocks freed.\n";
+	return released;
+}
+
+// Images older than version 1 may still hold file contents in free blocks,
+// which every allocation expects to read as zeros; they are punched once, on
+// upgrade.
+bool System::discardFreeBlocks(){
+	std::unique_lock<std::shared_mutex> lock(FATMutex);
+	for (auto& group : allocationGroups){
+		std::unique_lock<std::mutex> groupLock(group->lock);
+		for (const auto& [start, length] : group->freeExtents.runs()){
+			if (!device.discard(start, length))	return false;
+		}
+	}
+	return true;
 }
 
 // Directory Table
 // std::vector<FileEntry*> metaDataTable;
 // MetadataManager Entries = MetadataManager(ORDER);
 
-bool System::loadDirectoryTable(std::fstream &disk){
-	disk.clear();
+// A directory slot holds the serialized entry; an inline file's data
+// overwrites the entry's extent area and may run on to the end of the slot.
+static void packDirSlot(const FileEntry& file, char* slot, size_t slotSize){
+	const SerializableFileEntry entry(file);
+	memset(slot, 0, slotSize);
+	memcpy(slot, &entry, sizeof(entry));
+	if (!file.hasInlineData)	return;
+	char* data = slot + offsetof(SerializableFileEntry, extents);
+	memset(data, 0, sizeof(entry.extents));
+	memcpy(data, file.inlineData.data(), file.inlineData.size());
+}
+
+// Only named slots are loaded, so an entry after a blank slot lands at a lower
+// index than its slot; entriesMoved then tells the caller that a saved index
+// is stale.
+bool System::loadDirectoryTable(BlockDevice &disk, bool* entriesMoved){
 	std::unique_lock<std::shared_mutex> lock_meta(metaMutex);
 	std::unique_lock<std::shared_mutex> lock_dir(dirEntryMutex);
 	std::unique_lock<std::shared_mutex> lock_metaIndex(metaIndexMutex);
-	for (int i = 0; i < ROOT_DIR_BLOCKS; i++) {
+	bool blankSeen = false;
+	if (entriesMoved)	*entriesMoved = false;
+	for (int64_t i = 0; i < superblock.rootDirBlocks; i++) {
 		char buffer[BLOCK_SIZE];
-		disk.seekg((ROOT_DIR_START + i) * BLOCK_SIZE, std::ios::beg);
-		disk.read(buffer, BLOCK_SIZE);
-		if (disk.fail())	return false;
-		for (int j = 0; j < ORDER - 1; j++) {
-			SerializableFileEntry entry;
-			size_t offset = j * sizeof(SerializableFileEntry);
-			if (offset + sizeof(SerializableFileEntry) <= BLOCK_SIZE) {
-				memcpy(&entry, buffer + offset, sizeof(SerializableFileEntry));
-				FileEntry* toBeSaved = new FileEntry(entry);
+		if (!disk.readBlocks(superblock.rootDirStart + i, 1, buffer))	return false;
+		// Images older than version 2 hold 32-bit entries, and before version 4
+		// entries were packed rather than slotted, until they are rewritten
+		const size_t entrySize = imageVersion < 2 ? sizeof(SerializableFileEntryV1) : imageVersion < 4 ? sizeof(SerializableFileEntry) : superblock.dirSlotSize();
+		for (int j = 0; j < superblock.entriesPerDirBlock(); j++) {
+			size_t offset = j * entrySize;
+			if (offset + entrySize <= BLOCK_SIZE) {
+				FileEntry* toBeSaved;
+				if (imageVersion < 2) {
+					SerializableFileEntryV1 entry;
+					memcpy(&entry, buffer + offset, sizeof(entry));
+					toBeSaved = new FileEntry(entry);
+				} else {
+					SerializableFileEntry entry;
+					memcpy(&entry, buffer + offset, sizeof(entry));
+					if (imageVersion < 3)	entry.extentDepth = 0; // Was padding before the extent tree
+					toBeSaved = new FileEntry(entry);
+				}
 				if (toBeSaved->fileName[0] != '\0') {
-					metaDataTable.push_back(toBeSaved);
-					int index = Entries->getFile(toBeSaved->fileName);
-					if (index != -1 && index != static_cast<int>(metaDataTable.size()) - 1) {
-						Entries->updateIdx(toBeSaved->fileName, metaDataTable.size() - 1);
+					if (toBeSaved->extentDepth > 0 && !loadExtentTree(disk, toBeSaved))	return false;
+					if (toBeSaved->hasInlineData){
+						if (toBeSaved->fileSize < 0 || toBeSaved->fileSize > superblock.inlineDataCapacity()){
+							std::cerr << "\tError: Corrupt inline data in '" << toBeSaved->fileName << "'.\n";
+							return false;
+						}
+						toBeSaved->inlineData.assign(buffer + offset + offsetof(SerializableFileEntry, extents), toBeSaved->fileSize);
 					}
+					metaDataTable.push_back(toBeSaved);
+					if (blankSeen && entriesMoved)	*entriesMoved = true;
 					metaIndex++;
 					if (toBeSaved->isDirectory)	availableDirEntry++;
 				}
+				else	blankSeen = true;
 			}
 		}
 	}
 	return true;
 }
-int System::saveDirectoryTable(std::fstream &disk, int index, ClientSession* session){
+int System::saveDirectoryTable(BlockDevice &disk, int index, ClientSession* session){
 	if (index < 0 || index >= static_cast<int>(metaDataTable.size())) {
 		// std::cerr << "\tError: Index out of bounds while saving FileEntry/rootDirectory to disk.\n";
 		std::string msg("Error: Index out of bounds while saving FileEntry/rootDirectory to disk.\n");
@@ -118,93 +233,150 @@ int System::saveDirectoryTable(std::fstream &disk, int index, ClientSession* ses
 		return 0;
 	}
 	std::unique_lock<std::shared_mutex> lock(metaMutex);
-	const int blocksPassed = index / (ORDER - 1); // Since each block record stores only ORDER entries
-	const int blockToModify = index % (ORDER - 1);
-	auto entryToSave = SerializableFileEntry(*metaDataTable[index]);
-	disk.seekp((ROOT_DIR_START + blocksPassed) * BLOCK_SIZE + (blockToModify * sizeof(FileEntry)), std::ios::beg);
-	disk.write(reinterpret_cast<char*>(&entryToSave), sizeof(SerializableFileEntry));
-	if (disk.fail()){
+	const int blocksPassed = index / superblock.entriesPerDirBlock(); // Each block stores order - 1 entries
+	const int blockToModify = index % superblock.entriesPerDirBlock();
+	std::vector<int64_t> staleBlocks;
+	if (!storeExtentTree(disk, metaDataTable[index], session, staleBlocks))	return 0;
+	const size_t slotSize = superblock.dirSlotSize();
+	std::vector<char> slot(slotSize);
+	packDirSlot(*metaDataTable[index], slot.data(), slotSize);
+	const off_t offset = static_cast<off_t>(superblock.rootDirStart + blocksPassed) * BLOCK_SIZE + blockToModify * slotSize;
+	if (!disk.writeAt(offset, slotSize, slot.data())){
 		std::string msg("Error: Failed to save root directory to disk.\n");
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
         // std::cerr << "\tError: Failed to save root directory to disk.\n";
-		disk.clear();
 		return 0;
     }
-	disk.flush();
+	if (!staleBlocks.empty())	adjustFreeBlocks(freeBitMapBlocks(staleBlocks));
 	return 1;
 }
-int System::saveDirectoryTableEntire(std::fstream &disk){
+int System::saveDirectoryTableEntire(BlockDevice &disk){
 	std::unique_lock<std::shared_mutex> lock(metaMutex);
 	int entryIndex = 0;
 	const int totalEntries = static_cast<int>(metaDataTable.size());
-	for (int i = 0; i < ROOT_DIR_BLOCKS && entryIndex < totalEntries; i++) {
+	std::vector<int64_t> staleBlocks;
+	for (FileEntry* entry : metaDataTable){
+		if (!storeExtentTree(disk, entry, nullptr, staleBlocks))	std::cerr << "\tError: Cannot save extent tree of '" << entry->fileName << "'.\n";
+	}
+	int64_t i = 0;
+	for (; i < superblock.rootDirBlocks && entryIndex < totalEntries; i++) {
 		char buffer[BLOCK_SIZE] = {0};
 
-		for (int j = 0; j < (ORDER - 1) && entryIndex < totalEntries; j++) {
-			size_t offset = j * sizeof(SerializableFileEntry);
-			if (entryIndex < totalEntries && (offset + sizeof(SerializableFileEntry) <= BLOCK_SIZE)){
-				SerializableFileEntry toSave = SerializableFileEntry(*metaDataTable[entryIndex]);
-				memcpy(buffer + offset, &toSave, sizeof(SerializableFileEntry));
-				entryIndex++;
-			}
+		const size_t slotSize = superblock.dirSlotSize();
+		for (int j = 0; j < superblock.entriesPerDirBlock() && entryIndex < totalEntries; j++) {
+			packDirSlot(*metaDataTable[entryIndex], buffer + j * slotSize, slotSize);
+			entryIndex++;
 		}
 
-		disk.seekp((ROOT_DIR_START + i) * BLOCK_SIZE, std::ios::beg);
-		disk.write(buffer, BLOCK_SIZE);
-		if (disk.fail()){
+		if (!disk.writeBlocks(superblock.rootDirStart + i, 1, buffer)){
 			std::cerr << "\tError: Failed to save root directory to disk.\n";
-			disk.clear();
 			return 0;
 		}
 	}
-	disk.flush();
+	// Clear whatever an earlier, longer (or older-format) table left behind
+	if (i < superblock.rootDirBlocks && !disk.discard(superblock.rootDirStart + i, superblock.rootDirBlocks - i)){
+		std::cerr << "\tError: Failed to clear the rest of the root directory.\n";
+		return 0;
+	}
+	if (!staleBlocks.empty())	adjustFreeBlocks(freeBitMapBlocks(staleBlocks));
 	return 1;
 }
 
 // Superblock
 // Superblock superblock;
 
-bool System::loadSuperblock(std::fstream &disk){
+// Older images are read into the current in-memory form; loadFromDisk then
+// rewrites them (see imageVersion).
+bool System::loadSuperblock(BlockDevice &disk){
 	std::unique_lock<std::shared_mutex> lock(superblockMutex);
-	disk.seekg(SUPER_BLOCK_START * BLOCK_SIZE, std::ios::beg);
-	disk.read(reinterpret_cast<char*>(&superblock), sizeof(Superblock));
+	char buffer[sizeof(Superblock)];
+	if (!disk.readAt(static_cast<off_t>(SUPER_BLOCK_START) * BLOCK_SIZE, sizeof(buffer), buffer))	return false;
+	memcpy(&superblock, buffer, sizeof(Superblock));
+	if (superblock.magic == SUPERBLOCK_MAGIC){
+		if (superblock.blockSize != BLOCK_SIZE || superblock.version > SUPERBLOCK_VERSION){
+			std::cerr << "\tError: Unsupported image (version " << superblock.version << ", block size " << superblock.blockSize << ").\n";
+			return false;
+		}
+		imageVersion = superblock.version;
+		if (imageVersion >= 2){
+			superblock.version = SUPERBLOCK_VERSION;
+			usersOffset = sizeof(Superblock);
+			return true;
+		}
+		SuperblockV1 v1;
+		memcpy(&v1, buffer, sizeof(SuperblockV1));
+		superblock.version = SUPERBLOCK_VERSION;
+		superblock.maxFiles = v1.maxFiles;
+		superblock.order = v1.order;
+		superblock.totalBlocks = v1.totalBlocks;
+		superblock.freeBlocks = v1.freeBlocks;
+		superblock.maxBlocks = v1.maxBlocks;
+		superblock.bitmapStart = v1.bitmapStart;
+		superblock.bitmapBlocks = v1.bitmapBlocks;
+		superblock.bplusTreeStart = v1.bplusTreeStart;
+		superblock.bplusTreeBlocks = v1.bplusTreeBlocks;
+		superblock.rootDirStart = v1.rootDirStart;
+		superblock.rootDirBlocks = v1.rootDirBlocks;
+		superblock.dataStart = v1.dataStart;
+		usersOffset = sizeof(SuperblockV1);
+		return true;
+	}
+	// Images formatted before the geometry was recorded used the old fixed layout
+	LegacySuperblock legacy;
+	memcpy(&legacy, buffer, sizeof(LegacySuperblock));
+	if (legacy.blockSize != BLOCK_SIZE){
+		std::cerr << "\tError: Unrecognised superblock.\n";
+		return false;
+	}
+	imageVersion = 0;
+	FormatOptions options;
+	options.diskSize = static_cast<uint64_t>(legacy.totalBlocks) * BLOCK_SIZE;
+	options.maxDiskSize = options.diskSize;
+	std::string error;
+	if (!superblock.layout(options, error) || static_cast<off_t>(superblock.dataStart) * BLOCK_SIZE != legacy.dataStart){
+		std::cerr << "\tError: Unrecognised superblock.\n";
+		return false;
+	}
+	superblock.freeBlocks = legacy.freeBlocks;
+	usersOffset = sizeof(LegacySuperblock);
 	return true;
 }
-int System::saveSuperblock(std::fstream &disk){
+// Allocations run in parallel, so every change to freeBlocks is made here,
+// under superblockMutex, as a delta.
+void System::adjustFreeBlocks(int64_t delta){
+	std::unique_lock<std::shared_mutex> lock(superblockMutex);
+	superblock.freeBlocks += delta;
+}
+int64_t System::availableBlocks(){
+	std::shared_lock<std::shared_mutex> lock(superblockMutex);
+	return superblock.freeBlocks - reservedBlocks;
+}
+int System::saveSuperblock(BlockDevice &disk){
 	std::unique_lock<std::shared_mutex> lock(superblockMutex);
-	disk.seekp(SUPER_BLOCK_START * BLOCK_SIZE, std::ios::beg);
-	disk.write(reinterpret_cast<char*>(&superblock), sizeof(Superblock));
-	if (disk.fail()){
+	if (!disk.writeAt(static_cast<off_t>(SUPER_BLOCK_START) * BLOCK_SIZE, sizeof(Superblock), reinterpret_cast<char*>(&superblock))){
 		std::cerr << "\tError: Failed to save superblock to disk.\n";
-		disk.clear();
 		return 0;
 	}
-	disk.flush();
 	return 1;
 }
 
 // Users
-int System::saveUsers(std::fstream& disk) {
+int System::saveUsers(BlockDevice& disk) {
 	std::unique_lock<std::shared_mutex> lock(userDataMutex);
-	disk.seekp(SUPER_BLOCK_START + sizeof(Superblock), std::ios::beg);
-	disk.write(reinterpret_cast<char*>(&totalUsers), sizeof(int));
+	disk.writeAt(SUPER_BLOCK_START + usersOffset, sizeof(int), reinterpret_cast<char*>(&totalUsers));
 	for (int i = 0; i < totalUsers; i++){
 		if (!userDatabase[i])	continue;
 		User userTS = *userDatabase[i];
-		disk.seekp(SUPER_BLOCK_START + sizeof(Superblock) + sizeof(int) + (sizeof(User) * i), std::ios::beg);
-		disk.write(reinterpret_cast<char*>(&userTS), sizeof(User));
-		if (disk.fail()){
+		if (!disk.writeAt(SUPER_BLOCK_START + usersOffset + sizeof(int) + (sizeof(User) * i), sizeof(User), reinterpret_cast<char*>(&userTS))){
 			std::cerr << "\tError: Failed to save user details at index " << i << ".\n";
-			disk.clear();
 			return 0;
 		}
 	}
-	disk.flush();
 	// std::cout << "Successfully saved user information.\n";
 	return 1;
 }
 
-bool System::loadUsers(std::fstream& disk) {
+bool System::loadUsers(BlockDevice& disk) {
 	std::shared_lock<std::shared_mutex> lock_userData(userDataMutex);
 	std::shared_lock<std::shared_mutex> lock_userTable(userTableMutex);
 	std::shared_lock<std::shared_mutex> lock_groupTable(groupTableMutex);
@@ -214,18 +386,13 @@ bool System::loadUsers(std::fstream& disk) {
 	userDatabase.clear();
 	groupTable.clear();
 	totalUsers = 0;
-	disk.clear();
-	disk.seekg(SUPER_BLOCK_START + sizeof(Superblock), std::ios::beg);
-	disk.read(reinterpret_cast<char*>(&totalUsers), sizeof(int));
-	if (disk.fail()) {
+	if (!disk.readAt(SUPER_BLOCK_START + usersOffset, sizeof(int), reinterpret_cast<char*>(&totalUsers))) {
 		std::cerr << "Error: Failed to read total users.\n";
-		disk.clear();
 		return false;
 	}
 	for (int i = 0; i < totalUsers; i++) {
 		User* userRet = new User();
-		disk.seekg(SUPER_BLOCK_START + sizeof(Superblock) + sizeof(int) + sizeof(User) * i, std::ios::beg);
-		disk.read(reinterpret_cast<char*>(userRet), sizeof(User));
+		disk.readAt(SUPER_BLOCK_START + usersOffset + sizeof(int) + sizeof(User) * i, sizeof(User), reinterpret_cast<char*>(userRet));
 		userDatabase.push_back(userRet);
 		std::string name(userRet->userName);
 		userTable[userRet->user_id] = name;
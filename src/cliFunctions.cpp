@@ -10,11 +10,18 @@ void System::printHelpM(ClientSession* session) {
               		 "rmdir <name>\n"
               		 "create <filename> <fileSize(optional)>\n"
               		 "write <filename> \"<fileContent(in quotes)>\"\n"
+              		 "write <filename> <offset> \"<fileContent(in quotes)>\"\n"
               		 "append <filename> \"<fileContent(in quotes)>\"\n"
               		 "read <filename>\n"
+              		 "read <filename> <offset> <length>\n"
               		 "rm <filename>\n"
               		 "rename <old> <new>\n"
               		 "stat <filename>\n"
+              		 "open <filename>\n"
+              		 "close <handle>\n"
+              		 "hread <handle> <offset> <length>\n"
+              		 "hwrite <handle> <offset> \"<fileContent(in quotes)>\"\n"
+              		 "hstat <handle>\n"
 			  		 "chmod <filename> <permissions>\n"
 			  		 "chown <filename> <owner_id:group_id>\n"
 			  		 "chgrp <filename> <group_id>\n"
@@ -24,6 +31,8 @@ void System::printHelpM(ClientSession* session) {
 			  		 "showusr\n"
 			  		 "showgrp\n"
 			  		 "tree\n"	  
+			  		 "cachestat\n"
+			  		 "grow <size_MB>\n"
               		 "exit\n");
 	session->msg.insert(session->msg.end(), msg.begin(), msg.end());
 }
@@ -33,8 +42,8 @@ bool System::chmodFileM(const std::string& fileName, int newPermissions, ClientS
 	session->oss.str("");
 	session->oss.clear();
 	
-	std::fstream disk(DISK_PATH, std::ios::binary | std::ios::out | std::ios::in);
-	if (!disk.is_open()) {
+	BlockDevice& disk = device;
+	if (!disk.isOpen()) {
 		session->oss << "Error: Disk file is not open for writing.(writing to '" << fileName << "')\n";
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -83,7 +92,6 @@ bool System::chmodFileM(const std::string& fileName, int newPermissions, ClientS
         return false;
     }
 	// std::cout << "Successfully updated the permissions.\n";
-	disk.close();
 	return true;
 }
 
@@ -92,8 +100,8 @@ bool System::chownM(const std::string& fileName, const std::string& changeOwners
 	session->oss.str("");
 	session->oss.clear();
 	
-	std::fstream disk(DISK_PATH, std::ios::binary | std::ios::out | std::ios::in);
-	if (!disk.is_open()) {
+	BlockDevice& disk = device;
+	if (!disk.isOpen()) {
 		session->oss << "Error: Disk file is not open for writing.(writing to '" << fileName << "')\n";
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -166,7 +174,6 @@ bool System::chownM(const std::string& fileName, const std::string& changeOwners
         return false;
     }
 	// std::cout << "Successfully updated the permissions.\n";
-	disk.close();
 	return true;
 }
 
@@ -175,8 +182,8 @@ bool System::chgrpCommand(const std::string& fileName, uint32_t new_group_id, Cl
 	session->oss.str("");
 	session->oss.clear();
 	
-	std::fstream disk(DISK_PATH, std::ios::binary | std::ios::out | std::ios::in);
-	if (!disk.is_open()) {
+	BlockDevice& disk = device;
+	if (!disk.isOpen()) {
 		session->oss << "Error: Disk file is not open for writing.(writing to '" << fileName << "')\n";
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -224,7 +231,6 @@ bool System::chgrpCommand(const std::string& fileName, uint32_t new_group_id, Cl
         return false;
     }
 	// std::cout << "Successfully updated the permissions.\n";
-	disk.close();
 
 	return true;
 }
@@ -273,6 +279,7 @@ void System::loginM(const std::string& username, const std::string& password, Cl
 		strncpy(userOrg->userName, "root", USER_NAME_LENGTH);
 		userOrg->userName[USER_NAME_LENGTH - 1] = '\0';
 		userOrg->password = 0;
+		closeAllHandles(session); // Handles carry the previous user's permissions
 		session->user = *userOrg;
 		session->currentDirectory = 0;
 		
@@ -281,9 +288,10 @@ void System::loginM(const std::string& username, const std::string& password, Cl
 		// std::cout << "Login successful! Welcome, " << username << ".\n";
 		return;
 	}
-	const int passwordHashed = hashFileName(password);
+	const int passwordHashed = hashPassword(password);
 	for (const auto& entry : userDatabase) {
 		if (entry->userName == username && entry->password == passwordHashed) {
+			closeAllHandles(session);
 			session->user = *entry;
 			session->currentDirectory = 0;
 			journalManager->recoverUncommitedOperations(session->user.userName, session);
@@ -318,7 +326,7 @@ void System::userAddM(const std::string& userName, const std::string& password,
 	User* userN = new User();
 	strncpy(userN->userName, userName.c_str(), USER_NAME_LENGTH);
 	userN->userName[USER_NAME_LENGTH - 1] = '\0';
-	userN->password = hashFileName(password);
+	userN->password = hashPassword(password);
 	userN->user_id = 1000 + (++totalUsers);
 	userN->group_id = group_id;
 	userDatabase.push_back(userN);
@@ -386,7 +394,7 @@ void System::treeM(ClientSession* session, const std::string& path, int depth, c
 	session->oss.str("");
 	session->oss.clear();
 	
-	std::fstream disk(DISK_PATH, std::ios::binary | std::ios::out | std::ios::in);
+	BlockDevice& disk = device;
 	FileEntry* dir = nullptr;
 	if (path != "/"){
 		dir = resolvePath(disk, path, session);
@@ -433,3 +441,27 @@ void System::treeM(ClientSession* session, const std::string& path, int depth, c
 		}
 	}
 }
+
+void System::cacheStatsM(ClientSession* session) {
+	session->msg.clear();
+	session->oss.str("");
+	session->oss.clear();
+
+	if (device.isMapped()) {
+		session->oss << "Disk image is memory-mapped; the block cache is disabled.\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return;
+	}
+	const CacheStats stats = device.cacheStats();
+	const uint64_t lookups = stats.hits + stats.misses;
+	session->oss << "Cached blocks : " << stats.cachedBlocks << " / " << stats.capacity << "\n";
+	session->oss << "Dirty blocks  : " << stats.dirtyBlocks << "\n";
+	session->oss << "Hits          : " << stats.hits << "\n";
+	session->oss << "Misses        : " << stats.misses << "\n";
+	session->oss << "Hit ratio     : " << (lookups ? (100.0 * stats.hits / lookups) : 0.0) << "%\n";
+	session->oss << "Evictions     : " << stats.evictions << "\n";
+	session->oss << "Write-backs   : " << stats.writebacks << "\n";
+	std::string msg = session->oss.str();
+	session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+}
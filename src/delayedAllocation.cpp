@@ -0,0 +1,121 @@
+#include "delayedAllocation.h"
+
+// Blocks needed to append length bytes to the file. An inline file that
+// outgrows its directory entry moves to blocks as a whole.
+static int64_t blocksForAppend(const FileEntry* file, size_t length, int64_t inlineCapacity) {
+	const int64_t fileSize = file->fileSize;
+	if (file->hasInlineData) {
+		const int64_t total = fileSize + static_cast<int64_t>(length);
+		return (total <= inlineCapacity) ? 0 : (total + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	}
+	const int64_t used = fileSize % BLOCK_SIZE;
+	const int64_t remaining = (used == 0) ? 0 : BLOCK_SIZE - used;
+	const int64_t spill = static_cast<int64_t>(length) - remaining;
+	return (spill <= 0) ? 0 : (spill + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Caller holds the file's write lock.
+bool System::bufferAppend(int fileIndex, FileEntry* file, const std::string& data, uint64_t timestamp, ClientSession* session) {
+	std::unique_lock<std::mutex> lock(delayedMutex);
+	DelayedAppend& pending = delayedAppends[fileIndex];
+	const int64_t needed = blocksForAppend(file, pending.data.size() + data.size(), superblock.inlineDataCapacity());
+	if (needed - pending.reservedBlocks > availableBlocks()) {
+		if (pending.data.empty())	delayedAppends.erase(fileIndex);
+		session->oss << "Error: Not enough storage to append data.\n";
+		return false;
+	}
+	reservedBlocks += needed - pending.reservedBlocks;
+	pending.reservedBlocks = needed;
+	pending.file = file;
+	pending.data += data;
+	pending.timestamps.push_back(timestamp);
+	return true;
+}
+
+size_t System::pendingBytes(int fileIndex) {
+	std::unique_lock<std::mutex> lock(delayedMutex);
+	auto it = delayedAppends.find(fileIndex);
+	return (it == delayedAppends.end()) ? 0 : it->second.data.size();
+}
+
+size_t System::pendingBytes(const FileEntry* file) {
+	std::unique_lock<std::mutex> lock(delayedMutex);
+	for (const auto& [index, pending] : delayedAppends) {
+		if (pending.file == file)	return pending.data.size();
+	}
+	return 0;
+}
+
+// Chooses blocks for everything buffered on the file and writes it through the
+// normal append path. Caller holds the file's write lock (or is unmounting).
+bool System::flushDelayedAppend(int fileIndex, FileEntry* file, ClientSession* session) {
+	DelayedAppend pending;
+	{
+		std::unique_lock<std::mutex> lock(delayedMutex);
+		auto it = delayedAppends.find(fileIndex);
+		if (it == delayedAppends.end())	return true;
+		pending = std::move(it->second);
+		delayedAppends.erase(it);
+	}
+	// writeFileData resolves the parent directory as the owner, and its size
+	// accounting is carried over to the owner's record
+	ClientSession owner;
+	owner.user.user_id = file->owner_id;
+	owner.user.group_id = file->group_id;
+	User* ownerRecord = nullptr;
+	{
+		std::shared_lock<std::shared_mutex> lock(userDataMutex);
+		for (User* user : userDatabase) {
+			if (user && user->user_id == file->owner_id) {
+				ownerRecord = user;
+				owner.user = *user;
+				break;
+			}
+		}
+	}
+	const uint32_t sizeBefore = owner.user.totalSize;
+	// The reservation is held until the blocks are chosen, and counts as
+	// available to this write only
+	writeFileData(*this, &owner, device, file, fileIndex, pending.data, true, pending.reservedBlocks);
+	reservedBlocks -= pending.reservedBlocks;
+	const uint32_t sizeChange = owner.user.totalSize - sizeBefore;
+	if (ownerRecord && sizeChange != 0) {
+		std::unique_lock<std::shared_mutex> lock(userDataMutex);
+		ownerRecord->totalSize += sizeChange;
+	}
+	if (session && session->user.user_id == file->owner_id)	session->user.totalSize += sizeChange;
+
+	// Only data that reached the image is committed; on failure the journal
+	// entries stay uncommitted, so recovery replays the appends
+	const std::string errors = owner.oss.str() + owner.msg;
+	if (errors.empty()) {
+		for (const uint64_t timestamp : pending.timestamps)	journalManager->markCommitted(timestamp);
+		return true;
+	}
+	if (session)	session->oss << errors;
+	else	std::cerr << errors;
+	return false;
+}
+
+// The buffered data is superseded (overwrite or delete); nothing reaches the image.
+void System::discardDelayedAppend(int fileIndex) {
+	DelayedAppend pending;
+	{
+		std::unique_lock<std::mutex> lock(delayedMutex);
+		auto it = delayedAppends.find(fileIndex);
+		if (it == delayedAppends.end())	return;
+		pending = std::move(it->second);
+		delayedAppends.erase(it);
+		reservedBlocks -= pending.reservedBlocks;
+	}
+	for (const uint64_t timestamp : pending.timestamps)	journalManager->markCommitted(timestamp);
+}
+
+void System::flushAllDelayedAppends() {
+	std::vector<std::pair<int, FileEntry*>> files;
+	{
+		std::unique_lock<std::mutex> lock(delayedMutex);
+		for (const auto& [index, pending] : delayedAppends)	files.emplace_back(index, pending.file);
+	}
+	for (const auto& [index, file] : files)	flushDelayedAppend(index, file, nullptr);
+}
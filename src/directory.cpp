@@ -21,7 +21,7 @@ bool System::createDirectory(const std::string &directoryName, ClientSession* se
 			std::shared_lock<std::shared_mutex> lock(metaMutex);
 			dir = metaDataTable[dirID];
 		}
-		if (currentIndex < 0 || currentIndex >= MAX_FILES || (dir && dir->isDirectory && dir->owner_id == session->user.user_id)) {
+		if (currentIndex < 0 || currentIndex >= superblock.maxFiles || (dir && dir->isDirectory && dir->owner_id == session->user.user_id)) {
 			session->oss << "Error: Directory " << directoryName << " already exists.\n";
 			std::string msg = session->oss.str();
 			session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -32,7 +32,7 @@ bool System::createDirectory(const std::string &directoryName, ClientSession* se
 	
 	{
 		std::shared_lock<std::shared_mutex> lock(metaIndexMutex);
-		if (metaIndex >= MAX_FILES) {
+		if (metaIndex >= superblock.maxFiles) {
 			session->oss << "Error: Not enough storage space for creating new directory.\n";
 			std::string msg = session->oss.str();
 			session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -55,7 +55,13 @@ bool System::createDirectory(const std::string &directoryName, ClientSession* se
 
 	{
 		std::shared_lock<std::shared_mutex> lock(metaIndexMutex);
-		Entries->insertFileEntry(savedDir, metaIndex);
+		if (!Entries->insertFileEntry(savedDir, metaIndex)) {
+			session->oss << "Error: Cannot add directory " << directoryName << " to the file index.\n";
+			std::string msg = session->oss.str();
+			session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+			delete newDir;
+			return false;
+		}
 	}
 	{
 		std::unique_lock<std::shared_mutex> lock(metaMutex);
@@ -70,7 +76,7 @@ bool System::createDirectory(const std::string &directoryName, ClientSession* se
 	return true;
 }
 
-FileEntry* System::resolvePath(std::fstream &disk, const std::string &path, ClientSession* session){
+FileEntry* System::resolvePath(BlockDevice &disk, const std::string &path, ClientSession* session){
 	if (!disk){
 		std::cerr << "Error: Cannot access disk while resolving path.\n";
 		return nullptr;
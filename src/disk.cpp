@@ -1,129 +1,93 @@
 #include "disk.h"
 
-bool initialiseDisk(const std::string& diskName){
-	std::ofstream disk(diskName, std::ios::binary);
-	disk.clear();
-	if (!disk){
-		std::cerr << "Error: Cannot create the disk file.\n";
-		return false;
-	}
-	
-	std::vector<char> emptyBlock(DISK_SIZE, 0);
-	disk.write(reinterpret_cast<char*>(emptyBlock.data()), static_cast<int>(emptyBlock.size()));
-	if (!disk.good()){
+bool initialiseDisk(System& fs, const std::string& diskName){
+	if (!fs.device.create(diskName, static_cast<off_t>(fs.superblock.totalBlocks) * BLOCK_SIZE)){
 		std::cerr << "Error: Cannot create the disk file.\n";
 		return false;
 	}
-	disk.flush();
 	std::cout << "Disk successfully created.\n";
-	disk.close();
-
 	return true;
 }
 
 bool initialiseSuperblock(System& fs) {
-	std::fstream disk(fs.DISK_PATH, std::ios::in | std::ios::out | std::ios::binary);
+	BlockDevice& disk = fs.device;
 	if (!disk){
 		std::cerr << "Error: Cannot open disk for superblock initialisation.\n";
 		return false;
 	}
-	Superblock* superblock = new Superblock();
-	{
-		std::unique_lock<std::shared_mutex> lock(fs.superblockMutex);
-		superblock->blockSize = BLOCK_SIZE;
-		superblock->totalBlocks = TOTAL_BLOCKS;
-		superblock->freeBlocks = TOTAL_BLOCKS - (SUPER_BLOCKS + BITMAP_BLOCKS + ROOT_DIR_BLOCKS + BPLUS_TREE_BLOCKS);
-		superblock->fatStart = BITMAP_START * BLOCK_SIZE;
-		superblock->dataStart = DATA_START * BLOCK_SIZE;
-	}
-	disk.seekp(SUPER_BLOCK_START * BLOCK_SIZE, std::ios::beg);
-	disk.write(reinterpret_cast<char*>(superblock), sizeof(Superblock));
-	fs.loadSuperblock(disk);
-	if (disk.fail()){
+	bool check = disk.writeAt(static_cast<off_t>(SUPER_BLOCK_START) * BLOCK_SIZE, sizeof(Superblock), reinterpret_cast<char*>(&fs.superblock));
+	if (!check || !fs.loadSuperblock(disk)){
 		std::cout << "Error: Cannot load superblock into memory.\n";
-		disk.clear();
 		return false;
 	}
 	std::cout << "Superblock initialised and stored on disk.\n";
 	std::cout << "Successfully loaded superblock in memory.\n";
-	
-	delete superblock;
-	disk.close();
 	return true;
 }
 
 bool initialiseFAT(System& fs){
-	std::fstream disk(fs.DISK_PATH, std::ios::in | std::ios::out | std::ios::binary);
+	BlockDevice& disk = fs.device;
 	if (!disk){
 		std::cerr << "Error: Cannot open disk for FAT table initialisation.\n";
 		return false;
 	}
 
-	std::vector<char> buffer(TOTAL_BLOCKS / 8, 0);
-
-	for (int i = 0; i < DATA_START; i++){
-		buffer[i / 8] |= (1 << (7 - (i % 8)));
-	}
-	disk.seekp(BITMAP_START * BLOCK_SIZE, std::ios::beg);
-	disk.write(buffer.data(), buffer.size());
-	if (disk.bad()){
+	Bitmap bitmap(fs.superblock.totalBlocks);
+	bitmap.setRange(0, fs.superblock.dataStart);
+	if (!disk.writeAt(static_cast<off_t>(fs.superblock.bitmapStart) * BLOCK_SIZE, bitmap.byteSize(), bitmap.data())){
 		std::cerr << "Error: Cannot write bitmap to disk.\n";
 		return false;
 	}
-	disk.flush();
 	std::cout << "Bitmap initialised and stored in the disk.\n";
-	fs.loadBitMap(disk);
-	if (disk.fail()){
+	if (!fs.loadBitMap(disk)){
 		std::cout << "Error: Cannot load bitmap into memory.\n";
-		disk.clear();
 		return false;
 	}
 	std::cout << "Successfully loaded bitmap in memory.\n";
-	disk.close();
 
 	return true;
 }
 
 bool initialiseFileEntries(System& fs){
-	std::fstream disk(fs.DISK_PATH, std::ios::in | std::ios::out | std::ios::binary);
+	BlockDevice& disk = fs.device;
 	if (!disk){
 		std::cerr << "Error: Cannot open disk for file entry initialisation.\n";
+		return false;
 	}
 	
-	std::vector<SerializableFileEntry> rootDirectory(ORDER - 1);
-	for (int i = 0; i < ORDER - 1; i++){
-		rootDirectory[i] = SerializableFileEntry();
+	if (!fs.Entries->createIndex(disk, fs.superblock.bplusTreeStart, fs.superblock.bplusTreeBlocks)){
+		std::cerr << "Error: Cannot initialise the B+ Tree.\n";
+		return false;
+	}
+
+	std::vector<char> rootDirectory(BLOCK_SIZE, 0);
+	for (int i = 0; i < fs.superblock.entriesPerDirBlock(); i++){
+		const SerializableFileEntry empty;
+		memcpy(rootDirectory.data() + i * fs.superblock.dirSlotSize(), &empty, sizeof(empty));
 	}
 	
-	for (int i = 0; i < ROOT_DIR_BLOCKS; i++) {
-		disk.seekg((ROOT_DIR_START + i) * BLOCK_SIZE, std::ios::beg);
-		disk.write(reinterpret_cast<char*>(rootDirectory.data()), sizeof(rootDirectory));
-		if (disk.bad()){
+	for (int64_t i = 0; i < fs.superblock.rootDirBlocks; i++) {
+		if (!disk.writeBlocks(fs.superblock.rootDirStart + i, 1, rootDirectory.data())){
 			std::cerr << "Error: Cannot write file entries to disk.\n";
 		}
 	}
-	disk.flush();
 	
 	std::cout << "File entries initialised and stored in the disk.\n";
 	{
 		std::unique_lock<std::shared_mutex> lock(fs.metaMutex);
-		fs.metaDataTable.reserve(MAX_FILES);
+		fs.metaDataTable.reserve(fs.superblock.maxFiles);
 	}	
-	fs.loadDirectoryTable(disk);
-	if (disk.fail()){
+	if (!fs.loadDirectoryTable(disk)){
 		std::cerr << "Error: Cannot load directory entries into memory.\n";
-		disk.clear();
 		return false;
 	}
 	std::cout << "Successfully loaded directory entries into memory.\n";
-	disk.close();
 
 	return true;
 }
 
 bool initialiseUsers(System& fs) {
-	std::fstream disk(fs.DISK_PATH, std::ios::in | std::ios::out | std::ios::binary);
-	if (!disk){
+	if (!fs.device){
 		std::cerr << "Error: Cannot open disk for file entry initialisation.\n";
 		return false;
 	}
@@ -153,7 +117,14 @@ bool System::formatFileSystem() {
 
 	bool check = true;
 	const std::string diskPath = DISK_PATH;
-	check = initialiseDisk(diskPath);
+	std::string error;
+	if (!superblock.layout(formatOptions, error)){
+		std::cerr << "Error: " << error << '\n';
+		return false;
+	}
+	usersOffset = sizeof(Superblock);
+	imageVersion = SUPERBLOCK_VERSION;
+	check = initialiseDisk(*this, diskPath);
 	if (!check)	return false;
 	check = initialiseSuperblock(*this);
 	if (!check)	return false;
@@ -168,10 +139,10 @@ bool System::formatFileSystem() {
 	std::cout << "File system formatting completed successfully.\n";
     std::cout << "Disk layout:\n";
     std::cout << "  Superblock Start  : Block " << SUPER_BLOCK_START << '\n';
-    std::cout << "  Bitmap Start      : Block " << BITMAP_START << '\n';
-    std::cout << "  B+ Tree Start     : Block " << BPLUS_TREE_START << '\n';
-    std::cout << "  Root Directory    : Block " << ROOT_DIR_START << '\n';
-    std::cout << "  Data Blocks Start : Block " << DATA_START << '\n';
+    std::cout << "  Bitmap Start      : Block " << superblock.bitmapStart << '\n';
+    std::cout << "  B+ Tree Start     : Block " << superblock.bplusTreeStart << '\n';
+    std::cout << "  Root Directory    : Block " << superblock.rootDirStart << '\n';
+    std::cout << "  Data Blocks Start : Block " << superblock.dataStart << '\n';
 	{
 		std::shared_lock<std::shared_mutex> lock(superblockMutex);
     	std::cout << "  Free Blocks       : " << superblock.freeBlocks << " / " << superblock.totalBlocks << '\n';
@@ -183,46 +154,123 @@ bool System::loadFromDisk() {
 	std::cout << "Starting File System...\n";
 	bool check = true;
 	
-	std::fstream disk(DISK_PATH, std::ios::in | std::ios::out | std::ios::binary);
+	BlockDevice& disk = device;
 	check = loadSuperblock(disk);
 	if (!check)	return false;
 	check = loadBitMap(disk);
 	if (!check)	return false;
-	if (!Entries->loadBPlusTree(disk)) {
-		std::cerr << "Error: Cannot load B+ Tree.\n";
-		exit(EXIT_FAILURE);
+	// Trees from before version 7 have another node format. Such a tree, one
+	// not closed cleanly, or one whose entries have moved is rebuilt from the
+	// directory table.
+	const bool indexLoaded = imageVersion >= 7 && Entries->openIndex(disk, superblock.bplusTreeStart, superblock.bplusTreeBlocks);
+	if (!indexLoaded && !Entries->createIndex(disk, superblock.bplusTreeStart, superblock.bplusTreeBlocks)) {
+		std::cerr << "Error: Cannot create B+ Tree.\n";
+		return false;
 	}
-	check = loadDirectoryTable(disk);
+	bool entriesMoved = false;
+	check = loadDirectoryTable(disk, &entriesMoved);
 	if (!check)	return false;
+	if (!indexLoaded || entriesMoved){
+		std::cout << "\tRebuilding the metadata index.\n";
+		std::vector<std::pair<std::string, int>> names;
+		names.reserve(metaDataTable.size());
+		for (int i = 0; i < static_cast<int>(metaDataTable.size()); i++){
+			if (metaDataTable[i]->fileName[0] != '\0')	names.emplace_back(metaDataTable[i]->fileName, i);
+		}
+		if (!Entries->bulkLoadIndex(names)){
+			std::cerr << "Error: Cannot rebuild the metadata index.\n";
+			return false;
+		}
+	}
 	check = loadUsers(disk);
 	if (!check)	return false;
+	if (imageVersion != SUPERBLOCK_VERSION){
+		// Rewrite in the current format: 64-bit directory entries, the user table after the larger superblock
+		if (superblock.order > Superblock::maxOrder()){
+			std::cerr << "Error: B+ tree order " << superblock.order << " is too large to upgrade this image.\n";
+			return false;
+		}
+		if (imageVersion < 1 && !discardFreeBlocks()){
+			std::cerr << "Error: Cannot clear the free blocks of this image.\n";
+			return false;
+		}
+		imageVersion = SUPERBLOCK_VERSION;
+		usersOffset = sizeof(Superblock);
+		if (!saveDirectoryTableEntire(disk) || !saveUsers(disk) || !saveSuperblock(disk) || !disk.sync())	return false;
+		std::cout << "\tUpgraded disk image to version " << SUPERBLOCK_VERSION << ".\n";
+	}
 	journalManager->loadJournal();
 	
 	std::cout << "File system loading completed successfully.\n";
     std::cout << "Disk layout:\n";
     std::cout << "  Superblock Start  : Block " << SUPER_BLOCK_START << '\n';
-    std::cout << "  Bitmap Start      : Block " << BITMAP_START << '\n';
-    std::cout << "  B+ Tree Start     : Block " << BPLUS_TREE_START << '\n';
-    std::cout << "  Meta Data Table   : Block " << ROOT_DIR_START << '\n';
-    std::cout << "  Data Blocks Start : Block " << DATA_START << '\n';
+    std::cout << "  Bitmap Start      : Block " << superblock.bitmapStart << '\n';
+    std::cout << "  B+ Tree Start     : Block " << superblock.bplusTreeStart << '\n';
+    std::cout << "  Meta Data Table   : Block " << superblock.rootDirStart << '\n';
+    std::cout << "  Data Blocks Start : Block " << superblock.dataStart << '\n';
     std::cout << "  Free Blocks       : " << superblock.freeBlocks << " / " << superblock.totalBlocks << '\n';
 
 	return true;
 }
 
 void System::saveInDisk() {
-	std::fstream disk(DISK_PATH, std::ios::in | std::ios::out | std::ios::binary);
+	BlockDevice& disk = device;
+	flushAllDelayedAppends();
 	std::cout << "Saving File system state.\n";
     std::cout << "Disk layout:\n";
     std::cout << "  Superblock Start  : Block " << SUPER_BLOCK_START << '\n';
-    std::cout << "  Bitmap Start      : Block " << BITMAP_START << '\n';
-    std::cout << "  B+ Tree Start     : Block " << BPLUS_TREE_START << '\n';
-    std::cout << "  Meta Data Table   : Block " << ROOT_DIR_START << '\n';
-    std::cout << "  Data Blocks Start : Block " << DATA_START << '\n';
+    std::cout << "  Bitmap Start      : Block " << superblock.bitmapStart << '\n';
+    std::cout << "  B+ Tree Start     : Block " << superblock.bplusTreeStart << '\n';
+    std::cout << "  Meta Data Table   : Block " << superblock.rootDirStart << '\n';
+    std::cout << "  Data Blocks Start : Block " << superblock.dataStart << '\n';
     std::cout << "  Free Blocks       : " << superblock.freeBlocks << " / " << superblock.totalBlocks << '\n';
 	saveBitMap(disk);
 	saveSuperblock(disk);
-	Entries->saveBPlusTree(disk);
+	Entries->closeIndex();
 	saveDirectoryTableEntire(disk);	
 	saveUsers(disk);
-}
\ No newline at end of file
+	disk.sync();
+}
+// Extends the image to newSizeMB without reformatting. The new blocks are
+// sparse and free; growth is bounded by what the bitmap region can describe.
+bool System::growM(int newSizeMB, ClientSession* session) {
+	session->msg.clear();
+	session->oss.str("");
+	session->oss.clear();
+
+	bool check = false;
+	if (session->user.user_id != 0) {
+		session->oss << "Error: Only root can grow the file system.\n";
+	} else {
+		const int64_t newBlocks = static_cast<int64_t>(newSizeMB) * 1024 * 1024 / BLOCK_SIZE;
+		bool grown = false;
+		{
+			// One exclusive section from the size check to the new totals, so two
+			// grows cannot both start from the same old size
+			std::unique_lock<std::shared_mutex> lock(FATMutex);
+			std::unique_lock<std::shared_mutex> superLock(superblockMutex);
+			const int64_t oldBlocks = superblock.totalBlocks;
+			if (newSizeMB <= 0 || newBlocks <= oldBlocks) {
+				session->oss << "Error: New size must be larger than the current " << oldBlocks * BLOCK_SIZE / (1024 * 1024) << " MB.\n";
+			} else if (newBlocks > superblock.maxBlocks) {
+				session->oss << "Error: Cannot grow beyond " << superblock.maxBlocks * BLOCK_SIZE / (1024 * 1024) << " MB.\n";
+			} else if (!device.resize(static_cast<off_t>(newBlocks) * BLOCK_SIZE)) {
+				session->oss << "Error: Cannot extend the disk image.\n";
+			} else {
+				FATTABLE.grow(static_cast<size_t>(newBlocks));
+				buildAllocationGroups();
+				superblock.totalBlocks = newBlocks;
+				superblock.freeBlocks += newBlocks - oldBlocks;
+				grown = true;
+			}
+		}
+		if (grown) {
+			check = flushBitMap(device) && saveSuperblock(device) && device.sync();
+			if (check)	session->oss << "File system grown to " << newSizeMB << " MB (" << newBlocks << " blocks).\n";
+			else	session->oss << "Error: Cannot save the grown file system.\n";
+		}
+	}
+	std::string msg = session->oss.str();
+	session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+	return check;
+}
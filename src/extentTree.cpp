@@ -0,0 +1,143 @@
+#include "extentTree.h"
+
+#include <algorithm>
+
+// Reads the nodes under the inline root into file->extents.
+bool System::loadExtentTree(BlockDevice &disk, FileEntry* file){
+	std::vector<Extent> extents;
+	std::vector<std::vector<int64_t>> levels(file->extentDepth);
+	std::vector<char> buffer(BLOCK_SIZE);
+	// Depth-first, left to right, so leaves are visited in file order
+	std::vector<std::pair<int64_t, int>> stack;
+	for (int i = file->rootCount - 1; i >= 0; i--)	stack.emplace_back(file->extentRoot[i].startBlock, file->extentDepth - 1);
+	while (!stack.empty()){
+		const auto [block, depth] = stack.back();
+		stack.pop_back();
+		if (!disk.readBlocks(block, 1, buffer.data()))	return false;
+		ExtentNodeHeader header;
+		memcpy(&header, buffer.data(), sizeof(header));
+		if (header.magic != EXTENT_NODE_MAGIC || header.depth != depth || header.count > EXTENTS_PER_NODE){
+			std::cerr << "\tError: Corrupt extent tree node " << block << " in '" << file->fileName << "'.\n";
+			return false;
+		}
+		levels[depth].push_back(block);
+		const Extent* entries = reinterpret_cast<const Extent*>(buffer.data() + sizeof(ExtentNodeHeader));
+		if (depth == 0){
+			extents.insert(extents.end(), entries, entries + header.count);
+			continue;
+		}
+		for (int i = header.count - 1; i >= 0; i--)	stack.emplace_back(entries[i].startBlock, depth - 1);
+	}
+	file->setExtents(std::move(extents));
+	file->extentIndexBlocks.clear();
+	for (const auto& level : levels)	file->extentIndexBlocks.insert(file->extentIndexBlocks.end(), level.begin(), level.end());
+	return true;
+}
+
+// Node count of each level, leaves first, of the tree over extentCount
+// extents. Nodes are packed: all but the last of a level are full, so the
+// layout follows from the count alone.
+static std::vector<int64_t> levelSizes(int64_t extentCount){
+	std::vector<int64_t> sizes;
+	for (int64_t entries = extentCount; entries > INLINE_EXTENTS;){
+		entries = (entries + EXTENTS_PER_NODE - 1) / EXTENTS_PER_NODE;
+		sizes.push_back(entries);
+	}
+	return sizes;
+}
+
+// Brings the tree up to date with file->extents: up to INLINE_EXTENTS extents
+// live in the entry itself, more are packed into node blocks, level by level,
+// until the top level fits inline. Extents only change at the end of the file,
+// so only the nodes from file->dirtyExtent on (the rightmost leaf and its path,
+// as a rule) are rewritten, in place; blocks are allocated only for nodes a
+// level gains. Nodes a level loses are returned in staleBlocks, to be freed
+// (and counted free) once the entry is saved.
+bool System::storeExtentTree(BlockDevice &disk, FileEntry* file, ClientSession* session, std::vector<int64_t> &staleBlocks){
+	if (!file->extentsDirty)	return true;
+
+	const std::vector<int64_t> sizes = levelSizes(file->numExtents());
+	std::vector<int64_t> oldSizes = levelSizes(file->storedExtents);
+	int64_t firstDirty = std::min(file->dirtyExtent, file->numExtents());
+	int64_t oldNodes = 0;
+	for (const int64_t size : oldSizes)	oldNodes += size;
+	if (oldNodes != static_cast<int64_t>(file->extentIndexBlocks.size())){
+		// Not the layout this count gives; replace the whole tree
+		oldSizes.clear();
+		firstDirty = 0;
+	}
+
+	// Each level keeps its old nodes in place, up to its new size
+	std::vector<std::vector<int64_t>> nodes(sizes.size());
+	std::vector<int64_t> kept(sizes.size(), 0);
+	std::vector<int64_t> stale;
+	int64_t nodeCount = 0;
+	size_t oldIndex = 0;
+	for (size_t depth = 0; depth < std::max(sizes.size(), oldSizes.size()); depth++){
+		const int64_t have = depth < oldSizes.size() ? oldSizes[depth] : 0;
+		const int64_t want = depth < sizes.size() ? sizes[depth] : 0;
+		for (int64_t i = 0; i < have; i++, oldIndex++){
+			if (i < want)	nodes[depth].push_back(file->extentIndexBlocks[oldIndex]);
+			else	stale.push_back(file->extentIndexBlocks[oldIndex]);
+		}
+		if (depth < kept.size())	kept[depth] = std::min(have, want);
+		nodeCount += std::max<int64_t>(want - have, 0);
+	}
+	if (oldSizes.empty())	stale = file->extentIndexBlocks;
+
+	std::vector<int64_t> fresh;
+	if (nodeCount > 0){
+		if (availableBlocks() < nodeCount){
+			if (session)	session->oss << "Error: Not enough free blocks for the extent tree.\n";
+			return false;
+		}
+		fresh = allocateBitMapBlocks(nodeCount, session, groupOf(file->extents.front().startBlock));
+		if (fresh.empty())	return false;
+		size_t nextNode = 0;
+		for (size_t depth = 0; depth < sizes.size(); depth++){
+			while (static_cast<int64_t>(nodes[depth].size()) < sizes[depth])	nodes[depth].push_back(fresh[nextNode++]);
+		}
+	}
+
+	std::vector<Extent> level;
+	std::vector<char> buffer(BLOCK_SIZE);
+	for (size_t depth = 0; depth < sizes.size(); depth++){
+		const std::vector<Extent>& entries = depth == 0 ? file->extents : level;
+		// Nodes before the first changed entry, and their entries above, stay as stored
+		const int64_t firstWrite = std::min(firstDirty / EXTENTS_PER_NODE, kept[depth]);
+		std::vector<Extent> parents;
+		for (int64_t node = 0; node < sizes[depth]; node++){
+			const size_t first = static_cast<size_t>(node) * EXTENTS_PER_NODE;
+			const size_t count = std::min(entries.size() - first, static_cast<size_t>(EXTENTS_PER_NODE));
+			int64_t covered = 0;
+			for (size_t i = first; i < first + count; i++)	covered += entries[i].length;
+			const int64_t block = nodes[depth][node];
+			parents.emplace_back(block, covered);
+			if (node < firstWrite)	continue;
+			std::fill(buffer.begin(), buffer.end(), 0);
+			const ExtentNodeHeader header{EXTENT_NODE_MAGIC, static_cast<uint16_t>(depth), static_cast<uint16_t>(count)};
+			memcpy(buffer.data(), &header, sizeof(header));
+			memcpy(buffer.data() + sizeof(header), entries.data() + first, count * sizeof(Extent));
+			if (!disk.writeBlocks(block, 1, buffer.data())){
+				if (session)	session->oss << "Error: Cannot write extent tree of '" << file->fileName << "'.\n";
+				if (!fresh.empty())	freeBitMapBlocks(fresh);
+				return false;
+			}
+		}
+		level = std::move(parents);
+		firstDirty = firstWrite;
+	}
+	const std::vector<Extent>& root = sizes.empty() ? file->extents : level;
+
+	file->extentDepth = static_cast<uint8_t>(sizes.size());
+	file->rootCount = static_cast<int>(root.size());
+	std::fill(file->extentRoot, file->extentRoot + INLINE_EXTENTS, Extent());
+	std::copy(root.begin(), root.end(), file->extentRoot);
+	staleBlocks.insert(staleBlocks.end(), stale.begin(), stale.end());
+	adjustFreeBlocks(-nodeCount); // The stale nodes are credited as they are freed
+	file->extentIndexBlocks.clear();
+	for (const auto& levelNodes : nodes)	file->extentIndexBlocks.insert(file->extentIndexBlocks.end(), levelNodes.begin(), levelNodes.end());
+	file->storedExtents = file->dirtyExtent = file->numExtents();
+	file->extentsDirty = false;
+	return true;
+}
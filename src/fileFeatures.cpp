@@ -17,7 +17,7 @@ std::string permissionToString(FileEntry* entry) {
 	}
 	return permission;
 }
-int setAttributes(System& fs, std::fstream& disk, const std::string& fileName, int attribute, ClientSession* session) {
+int setAttributes(System& fs, BlockDevice& disk, const std::string& fileName, int attribute, ClientSession* session) {
 	std::string file = std::to_string(session->currentDirectory) + "F_" + fileName;
 	int searchFileIndex = fs.Entries->getFile(file);
 	if (searchFileIndex == -1) {
@@ -40,7 +40,7 @@ int setAttributes(System& fs, std::fstream& disk, const std::string& fileName, i
 	std::cout << "Successfully updated attributes.\n";
 	return 1;
 }
-int clearAttributes(System& fs, std::fstream& disk, const std::string& fileName, int attribute, ClientSession* session) {
+int clearAttributes(System& fs, BlockDevice& disk, const std::string& fileName, int attribute, ClientSession* session) {
 	std::string file = std::to_string(session->currentDirectory) + "F_" + fileName;
 	int searchFileIndex = fs.Entries->getFile(file);
 	if (searchFileIndex == -1) {
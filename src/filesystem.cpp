@@ -1,7 +1,7 @@
 #include "filesystem.h"
 
 // namespace fileSystemOperations {
-void createFile(System& fs, ClientSession* session, std::fstream &disk, const std::string &fileName, const int &fileSize, FileEntry* newFile, const int& index, uint16_t permissions) {
+void createFile(System& fs, ClientSession* session, BlockDevice &disk, const std::string &fileName, const int64_t &fileSize, FileEntry* newFile, const int& index, uint16_t permissions) {
 	// std::cout << "Creating file: '" << fileName << "':\n";
 	
 	if (!helpers::isValidFileName(fileName)){
@@ -10,36 +10,23 @@ void createFile(System& fs, ClientSession* session, std::fstream &disk, const st
 		return;
 	}
 	std::string savedName = std::to_string(session->user.user_id) + std::to_string(index) + "F_" + fileName;
-	int requiredBlocks = (fileSize + BLOCK_SIZE - 1)/BLOCK_SIZE;
-	std::vector<int> allocatedBlocks = fs.allocateBitMapBlocks(disk, requiredBlocks, session);
-	if (allocatedBlocks.empty()){
-		session->oss << "Error: Try creating file again.\n";
-		// std::cerr << "\tError: Try creating file again.\n";
-		return;
-	}
-	int size = static_cast<int>(allocatedBlocks.size());
-	Superblock originalSuperblock = fs.superblock;
-	int extentIndex = 0;
-	for (int i = 0; i < size; i++){
-		if (extentIndex >= MAX_EXTENTS){
-			session->oss << "Error: Exceeded max extents while creating file.\n";
-			// std::cerr << "\tError: Exceeded max extents while creating file.\n";
-			// std::cerr << "\tAttempting rollback\n";
-			fs.rollbackMetadataIndex(disk, fs.superblock, fs.metaIndex - 1, allocatedBlocks);
+	// Small files keep their contents in the directory entry and take no blocks
+	const bool inlined = fileSize <= fs.superblock.inlineDataCapacity();
+	int64_t requiredBlocks = inlined ? 0 : (fileSize + BLOCK_SIZE - 1)/BLOCK_SIZE;
+	std::vector<int64_t> allocatedBlocks;
+	if (!inlined){
+		allocatedBlocks = fs.allocateBitMapBlocks(requiredBlocks, session, index);
+		if (allocatedBlocks.empty()){
+			session->oss << "Error: Try creating file again.\n";
+			// std::cerr << "\tError: Try creating file again.\n";
 			return;
 		}
-		int startBlock = allocatedBlocks[i];
-		int length = 1;
-		while ((i + 1) < size || allocatedBlocks[i + 1] == allocatedBlocks[i] + 1){
-			length++;
-			i++;
-		}
-		newFile->extents[extentIndex].length = length;
-		newFile->extents[extentIndex].startBlock = startBlock;
-		newFile->numExtents++;
-		extentIndex++;
 	}
+	newFile->addBlocks(allocatedBlocks);
 	newFile->fileSize = fileSize;
+	newFile->unwritten = !inlined; // Reads return zeros without touching the disk
+	newFile->hasInlineData = inlined;
+	if (inlined)	newFile->inlineData.assign(fileSize, '\0');
 	newFile->isDirectory = false;
 	newFile->parentIndex = index;
 	newFile->dirID = index;
@@ -52,7 +39,7 @@ void createFile(System& fs, ClientSession* session, std::fstream &disk, const st
 	newFile->permissions = permissions;
 	newFile->attributes = 0;
 	
-	fs.superblock.freeBlocks -= requiredBlocks;
+	fs.adjustFreeBlocks(-requiredBlocks);
 	FileEntry* parentDir = nullptr;
 	{
 		std::shared_lock<std::shared_mutex> lock(fs.metaMutex);
@@ -73,7 +60,18 @@ void createFile(System& fs, ClientSession* session, std::fstream &disk, const st
 	}
 	session->user.totalSize += newFile->fileSize;
 	
-	fs.Entries->insertFileEntry(savedName, fs.metaIndex);
+	if (!fs.Entries->insertFileEntry(savedName, fs.metaIndex)){
+		// The index region is full: undo the accounting and give the blocks back
+		session->oss << "Error: Cannot add '" << fileName << "' to the file index; the file was not created.\n";
+		{
+			std::shared_lock<std::shared_mutex> lock(fs.metaMutex);
+			if (parentDir)	parentDir->fileSize -= newFile->fileSize;
+		}
+		session->user.totalSize -= newFile->fileSize;
+		fs.releaseRolledBackBlocks(true, allocatedBlocks);
+		fs.flushBitMap(disk);
+		return;
+	}
 	std::cout << newFile->fileName << ' ' << fs.metaDataTable.size() << '\n'; // LOGS
 	fs.metaDataTable.push_back(newFile);
 	fs.metaIndex++;
@@ -83,7 +81,7 @@ void createFile(System& fs, ClientSession* session, std::fstream &disk, const st
 		session->oss << "Error: Corrupted file entry(Cannot update file entry) with index: " << fs.metaIndex - 1 << ".\n";
 		// std::cout << "\tError: Corrupted file entry(Cannot update file entry) with index: " << fs.metaIndex - 1 << ".\n";
 		// std::cout << "\tAttempting rollback\n";
-		fs.rollbackMetadataIndex(disk, originalSuperblock, fs.metaIndex - 1, allocatedBlocks);
+		fs.rollbackMetadataIndex(disk, true, fs.metaIndex - 1, allocatedBlocks);
 		return;
 	}
 	save = fs.saveSuperblock(disk);
@@ -91,171 +89,126 @@ void createFile(System& fs, ClientSession* session, std::fstream &disk, const st
 		session->oss << "Error: Cannot update Superblock after creating file.\n";
 		// std::cerr << "\tError: Cannot update Superblock after creating file.\n";
 		// std::cout << "\tAttempting rollback\n";
-		fs.rollbackMetadataIndex(disk, originalSuperblock, fs.metaIndex - 1, allocatedBlocks);
+		fs.rollbackMetadataIndex(disk, true, fs.metaIndex - 1, allocatedBlocks);
 		fs.Entries->removeFileEntry(savedName);
 		return;
 	}
-	disk.flush();
 	// std::cout << "\tFile '" << fileName << "' created successfully, at block: " << newFile->extents->startBlock << " and key: " << key << '\n';
 }
-void writeFileData(System& fs, ClientSession* session, std::fstream &disk, FileEntry* file, const int fileIndex, const std::string &fileContent, bool append){
+// Writes size bytes at the start of the block and zeros the rest of it, so the
+// bytes past the end of a file never show what the block held before.
+static bool writeBlockHead(BlockDevice &disk, int64_t block, const char* data, size_t size){
+	const off_t offset = static_cast<off_t>(block) * BLOCK_SIZE;
+	if (size >= BLOCK_SIZE)	return disk.writeAt(offset, BLOCK_SIZE, data);
+	std::vector<char> buffer(BLOCK_SIZE, 0);
+	memcpy(buffer.data(), data, size);
+	return disk.writeAt(offset, BLOCK_SIZE, buffer.data());
+}
+// reserved blocks were set aside for this write (a delayed append) and count
+// as available to it; the caller releases them once it returns.
+void writeFileData(System& fs, ClientSession* session, BlockDevice &disk, FileEntry* file, const int fileIndex, const std::string &fileContent, bool append, int64_t reserved){
 	// std::cout << "Writing content to file '" << file->fileName << "'.\n";
-	std::vector<int> newlyAllocatedBlocks;
-	Superblock originalSuperBlock = fs.superblock;
+	if (append && file->hasInlineData){
+		// Rewritten whole: stays inline if it still fits, otherwise moves to blocks
+		writeFileData(fs, session, disk, file, fileIndex, file->inlineData + fileContent, false, reserved);
+		return;
+	}
+	std::vector<int64_t> newlyAllocatedBlocks;
 	FileEntry* orgFileEntry;
 	{
 		std::shared_lock<std::shared_mutex> lock(fs.metaMutex);
 		orgFileEntry = fs.metaDataTable[fileIndex];
 	}
-	int reqBlocksUpdate = 0;
+	int64_t reqBlocksUpdate = 0;
+	// Grow the file inside the allocation group that holds its last extent
+	const int groupHint = (file->numExtents() > 0) ? fs.groupOf(file->lastBlock()) : file->parentIndex;
 	if (append){
-		int bytesWritten = file->fileSize % BLOCK_SIZE;
+		int bytesWritten = static_cast<int>(file->fileSize % BLOCK_SIZE);
 		int remaining = (bytesWritten == 0) ? 0 : BLOCK_SIZE - bytesWritten;
-		int actualBytesWritten = 0;
-		int requiredBlocks = (static_cast<int>(fileContent.size()) - remaining + BLOCK_SIZE - 1)/BLOCK_SIZE;
-		if (fs.superblock.freeBlocks < requiredBlocks){
+		size_t actualBytesWritten = 0;
+		int64_t requiredBlocks = (static_cast<int64_t>(fileContent.size()) - remaining + BLOCK_SIZE - 1)/BLOCK_SIZE;
+		if (requiredBlocks < 0)	requiredBlocks = 0;
+		if (fs.availableBlocks() + reserved < requiredBlocks){
 			session->oss << "Error: Not enough storage to append data.\n";
 			// std::cout << "\tError: Not enough storage to append data.\n";
 			return;
 		}
+		// Blocks are chosen before anything is written, so a failed allocation
+		// leaves the file as it was
+		std::vector<int64_t> appendedBlocks;
+		if (requiredBlocks > 0){
+			appendedBlocks = fs.allocateBitMapBlocks(requiredBlocks, session, groupHint);
+			if (static_cast<int64_t>(appendedBlocks.size()) != requiredBlocks){
+				session->oss << "Error: Not enough storage to append data.\n";
+				fs.releaseRolledBackBlocks(false, appendedBlocks);
+				return;
+			}
+		}
 		reqBlocksUpdate = requiredBlocks;
 		if (remaining < BLOCK_SIZE) {
-			int block = file->extents[file->numExtents - 1].startBlock + file->extents[file->numExtents - 1].length - 1;
-			int writeSize = std::min(remaining, static_cast<int>(fileContent.size()));
-			disk.seekp(block * BLOCK_SIZE + bytesWritten, std::ios::beg);
-			disk.write(fileContent.data(), writeSize);
-			if (disk.fail()){
+			int64_t block = file->lastBlock();
+			size_t writeSize = std::min(static_cast<size_t>(remaining), fileContent.size());
+			const off_t offset = static_cast<off_t>(block) * BLOCK_SIZE + bytesWritten;
+			if (!disk.writeAt(offset, writeSize, fileContent.data())){
 				session->oss << "Error: Cannot append data(first block).\n";
 				// std::cout << "\tError: Cannot append data(first block).\n";
-				disk.clear();
-				std::vector<char> emptyBlock(0, writeSize);
-				disk.seekp(block * BLOCK_SIZE + bytesWritten, std::ios::beg);
-				disk.write(emptyBlock.data(), writeSize);
+				std::vector<char> emptyBlock(writeSize, 0);
+				disk.writeAt(offset, writeSize, emptyBlock.data());
+				fs.releaseRolledBackBlocks(false, appendedBlocks);
 				return;
 			}
 			actualBytesWritten += writeSize;
 		}
-		if (actualBytesWritten != static_cast<int>(fileContent.size())) {
-			std::vector<int> newlyAllocatedBlocks = fs.allocateBitMapBlocks(disk, requiredBlocks, session);
-			int size = static_cast<int>(newlyAllocatedBlocks.size()), extentIndex = file->numExtents;
-			for (int i = 0; i < size; i++){
-				if (extentIndex > MAX_EXTENTS){
-					session->oss << "Error: Exceeded max extents while creating file.\n";
-					// std::cerr << "\tError: Exceeded max extents while creating file.\n";
-					// std::cerr << "\tAttempting rollback\n";
-					fs.rollbackMetadataIndex(disk, fs.superblock, -1, newlyAllocatedBlocks); // No FileEntry modification until
-					// RollingBack already written data
-					int block = orgFileEntry->extents[orgFileEntry->numExtents - 1].startBlock + orgFileEntry->extents[orgFileEntry->numExtents - 1].length - 1;
-					int writeSize = std::min(remaining, static_cast<int>(fileContent.size()));
-					std::vector<char> emptyBlock(0, writeSize);
-					disk.seekp(block * BLOCK_SIZE + bytesWritten, std::ios::beg);
-					disk.write(emptyBlock.data(), writeSize);
-					return;
-				}
-			
-				int startBlock = newlyAllocatedBlocks[i];
-				int length = 1;
-				while ((i + 1) != size || newlyAllocatedBlocks[i + 1] == newlyAllocatedBlocks[i] + 1){
-					length++;
-					i++;
-				}
-				file->extents[extentIndex].length = length;
-				file->extents[extentIndex].startBlock = startBlock;
-				file->numExtents++;
-				extentIndex++;
-			}
-			for (int block : newlyAllocatedBlocks){
-				int toWrite = std::min(BLOCK_SIZE, static_cast<int>(fileContent.size() - actualBytesWritten));
-				disk.seekp(block * BLOCK_SIZE, std::ios::beg);
-				disk.write(fileContent.data() + actualBytesWritten, toWrite);
-				if (disk.bad()){
+		if (actualBytesWritten != fileContent.size()) {
+			std::vector<int64_t>& newlyAllocatedBlocks = appendedBlocks;
+			file->addBlocks(newlyAllocatedBlocks);
+			for (int64_t block : newlyAllocatedBlocks){
+				size_t toWrite = std::min(static_cast<size_t>(BLOCK_SIZE), fileContent.size() - actualBytesWritten);
+				if (!writeBlockHead(disk, block, fileContent.data() + actualBytesWritten, toWrite)){
 					session->oss << "Error: Failed to write to newly allocated blocks in append mode.\n";
 					// std::cerr << "\tError: Failed to write to newly allocated blocks in append mode.\n";
 					// std::cerr << "\tAttempting rollback:\n";
-					fs.rollbackMetadataOrg(disk, originalSuperBlock, orgFileEntry, fileIndex, newlyAllocatedBlocks);
+					fs.rollbackMetadataOrg(disk, false, orgFileEntry, fileIndex, newlyAllocatedBlocks);
 					return;
 				}
-				disk.flush();
 				actualBytesWritten += toWrite;
 			}
 		}
 	}
 	else{
-		int requiredBlocks = (fileContent.size() + BLOCK_SIZE - 1)/BLOCK_SIZE;
-		int allocatedBlocks = (file->fileSize + BLOCK_SIZE - 1)/BLOCK_SIZE;
+		const bool inlined = static_cast<int64_t>(fileContent.size()) <= fs.superblock.inlineDataCapacity();
+		int64_t requiredBlocks = inlined ? 0 : (static_cast<int64_t>(fileContent.size()) + BLOCK_SIZE - 1)/BLOCK_SIZE;
+		int64_t allocatedBlocks = file->blockCount();
 		if (requiredBlocks > allocatedBlocks){
-			int difference = requiredBlocks - allocatedBlocks;
-			if (fs.superblock.freeBlocks < difference){
+			int64_t difference = requiredBlocks - allocatedBlocks;
+			if (fs.availableBlocks() + reserved < difference){
 				session->oss << "Error: Not enough storage for additional data.\n";
 				// std::cerr << "\tError: Not enough storage for additional data.\n";
 				return;
 			}
 			reqBlocksUpdate = difference;
-			int block = file->extents[file->numExtents - 1].startBlock + file->extents[file->numExtents - 1].length - 1;
-			std::vector<int> newlyAllocatedBlocks = fs.allocateBitMapBlocks(disk, difference, session);
-			int i = 0;
-			while (newlyAllocatedBlocks[i] == block + 1){
-				file->extents[file->numExtents - 1].length += 1;
-				i++;
-			}
-			if (i <= static_cast<int>(newlyAllocatedBlocks.size()) - 1) {
-				int size = newlyAllocatedBlocks.size(), extentIndex = file->numExtents;
-				for (int i = 0; i < size; i++){
-					if (extentIndex > MAX_EXTENTS){
-						session->oss << "Error: Exceeded max extents while creating file.\n";
-						// std::cerr << "\tError: Exceeded max extents while creating file.\n";
-						// std::cerr << "\tAttempting rollback\n";
-						fs.rollbackMetadataOrg(disk, fs.superblock, orgFileEntry, fileIndex, newlyAllocatedBlocks);
-						return;
-					}
-					int startBlock = newlyAllocatedBlocks[i];
-					int length = 1;
-					while ((i + 1) != size || newlyAllocatedBlocks[i + 1] == newlyAllocatedBlocks[i] + 1){
-						length++;
-						i++;
-					}
-					file->extents[extentIndex].length = length;
-					file->extents[extentIndex].startBlock = startBlock;
-					file->numExtents++;
-					extentIndex++;
-				}
+			std::vector<int64_t> newlyAllocatedBlocks = fs.allocateBitMapBlocks(difference, session, groupHint);
+			if (newlyAllocatedBlocks.empty()){
+				session->oss << "Error: Not enough storage for additional data.\n";
+				return;
 			}
+			file->addBlocks(newlyAllocatedBlocks);
 		}
 		else if (requiredBlocks < allocatedBlocks){
-			int countedBlocks = 0, extentIndex = 0, finalExtentIndex = 0;
-			while (countedBlocks < requiredBlocks){
-				countedBlocks += file->extents[extentIndex].length; // Count total blocks in each extent
-				if (countedBlocks > requiredBlocks){
-					int remBlocks = countedBlocks - requiredBlocks; // If the total blocks exceeds the required blocks
-					file->extents[extentIndex].length -= remBlocks; // Due to the additional in last added extent blocks
-					finalExtentIndex = extentIndex;
-					for (int i = remBlocks; i > 0; i--)	newlyAllocatedBlocks.push_back(file->extents[extentIndex].startBlock + file->extents[extentIndex].length - remBlocks + i);
-					extentIndex++;
-					while (extentIndex < file->numExtents){
-						int ln = file->extents[extentIndex].length;
-						for (int i = 0; i < ln; i++)	newlyAllocatedBlocks.push_back(file->extents[extentIndex].startBlock + i);
-						extentIndex++;
-					}
-				}
-				file->numExtents = finalExtentIndex + 1;
-			}
-			fs.freeBitMapBlocks(disk, newlyAllocatedBlocks);
-			for (int i = file->numExtents; i < MAX_EXTENTS; i++){
-				if (file->extents[i].startBlock == -1)	break;
-				else{
-					file->extents[i].startBlock = -1;
-					file->extents[i].length = 0;
-				}
-			}
+			// Keep the first requiredBlocks blocks, release everything after them
+			newlyAllocatedBlocks = file->truncateBlocks(requiredBlocks);
+			reqBlocksUpdate = -fs.freeBitMapBlocks(newlyAllocatedBlocks);
 		}
-		int bytesWritten = 0, extentIndex = 0;
-		while (extentIndex < file->numExtents){
-			int ln = file->extents[extentIndex].length;
-			for (int i = 0; i < ln; i++){
-				size_t dataBytes = std::min(BLOCK_SIZE, static_cast<int>(fileContent.size() - bytesWritten));
-				disk.seekp((file->extents[extentIndex].startBlock + i) * BLOCK_SIZE, std::ios::beg);
-				disk.write(fileContent.data() + bytesWritten, dataBytes);
-				if (disk.bad()){
+		file->hasInlineData = inlined;
+		if (inlined)	file->inlineData = fileContent;
+		else	file->inlineData.clear();
+		size_t bytesWritten = 0;
+		int extentIndex = 0;
+		while (extentIndex < file->numExtents()){
+			int64_t ln = file->extents[extentIndex].length;
+			for (int64_t i = 0; i < ln; i++){
+				size_t dataBytes = std::min(static_cast<size_t>(BLOCK_SIZE), fileContent.size() - bytesWritten);
+				if (!writeBlockHead(disk, file->extents[extentIndex].startBlock + i, fileContent.data() + bytesWritten, dataBytes)){
 					session->oss << "Error: Failed to write data to disk for file '" << file->fileName << "' at extent: " << extentIndex << ".\n";
 					// std::cerr << "\tError: Failed to write data to disk for file '" << file->fileName << "' at extent: " << extentIndex << ".\n";
 					return;
@@ -264,7 +217,6 @@ void writeFileData(System& fs, ClientSession* session, std::fstream &disk, FileE
 			}
 			extentIndex++;
 		}
-		disk.flush();
 	}
 	FileEntry* parentDir = nullptr;
 	{
@@ -286,109 +238,241 @@ void writeFileData(System& fs, ClientSession* session, std::fstream &disk, FileE
 		}
 	}
 	session->user.totalSize -= file->fileSize;
-	file->fileSize = append ? fileContent.size() + file->fileSize : fileContent.size();
+	file->fileSize = static_cast<int64_t>(fileContent.size()) + (append ? file->fileSize : 0);
 	if (file->parentIndex != 0)
 		parentDir->fileSize += file->fileSize;
 	uint64_t current_time = std::time(nullptr);
 	file->modified_at = current_time;
 	file->accessed_at = current_time;
-	fs.superblock.freeBlocks -= reqBlocksUpdate;
+	file->unwritten = false;
+	fs.adjustFreeBlocks(-reqBlocksUpdate);
 	int save = fs.saveDirectoryTable(disk, fileIndex, session);
 	if (save == 0) {
 		// std::cerr << "\tAttempting rollback\n";
-		fs.rollbackMetadataOrg(disk, originalSuperBlock, orgFileEntry, fileIndex, newlyAllocatedBlocks);
+		fs.rollbackMetadataOrg(disk, true, orgFileEntry, fileIndex, newlyAllocatedBlocks);
 		return;
 	}
 	save = fs.saveSuperblock(disk);
 	if (save == 0){
 		// std::cerr << "\tAttempting rollback\n";
-		fs.rollbackMetadataOrg(disk, originalSuperBlock, orgFileEntry, fileIndex, newlyAllocatedBlocks);
+		fs.rollbackMetadataOrg(disk, true, orgFileEntry, fileIndex, newlyAllocatedBlocks);
 		return;
 	}
-	save = fs.saveBitMap(disk);
+	save = fs.flushBitMap(disk);
 	if (save == 0){
 		// std::cerr << "\tError: Cannot update bitmap. Attempting rollback\n";
-		fs.rollbackMetadataOrg(disk, originalSuperBlock, orgFileEntry, fileIndex, newlyAllocatedBlocks);
+		fs.rollbackMetadataOrg(disk, true, orgFileEntry, fileIndex, newlyAllocatedBlocks);
 		return;
 	}
-	disk.flush();
 	// std::cout << "\tData written sucessfully for the file: '" << file->fileName << "'.\n";
 	// for (auto& filex : file->extents) {
 	// 	std::cout << "\tExtent: " << filex.startBlock << " and length: " << filex.length << '\n';
 	// }
 }
-std::string System::readFileData(std::fstream &disk, FileEntry* file, ClientSession* session){	
+// Splits the byte range [offset, offset + length) of the file into one piece
+// per extent it touches and calls transfer(image offset, size, bytes done) on
+// each. The range must lie within the file's blocks.
+static bool forEachExtentRange(const FileEntry* file, int64_t offset, int64_t length, const std::function<bool(off_t, size_t, int64_t)>& transfer){
+	if (length <= 0)	return true;
+	int64_t done = 0;
+	for (size_t extent = file->findExtent(offset / BLOCK_SIZE); done < length && extent < file->extents.size(); extent++){
+		const int64_t inExtent = offset + done - file->extentStarts[extent] * BLOCK_SIZE;
+		const int64_t chunk = std::min(length - done, file->extents[extent].length * BLOCK_SIZE - inExtent);
+		if (!transfer(static_cast<off_t>(file->extents[extent].startBlock) * BLOCK_SIZE + inExtent, chunk, done))	return false;
+		done += chunk;
+	}
+	return done == length;
+}
+static bool writeFileBlocks(BlockDevice &disk, const FileEntry* file, int64_t offset, const char* data, int64_t length){
+	return forEachExtentRange(file, offset, length, [&](off_t position, size_t size, int64_t done){
+		return disk.writeAt(position, size, data + done);
+	});
+}
+std::string System::readFileData(BlockDevice &disk, FileEntry* file, ClientSession* session){	
 	// std::cout << "Reading data from file '" << file->fileName << "'.\n";
 	std::string fileContent;
-	int extent = 0;
-	// std::cout << "File Name: " << file->fileName << '\n';
-	// std::cout << "File Size: " << file->fileSize << '\n';
-	while (extent < file->numExtents){
-		int ln = file->extents[extent].length, bytesToRead = 0, bytesRead = 0;
-		// Counting total bytes to read from all extents
-		for (int i = 0; i < ln; i++){
-			bytesToRead = std::min(BLOCK_SIZE, std::max(0, file->fileSize - bytesRead));
-			bytesRead += bytesToRead;
-		}
-		std::streamsize size = file->extents[extent].length * BLOCK_SIZE;
-		std::string buffer(size, '\0');
-		// std::vector<char> buffer(bytesToRead, 0);
-		disk.seekg(file->extents[extent].startBlock * BLOCK_SIZE, std::ios::beg);
-		// disk.read(buffer.data(), bytesToRead);
-		disk.read(&buffer[0], bytesRead);
-		if (disk.fail()){
-			session->oss << "\nError: Cannot read file contents at block: " << file->extents[extent].startBlock << ".\n";
-			disk.clear();
-			return "";
-		}
-		// std::cout << "\nReading from block: " << file->extents[extent].startBlock << " with length: " << file->extents[extent].length << ":\n";
-		// std::cout << buffer;
-		// for (char ch : buffer){
-		// 	std::cout << ch;
-		// }
-		fileContent.append(buffer.begin(), buffer.end());
-		if (bytesRead >= file->fileSize)	break;
-		extent++;
-	}
+	if (!readFileRange(disk, file, 0, file->fileSize, fileContent, session))	return "";
 	// std::cout << "\n\tFile contents read successfully.\n";
 	fileContent.insert(fileContent.end(), '\n');
 	return fileContent;
 }
-void deleteFile(System& fs, ClientSession* session, std::fstream &disk, FileEntry* file, const int fileInd){
+// Reads at most length bytes from offset; the range is cut short at the end
+// of the file. Only the blocks it covers are read.
+bool System::readFileRange(BlockDevice &disk, FileEntry* file, int64_t offset, int64_t length, std::string &content, ClientSession* session){
+	content.clear();
+	if (offset < 0 || length < 0){
+		session->oss << "Error: Offset and length must not be negative.\n";
+		return false;
+	}
+	if (offset >= file->fileSize)	return true;
+	length = std::min(length, file->fileSize - offset);
+	if (file->hasInlineData){
+		content = file->inlineData.substr(offset, length); // No I/O beyond the directory entry
+		return true;
+	}
+	content.assign(length, '\0');
+	if (file->unwritten)	return true;
+	const bool check = forEachExtentRange(file, offset, length, [&](off_t position, size_t size, int64_t done){
+		return disk.readAt(position, size, &content[done]);
+	});
+	if (!check){
+		session->oss << "\nError: Cannot read file contents at offset: " << offset << ".\n";
+		content.clear();
+		return false;
+	}
+	return true;
+}
+// Hands the file to stream one block at a time, so memory use stays constant
+// whatever the file size. Long extent ranges go to stream.sendFile when it is set. The output matches readFileData, trailing '\n' included.
+bool System::streamFileData(BlockDevice &disk, FileEntry* file, const ReadStream &stream, ClientSession* session){
+	if (!stream.start(file->fileSize + 1))	return false;
+	bool check = true;
+	if (file->hasInlineData)	check = stream.write(file->inlineData.data(), file->inlineData.size());
+	else if (file->unwritten){
+		const std::vector<char> zeros(BLOCK_SIZE, 0);
+		for (int64_t done = 0; check && done < file->fileSize; done += BLOCK_SIZE){
+			check = stream.write(zeros.data(), static_cast<size_t>(std::min<int64_t>(BLOCK_SIZE, file->fileSize - done)));
+		}
+	}
+	else {
+		std::vector<char> block(BLOCK_SIZE);
+		check = forEachExtentRange(file, 0, file->fileSize, [&](off_t position, size_t size, int64_t){
+			if (stream.sendFile && size >= SENDFILE_MIN_BYTES){
+				const int imageFd = disk.directReadFd(position, size);
+				if (imageFd != -1)	return stream.sendFile(imageFd, position, size);
+			}
+			for (size_t done = 0; done < size; done += BLOCK_SIZE){
+				const size_t chunk = std::min(size - done, static_cast<size_t>(BLOCK_SIZE));
+				if (!disk.readAt(position + static_cast<off_t>(done), chunk, block.data()))	{
+					session->oss << "\nError: Cannot read file contents at offset: " << position + static_cast<off_t>(done) << ".\n";
+					return false;
+				}
+				if (!stream.write(block.data(), chunk))	return false;
+			}
+			return true;
+		});
+	}
+	return check && stream.write("\n", 1);
+}
+// Writes data at offset, growing the file when the range ends past it; a gap
+// between the old end and offset reads as zeros. Only the blocks the range
+// covers are written.
+void writeFileRange(System& fs, ClientSession* session, BlockDevice &disk, FileEntry* file, const int fileIndex, const int64_t offset, const std::string &data){
+	if (offset < 0){
+		session->oss << "Error: Offset must not be negative.\n";
+		return;
+	}
+	const int64_t end = offset + static_cast<int64_t>(data.size());
+	const int64_t newSize = std::max(file->fileSize, end);
+	FileEntry* orgFileEntry;
+	{
+		std::shared_lock<std::shared_mutex> lock(fs.metaMutex);
+		orgFileEntry = fs.metaDataTable[fileIndex];
+	}
+	std::vector<int64_t> newlyAllocatedBlocks;
+	int64_t reqBlocksUpdate = 0;
+	if (file->hasInlineData && newSize <= fs.superblock.inlineDataCapacity()){
+		if (static_cast<int64_t>(file->inlineData.size()) < newSize)	file->inlineData.resize(newSize, '\0');
+		file->inlineData.replace(offset, data.size(), data);
+	}
+	else{
+		const int64_t difference = (newSize + BLOCK_SIZE - 1)/BLOCK_SIZE - file->blockCount();
+		if (difference > 0){
+			if (fs.availableBlocks() < difference){
+				session->oss << "Error: Not enough storage for additional data.\n";
+				return;
+			}
+			const int groupHint = (file->numExtents() > 0) ? fs.groupOf(file->lastBlock()) : file->parentIndex;
+			newlyAllocatedBlocks = fs.allocateBitMapBlocks(difference, session, groupHint);
+			if (newlyAllocatedBlocks.empty()){
+				session->oss << "Error: Not enough storage for additional data.\n";
+				return;
+			}
+			file->addBlocks(newlyAllocatedBlocks);
+			reqBlocksUpdate = difference;
+		}
+		bool check = true;
+		if (file->hasInlineData){
+			// Outgrew the directory entry: the old contents move to the blocks too
+			check = writeFileBlocks(disk, file, 0, file->inlineData.data(), file->inlineData.size());
+			file->hasInlineData = false;
+			file->inlineData.clear();
+		}
+		else if (offset > file->fileSize && !file->unwritten){
+			// Bytes past the old end of its last block may hold earlier contents
+			const int64_t gapEnd = std::min(offset, (file->fileSize + BLOCK_SIZE - 1)/BLOCK_SIZE * BLOCK_SIZE);
+			std::vector<char> zeros(std::max<int64_t>(gapEnd - file->fileSize, 0), 0);
+			check = writeFileBlocks(disk, file, file->fileSize, zeros.data(), zeros.size());
+		}
+		if (check && end > file->fileSize && end % BLOCK_SIZE != 0){
+			// The rest of the new last block, which may not have been written before
+			const std::vector<char> zeros(BLOCK_SIZE - end % BLOCK_SIZE, 0);
+			check = writeFileBlocks(disk, file, end, zeros.data(), zeros.size());
+		}
+		if (!check || !writeFileBlocks(disk, file, offset, data.data(), data.size())){
+			session->oss << "Error: Failed to write data to disk for file '" << file->fileName << "' at offset: " << offset << ".\n";
+			fs.rollbackMetadataOrg(disk, false, orgFileEntry, fileIndex, newlyAllocatedBlocks);
+			return;
+		}
+		file->unwritten = false; // Blocks outside the range are still zeros
+	}
+	FileEntry* parentDir = nullptr;
+	{
+		std::shared_lock<std::shared_mutex> lock(fs.metaMutex);
+		if (file->parentIndex != 0){
+			for (auto& entry : fs.metaDataTable) {
+				if (entry->dirID == file->parentIndex && entry->isDirectory && entry->owner_id == session->user.user_id){
+					parentDir = entry;
+					break;
+				}
+			}
+			if (!parentDir) {
+				session->oss << "Error: No parent directory found.\n";
+				return;
+			}
+			parentDir->fileSize += newSize - file->fileSize;
+		}
+	}
+	session->user.totalSize += newSize - file->fileSize;
+	file->fileSize = newSize;
+	uint64_t current_time = std::time(nullptr);
+	file->modified_at = current_time;
+	file->accessed_at = current_time;
+	fs.adjustFreeBlocks(-reqBlocksUpdate);
+	int save = fs.saveDirectoryTable(disk, fileIndex, session);
+	if (save == 0) {
+		fs.rollbackMetadataOrg(disk, true, orgFileEntry, fileIndex, newlyAllocatedBlocks);
+		return;
+	}
+	save = fs.saveSuperblock(disk);
+	if (save == 0){
+		fs.rollbackMetadataOrg(disk, true, orgFileEntry, fileIndex, newlyAllocatedBlocks);
+		return;
+	}
+	save = fs.flushBitMap(disk);
+	if (save == 0){
+		fs.rollbackMetadataOrg(disk, true, orgFileEntry, fileIndex, newlyAllocatedBlocks);
+		return;
+	}
+}
+void deleteFile(System& fs, ClientSession* session, BlockDevice &disk, FileEntry* file, const int fileInd){
 	// std::cout << "Deleting file '" << file->fileName << '\n';
 	if (!disk){
 		session->oss << "Error: Disk not accessible while deleting a file.\n";
 		// std::cerr << "\tError: Disk not accessible while deleting a file.\n";
 		return;
 	}
-	std::vector<int> newlyAllocatedBlocks;
-	int freed = 0;
-	std::vector<char> emptyBlock(BLOCK_SIZE, 0);
-	int extent = 0;
-	while (extent < MAX_EXTENTS){
-		int ln = file->extents[extent].length;
-		for (int i = 0; i < ln; i++)	newlyAllocatedBlocks.push_back(file->extents[extent].startBlock + i);
-		extent++;
-		freed += ln;
-	}
-	for(int block : newlyAllocatedBlocks){
-		disk.seekp(block * BLOCK_SIZE, std::ios::beg);
-		disk.write(emptyBlock.data(), emptyBlock.size());
-		if (disk.fail()){
-			session->oss << "Error: Cannot erase data.\n";
-			// std::cerr << "\tError: Cannot erase data.\n";
-			disk.clear();
-			return;
-		}	
-	}
+	// Data blocks plus the extent tree's node blocks
+	std::vector<int64_t> newlyAllocatedBlocks = file->allBlocks();
+	newlyAllocatedBlocks.insert(newlyAllocatedBlocks.end(), file->extentIndexBlocks.begin(), file->extentIndexBlocks.end());
 	// std::cout << "\tClearing up space\n";
-	fs.freeBitMapBlocks(disk, newlyAllocatedBlocks);
-	fs.saveBitMap(disk);
+	const int64_t freed = fs.freeBitMapBlocks(newlyAllocatedBlocks);
+	fs.flushBitMap(disk);
 	{
 		std::unique_lock<std::shared_mutex> lock(fs.metaMutex);
 		fs.metaDataTable[fileInd] = new FileEntry();
 	}
-	fs.superblock.freeBlocks += freed;
+	fs.adjustFreeBlocks(freed);
 	int save = fs.saveDirectoryTable(disk, fileInd, session);
 	if (save == 0){
 		session->oss << "Error: File entry update error during file deletion\n";
@@ -402,7 +486,5 @@ void deleteFile(System& fs, ClientSession* session, std::fstream &disk, FileEntr
 		return;
 	}
 	fs.Entries->removeFileEntry(file->fileName);
-	
-	disk.flush();
 	// std::cout << "\tFile deleted successfully.\n";
 }
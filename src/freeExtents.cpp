@@ -0,0 +1,91 @@
+#include "freeExtents.h"
+
+#include <algorithm>
+
+void FreeExtentIndex::clear() {
+	byStart.clear();
+	byLength.clear();
+	freeBlocks = 0;
+}
+
+void FreeExtentIndex::build(const Bitmap& bitmap, int64_t floor, int64_t limit) {
+	clear();
+	size_t start = bitmap.findFree(static_cast<size_t>(floor), static_cast<size_t>(limit));
+	while (start != Bitmap::npos) {
+		size_t end = bitmap.findUsed(start, static_cast<size_t>(limit));
+		if (end == Bitmap::npos)	end = std::min(bitmap.size(), static_cast<size_t>(limit));
+		add(static_cast<int64_t>(start), static_cast<int64_t>(end - start));
+		start = bitmap.findFree(end, static_cast<size_t>(limit));
+	}
+}
+
+void FreeExtentIndex::add(int64_t start, int64_t length) {
+	byStart.emplace(start, length);
+	byLength.emplace(length, start);
+	freeBlocks += length;
+}
+
+void FreeExtentIndex::erase(std::map<int64_t, int64_t>::iterator it) {
+	byLength.erase({it->second, it->first});
+	freeBlocks -= it->second;
+	byStart.erase(it);
+}
+
+// Hands out the first count blocks of the run and keeps the remainder.
+void FreeExtentIndex::take(std::map<int64_t, int64_t>::iterator it, int64_t count, std::vector<int64_t>& blocks) {
+	const int64_t start = it->first;
+	const int64_t length = it->second;
+	erase(it);
+	for (int64_t i = 0; i < count; i++)	blocks.push_back(start + i);
+	if (length > count)	add(start + count, length - count);
+}
+
+bool FreeExtentIndex::allocate(int64_t count, std::vector<int64_t>& blocks) {
+	if (count <= 0)	return true;
+	if (count > freeBlocks)	return false;
+
+	auto fit = byLength.lower_bound({count, INT64_MIN});
+	if (fit != byLength.end()) {
+		take(byStart.find(fit->second), count, blocks);
+		return true;
+	}
+	const size_t first = blocks.size();
+	int64_t remaining = count;
+	while (remaining > 0) {
+		const auto largest = std::prev(byLength.end());
+		const int64_t length = std::min(largest->first, remaining);
+		take(byStart.find(largest->second), length, blocks);
+		remaining -= length;
+	}
+	std::sort(blocks.begin() + first, blocks.end());
+	return true;
+}
+
+void FreeExtentIndex::release(int64_t start, int64_t length) {
+	if (length <= 0)	return;
+	auto next = byStart.lower_bound(start);
+	if (next != byStart.begin()) {
+		auto prev = std::prev(next);
+		if (prev->first + prev->second == start) {
+			start = prev->first;
+			length += prev->second;
+			erase(prev);
+		}
+	}
+	if (next != byStart.end() && start + length == next->first) {
+		length += next->second;
+		erase(next);
+	}
+	add(start, length);
+}
+
+void FreeExtentIndex::release(const std::vector<int64_t>& blocks) {
+	std::vector<int64_t> sorted(blocks);
+	std::sort(sorted.begin(), sorted.end());
+	for (size_t i = 0; i < sorted.size();) {
+		size_t j = i + 1;
+		while (j < sorted.size() && sorted[j] == sorted[j - 1] + 1)	j++;
+		release(sorted[i], static_cast<int64_t>(j - i));
+		i = j;
+	}
+}
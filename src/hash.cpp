@@ -1,11 +1,14 @@
 #include <iostream>
+#include <cstring>
 #include "hash.h"
 typedef uint8_t u8;
 typedef uint32_t u32;
 typedef uint64_t u64;
 
-int hashFileName(const std::string& fileName) {
-	std::vector<uint8_t> digest = sha256(fileName);
+// Passwords keep the first four bytes of their SHA-256 digest; the user
+// table stores exactly this value.
+int hashPassword(const std::string& password) {
+	std::vector<uint8_t> digest = sha256(password);
 	int hashValue = 0;
 	for (int i = 0; i < 4; i++) {
 		hashValue = (hashValue << 8) | digest[i];
@@ -14,6 +17,82 @@ int hashFileName(const std::string& fileName) {
 	return hashValue;
 }
 
+// Name hashing, after wyhash: a few 64x64->128 bit multiplies instead of 64
+// rounds of SHA-256. The value is stored in the B+ tree, so it must not change.
+static const u64 nameSecret[4] = {0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull};
+
+static inline void multiply128(u64& low, u64& high) {
+	__uint128_t product = static_cast<__uint128_t>(low) * high;
+	low = static_cast<u64>(product);
+	high = static_cast<u64>(product >> 64);
+}
+
+static inline u64 mix(u64 a, u64 b) {
+	multiply128(a, b);
+	return a ^ b;
+}
+
+static inline u64 read64(const u8* p) {
+	u64 value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static inline u64 read32(const u8* p) {
+	u32 value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+// One to three bytes: the first, middle and last
+static inline u64 read3(const u8* p, size_t length) {
+	return (static_cast<u64>(p[0]) << 16) | (static_cast<u64>(p[length >> 1]) << 8) | p[length - 1];
+}
+
+uint64_t hashName(const std::string& name) {
+	const u8* p = reinterpret_cast<const u8*>(name.data());
+	const size_t length = name.size();
+	u64 seed = mix(nameSecret[0], nameSecret[1]);
+	u64 a, b;
+	if (length <= 16) {
+		if (length >= 4) {
+			const size_t step = (length >> 3) << 2;
+			a = (read32(p) << 32) | read32(p + step);
+			b = (read32(p + length - 4) << 32) | read32(p + length - 4 - step);
+		}
+		else if (length > 0) {
+			a = read3(p, length);
+			b = 0;
+		}
+		else	a = b = 0;
+	}
+	else {
+		size_t remaining = length;
+		if (remaining > 48) {
+			u64 seed1 = seed, seed2 = seed;
+			do {
+				seed = mix(read64(p) ^ nameSecret[1], read64(p + 8) ^ seed);
+				seed1 = mix(read64(p + 16) ^ nameSecret[2], read64(p + 24) ^ seed1);
+				seed2 = mix(read64(p + 32) ^ nameSecret[3], read64(p + 40) ^ seed2);
+				p += 48;
+				remaining -= 48;
+			} while (remaining > 48);
+			seed ^= seed1 ^ seed2;
+		}
+		while (remaining > 16) {
+			seed = mix(read64(p) ^ nameSecret[1], read64(p + 8) ^ seed);
+			p += 16;
+			remaining -= 16;
+		}
+		a = read64(p + remaining - 16);
+		b = read64(p + remaining - 8);
+	}
+	a ^= nameSecret[1];
+	b ^= seed;
+	multiply128(a, b);
+	return mix(a ^ nameSecret[0] ^ length, b ^ nameSecret[1]);
+}
+
 const u32 K[] = {
     0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
     0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
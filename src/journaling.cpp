@@ -42,7 +42,7 @@ void JournalManager::appendToFile(const FileJournaling& journal) {
 	entryOffsets.push_back(pos);
 	journalFile.close();
 }
-uint64_t JournalManager::logOperation(std::string user, const std::string& op, const std::string& fileName, const std::string& newFileName, const std::string& data, uint32_t fileSize, const int currentDir) {
+uint64_t JournalManager::logOperation(std::string user, const std::string& op, const std::string& fileName, const std::string& newFileName, const std::string& data, uint64_t fileSize, const int currentDir, int64_t offset) {
 	uint64_t timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
 	FileJournaling entry {
 		user,
@@ -54,16 +54,22 @@ uint64_t JournalManager::logOperation(std::string user, const std::string& op, c
 		fileSize,
 		data,
 		false,
-		false
+		false,
+		offset
 	};
 	{
 		std::unique_lock<std::mutex> lock(journalMutex);
+		// markCommitted finds entries by timestamp, so keep them strictly increasing
+		if (!journals.empty() && entry.timestamp <= journals.back().timestamp)	entry.timestamp = journals.back().timestamp + 1;
+		timestamp = entry.timestamp;
 		journals.push_back(entry);
 		appendToFile(entry);
 	}
 	return timestamp;
 }
 void JournalManager::markCommitted(uint64_t timestamp) {
+	system->flushBitMap(system->device);
+	if (!system->device.commit())	std::cerr << "Error: Unable to sync the disk image at commit.\n";
 	std::unique_lock<std::mutex> lock(journalMutex);
 	int low = 0, high = static_cast<int>(journals.size()) - 1, mid;
 	while (low <= high) {
@@ -152,6 +158,9 @@ void JournalManager::updateUncommitedOperations(std::vector<FileJournaling>& unc
 		} else if (entry.operation == OP_WRITE_APPEND) {
 			entry.fileName.erase(0, 2 + static_cast<int>(std::to_string(entry.directory).length() + std::to_string(session->user.user_id).length()));
 			system->writeData(entry.fileName, entry.data, true, session, entry.check, entry.timestamp, &entry);
+		} else if (entry.operation == OP_WRITE_AT) {
+			entry.fileName.erase(0, 2 + static_cast<int>(std::to_string(entry.directory).length() + std::to_string(session->user.user_id).length()));
+			system->writeDataAt(entry.fileName, entry.offset, entry.data, session, entry.check, entry.timestamp, &entry);
 		} else if (entry.operation == OP_RENAME) {
 			entry.fileName.erase(0, 2 + static_cast<int>(std::to_string(entry.directory).length() + std::to_string(session->user.user_id).length()));
 			system->renameFiles(entry.fileName, entry.newFileName, session, entry.check, entry.timestamp, &entry);
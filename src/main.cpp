@@ -11,12 +11,22 @@
 #include "UNIX/ipc_server.h"
 #include "UNIX/ipc_client.h"
 
-void handle_sigint(int signal) {
-    cleanup();
-}
-
-int main() {
-    signal(SIGINT, handle_sigint);
+// The server installs its own SIGINT handler (a clean shutdown); a client
+// keeps the default and simply exits.
+int main(int argc, char* argv[]) {
+    MountOptions options;
+    bool batch = false;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg(argv[i]);
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--mmap")   options.mapImage = true;
+        // Geometry of a newly formatted image
+        else if (arg == "--size" && hasValue)   options.format.diskSize = std::stoull(argv[++i]) * 1024 * 1024;
+        else if (arg == "--max-size" && hasValue)   options.format.maxDiskSize = std::stoull(argv[++i]) * 1024 * 1024;
+        else if (arg == "--max-files" && hasValue)  options.format.maxFiles = std::stoi(argv[++i]);
+        else if (arg == "--order" && hasValue)  options.format.order = std::stoi(argv[++i]);
+        else if (arg == "--batch")  batch = true;
+    }
     
     // pid_t pid = fork();
     // if (pid < 0) {
@@ -29,7 +39,7 @@ int main() {
     // } else {
     //     run_server();
     // }
-    if (!is_server_running())   run_server();
-    else  run_client();
+    if (!is_server_running())   run_server(options);
+    else  run_client(batch);
     return 0;
 }
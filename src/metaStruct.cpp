@@ -1,583 +1,607 @@
 #include "metaStruct.h"
 
+#include <thread>
+
 /*
-Each node will save:
-nodeID (4 bytes)
-isLeaf (1 byte)
-numKeys (4 bytes)
-keys[4] (4 × 4 = 16 bytes)
-If leaf:
-values[4] (4 × 4 = 16 bytes)
-nextLeafID (4 bytes)
-If internal:
-children[5] (5 × 4 = 20 bytes)
+The tree lives in the B+ tree region, one node per block:
+page 0: IndexHeader (magic, clean flag, root page, pages in use)
+leaf page: LeafPage
+	isLeaf, count (2 bytes each), next leaf (4 bytes)
+	hashes[LEAF_KEYS] (8 bytes each)
+	slots[LEAF_KEYS] (4 bytes each)
+	names[LEAF_KEYS] (FILE_NAME_LENGTH bytes each)
+internal page: InternalPage
+	isLeaf, count (2 bytes each), unused (4 bytes)
+	hashes[INTERNAL_KEYS] (8 bytes each)
+	children[INTERNAL_KEYS + 1] (4 bytes each)
+Nodes are read through a NodePool and written back one page at a time.
+Each node is guarded by the version latch of its frame.
 */
 
-int BPlusTree::saveBPlusTree(std::fstream &disk) {
-    if (!disk.is_open()) {
-        std::cerr << "Error: Cannot access disk to save B+ Tree.\n";
-        return 0;
-    }
-
-    std::vector<char> buffer(BLOCK_SIZE, 0);
-    int offset = 0;
-    int blockIndex = 0;
-
-    std::queue<BPlusTreeNode*> q;
-	std::unordered_set<int> visited;
-    q.push(root);
-
-    while (!q.empty()) {
-        BPlusTreeNode* current = q.front();
-        q.pop();
-
-        if (!current || visited.count(current->nodeID)) continue;
-		visited.insert(current->nodeID);
-
-        std::vector<char> nodeBuffer;
-        nodeBuffer.insert(nodeBuffer.end(), reinterpret_cast<char*>(&current->nodeID), reinterpret_cast<char*>(&current->nodeID) + sizeof(int));
-		uint8_t leafFlag = static_cast<uint8_t>(current->isLeaf);
-        nodeBuffer.insert(nodeBuffer.end(), reinterpret_cast<char*>(&leafFlag), reinterpret_cast<char*>(&leafFlag) + sizeof(uint8_t));
-        int numKeys = current->keys.size();
-        nodeBuffer.insert(nodeBuffer.end(), reinterpret_cast<char*>(&numKeys), reinterpret_cast<char*>(&numKeys) + sizeof(int));
-        for (int key : current->keys) {
-            nodeBuffer.insert(nodeBuffer.end(), reinterpret_cast<char*>(&key), reinterpret_cast<char*>(&key) + sizeof(int));
-        }
-        if (current->isLeaf) {
-            for (int val : current->values) {
-				nodeBuffer.insert(nodeBuffer.end(), reinterpret_cast<char*>(&val), reinterpret_cast<char*>(&val) + sizeof(int));
-            }
-            int nextLeafID = (current->nextLeaf) ? current->nextLeaf->nodeID : -1;
-            nodeBuffer.insert(nodeBuffer.end(), reinterpret_cast<char*>(&nextLeafID), reinterpret_cast<char*>(&nextLeafID) + sizeof(int));
-        } else {
-			int numChildren = current->children.size();
-			nodeBuffer.insert(nodeBuffer.end(), reinterpret_cast<char*>(&numChildren), reinterpret_cast<char*>(&numChildren) + sizeof(int));
-            for (BPlusTreeNode* child : current->children) {
-                int childID = (child) ? child->nodeID : -1;
-                nodeBuffer.insert(nodeBuffer.end(), reinterpret_cast<char*>(&childID), reinterpret_cast<char*>(&childID) + sizeof(int));
-                if (child) q.push(child);
-            }
-        }
-
-        if (offset + nodeBuffer.size() > BLOCK_SIZE) {
-            disk.seekp(BPLUS_TREE_START * BLOCK_SIZE + blockIndex * BLOCK_SIZE, std::ios::beg);
-            disk.write(buffer.data(), BLOCK_SIZE);
-
-            std::fill(buffer.begin(), buffer.end(), 0);
-            offset = 0;
-            blockIndex++;
-        }
-
-        memcpy(buffer.data() + offset, nodeBuffer.data(), nodeBuffer.size());
-        offset += nodeBuffer.size();
-    }
-
-    if (offset > 0) {
-        disk.seekp(BPLUS_TREE_START * BLOCK_SIZE + blockIndex * BLOCK_SIZE, std::ios::beg);
-        disk.write(buffer.data(), BLOCK_SIZE);
-        disk.flush();
-    }
-
-	disk.flush();
-    return 1;
-}
+namespace {
+	// Version latches: the low bit is never set, bit 1 is held by a writer, and
+	// each release moves the version on.
+	constexpr uint64_t LATCH_LOCKED = 2;
+
+	// Notes the version to validate a read against; false while a writer holds
+	// the latch.
+	bool readLatch(const std::atomic<uint64_t>& latch, uint64_t& version) {
+		version = latch.load(std::memory_order_acquire);
+		if (!(version & LATCH_LOCKED))	return true;
+		std::this_thread::yield();
+		return false;
+	}
 
-int BPlusTree::loadBPlusTree(std::fstream &disk) {
-    if (!disk.is_open()) {
-        std::cerr << "Error: Cannot access disk to load B+ Tree.\n";
-        return 0;
-    }
+	// True when nothing was written under the latch since version was read.
+	bool validLatch(const std::atomic<uint64_t>& latch, uint64_t version) {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return latch.load(std::memory_order_relaxed) == version;
+	}
 
-    disk.seekg(BPLUS_TREE_START * BLOCK_SIZE, std::ios::beg);
-	std::vector<char> buffer(BLOCK_SIZE);
-	
-	std::unordered_map<int, BPlusTreeNode*> nodeMap;
-    std::unordered_map<int, std::vector<int>> tempChildrenMap;
-    std::unordered_map<int, int> tempNextLeafMap;
-	
-	while (disk.read(buffer.data(), BLOCK_SIZE)){
-		size_t offset = 0;
-		while (offset <= BLOCK_SIZE) {
-			int nodeID;
-			memcpy(&nodeID, buffer.data() + offset, sizeof(int));
-			if (nodeID == 0)	break;
-			offset += sizeof(int);
-			
-			if (offset + sizeof(uint8_t) > BLOCK_SIZE)	break;
-			uint8_t leafFlag;
-            memcpy(&leafFlag, buffer.data() + offset, sizeof(uint8_t));
-            offset += sizeof(uint8_t);
-			bool isLeaf = static_cast<bool>(leafFlag);
-
-			if (offset + sizeof(int) > BLOCK_SIZE) break;
-            int numKeys;
-            memcpy(&numKeys, buffer.data() + offset, sizeof(int));
-            offset += sizeof(int);
-
-			if (offset + numKeys * sizeof(int) > BLOCK_SIZE) break;
-            std::vector<int> keys(numKeys);
-            for (int i = 0; i < numKeys; ++i) {
-                memcpy(&keys[i], buffer.data() + offset, sizeof(int));
-                offset += sizeof(int);
-            }
-
-			BPlusTreeNode* newNode = new BPlusTreeNode();
-			if (nodeMap.empty())	root = newNode;
-			newNode->nodeID = nodeID;
-			newNode->isLeaf = isLeaf;
-			newNode->keys = keys;
-
-			if (isLeaf) {
-				if (offset + keys.size() * sizeof(int) > BLOCK_SIZE)	break;
-				for (int i = 0; i < numKeys; i++) {
-					int value;
-					memcpy(&value, buffer.data() + offset, sizeof(int));
-					newNode->values.push_back(value);
-					offset += sizeof(int);
-				}
-				int nextLeafNode;
-				memcpy(&nextLeafNode, buffer.data() + offset, sizeof(int));
-				offset += sizeof(int);
-				tempNextLeafMap[newNode->nodeID] = nextLeafNode;
-			} else {
-				if (offset + sizeof(int) > BLOCK_SIZE)	break;
-				int numChildren;
-				memcpy(&numChildren, buffer.data() + offset, sizeof(int));
-				offset += sizeof(int);
-
-				if (offset + numChildren * sizeof(int) > BLOCK_SIZE)	break;
-				std::vector<int> childIDs;
-				for (int i = 0; i < numChildren; i++) {
-					int child;
-					memcpy(&child, buffer.data() + offset, sizeof(int));
-					offset += sizeof(int);
-					childIDs.push_back(child);
-				}
-				tempChildrenMap[newNode->nodeID] = childIDs;
-			}
-			nodeMap[newNode->nodeID] = newNode;
-		}
+	// Takes the latch, provided nothing was written since version was read.
+	bool upgradeLatch(std::atomic<uint64_t>& latch, uint64_t version) {
+		return latch.compare_exchange_strong(version, version + LATCH_LOCKED, std::memory_order_acquire);
 	}
 
-	for (auto& [id, node] : nodeMap) {
-		if (!node->isLeaf) {
-			for (int childID : tempChildrenMap[id]) {
-				if (nodeMap.count(childID)){
-					node->children.push_back(nodeMap[childID]);
-					nodeMap[childID]->parent = node;
-				}
-			}
-		}
-		else {
-			int nextLeafId = tempNextLeafMap[id];
-			if (nodeMap.count(nextLeafId)) {
-				node->nextLeaf = nodeMap[nextLeafId];
-			}
-		}
+	void releaseLatch(std::atomic<uint64_t>& latch) {
+		latch.fetch_add(LATCH_LOCKED, std::memory_order_release);
 	}
-	
-	if (nodeMap.empty()) {
-        root = new BPlusTreeNode();
-		root->isLeaf = true;
-		root->nodeID = ++nodes;
-		return 0;
-    }
-
-	return 1;
-}
 
+	// Both latches or neither.
+	bool upgradeLatches(std::atomic<uint64_t>& first, uint64_t firstVersion, std::atomic<uint64_t>& second, uint64_t secondVersion) {
+		if (!upgradeLatch(first, firstVersion))	return false;
+		if (upgradeLatch(second, secondVersion))	return true;
+		releaseLatch(first);
+		return false;
+	}
 
-BPlusTree::BPlusTree(int order) {
-	this->order = order;
-	root = new BPlusTreeNode();
-	root->isLeaf = true;
-	root->nodeID = ++nodes;
-}
-// BPlusTree::~BPlusTree() {
-// 	std::function<void(BPlusTreeNode*)> deleteNodes = [&](BPlusTreeNode* node){
-// 		if (!node)	return;
-// 		for (BPlusTreeNode* child : node->children)	deleteNodes(child);
-// 		delete node;
-// 	};
-// 	deleteNodes(root);
-// }
-BPlusTreeNode* BPlusTree::findLeafNode(int key){
-	BPlusTreeNode* node = root;
-	while (!node->isLeaf) {
-		int i = 0;
-		while (i < static_cast<int>(node->keys.size()) && key >= node->keys[i])	i++;
-		node = node->children[i];
+	// Branch-free binary search over sorted hashes: the number of them below
+	// hash, or with Inclusive, not above it. The loop runs log2(count) times
+	// whatever the data, and the compiler turns the select into a cmov.
+	template <bool Inclusive>
+	int rank(const uint64_t* hashes, int count, uint64_t hash) {
+		if (count == 0)	return 0;
+		const uint64_t* base = hashes;
+		int length = count;
+		while (length > 1) {
+			const int half = length / 2;
+			const bool right = Inclusive ? base[half] <= hash : base[half] < hash;
+			base += right ? half : 0;
+			length -= half;
+		}
+		return static_cast<int>(base - hashes) + (Inclusive ? *base <= hash : *base < hash);
 	}
-	return node;
-}
-void BPlusTree::splitInternalNode(BPlusTreeNode* parent) {
-	int middleIndex = parent->keys.size() / 2;
-	int middleElement = parent->keys[middleIndex];
-
-	BPlusTreeNode* newNode = new BPlusTreeNode();
-	newNode->nodeID = ++nodes;
-	newNode->keys.assign(parent->keys.begin() + middleIndex + 1, parent->keys.end());
-	newNode->children.assign(parent->children.begin() + middleIndex + 1, parent->children.end());
-	
-	parent->keys.resize(middleIndex);
-	parent->children.resize(middleIndex + 1);
-
-	for (BPlusTreeNode* child : newNode->children) {
-		child->parent = newNode;
+
+	// A reader may see a page mid-change; its count is kept within the arrays
+	// so the read stays in bounds until the version check throws it away.
+	int keyCount(const InternalPage* node) {
+		return std::min<int>(node->count, INTERNAL_KEYS);
 	}
 
-	insertInternal(middleElement, parent, newNode);
-}
-void BPlusTree::insertInternal(int middleKey, BPlusTreeNode* leftChild, BPlusTreeNode* rightChild) {
-	if (!leftChild->parent) {
-		root = new BPlusTreeNode();
-		root->nodeID = ++nodes;
-		root->keys.push_back(middleKey);
-		root->children.push_back(leftChild);
-		root->children.push_back(rightChild);
-		leftChild->parent = root;
-		rightChild->parent = root;
-		return;
+	int keyCount(const LeafPage* leaf) {
+		return std::min<int>(leaf->count, LEAF_KEYS);
 	}
-	BPlusTreeNode* parent = leftChild->parent;
-	auto it = std::upper_bound(parent->keys.begin(), parent->keys.end(), middleKey);
-	int index = it - parent->keys.begin();
-
-	parent->keys.insert(it, middleKey);
-	parent->children.insert(parent->children.begin() + index + 1, rightChild);
-	rightChild->parent = parent;
-	
-	if (static_cast<int>(parent->keys.size()) >= order)	splitInternalNode(parent);
-}
-void BPlusTree::splitLeafNode(BPlusTreeNode* leaf){
-	int midIndex = leaf->keys.size() / 2;
-	
-	BPlusTreeNode* newLeaf = new BPlusTreeNode();
-	newLeaf->nodeID = ++nodes;
-	newLeaf->isLeaf = true;
-	newLeaf->keys.assign(leaf->keys.begin() + midIndex, leaf->keys.end());
-	newLeaf->values.assign(leaf->values.begin() + midIndex, leaf->values.end());
-
-	leaf->keys.resize(midIndex);
-	leaf->values.resize(midIndex);
-	
-	newLeaf->nextLeaf = leaf->nextLeaf;
-	leaf->nextLeaf = newLeaf;
-
-	int middleKey = newLeaf->keys.front();
-	insertInternal(middleKey, leaf, newLeaf);
-}
-void BPlusTree::insert(int key, const int metaIndex) {
-	BPlusTreeNode* leaf = findLeafNode(key);
 
-	auto it = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key);
-	int index = it - leaf->keys.begin();
-	leaf->keys.insert(it, key);
-	leaf->values.insert(leaf->values.begin() + index, metaIndex);
-	
+	// Child to follow for hash
+	int childIndex(const InternalPage* node, uint64_t hash) {
+		return rank<true>(node->hashes, keyCount(node), hash);
+	}
 
-	if (static_cast<int>(leaf->keys.size()) >= order)	splitLeafNode(leaf);
-	if (static_cast<int>(leaf->keys.size()) < (order + 1) / 2)	handleLeafUnderflow(leaf);
-}
+	// First slot whose key is not less than key
+	int lowerBound(const LeafPage* leaf, const IndexKey& key) {
+		const int count = keyCount(leaf);
+		int index = rank<false>(leaf->hashes, count, key.hash);
+		while (index < count && leaf->hashes[index] == key.hash && memcmp(leaf->names[index], key.name, FILE_NAME_LENGTH) < 0)	index++;
+		return index;
+	}
 
-bool BPlusTree::update(int key, int idx) {
-	BPlusTreeNode* leaf = findLeafNode(key);
-	int low = 0, high = leaf->keys.size() - 1, mid;
-	while (low <= high){
-		mid = (low + high) / 2;
-		if (leaf->keys[mid] == key) {
-			leaf->values[mid] = idx;
-			return true;
-		};
-		if (leaf->keys[mid] > key)	high = mid - 1;
-		else if (leaf->keys[mid] < key)	low = mid + 1;
+	bool matches(const LeafPage* leaf, int index, const IndexKey& key) {
+		return index < keyCount(leaf) && leaf->hashes[index] == key.hash && memcmp(leaf->names[index], key.name, FILE_NAME_LENGTH) == 0;
 	}
-	return	false;
-
-	// auto it = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key);
-	// if (it != leaf->keys.end()){
-	// 	int index = it - leaf->keys.begin();
-	// 	if (leaf->keys[index] == key)	return leaf->values[index];
-	// }
-	// return -1;
-}
 
-void BPlusTree::handleInternalUnderflow(BPlusTreeNode* node) {
-	if (!node->parent){
-		if (node->keys.empty() && !node->isLeaf && node->children.size() == 1) {
-			root = node->children[0];
-			root->parent = nullptr;
-			delete node;
-		}
-		return;
+	void insertIntoLeaf(LeafPage* leaf, const IndexKey& key, int32_t value) {
+		const int index = lowerBound(leaf, key);
+		std::copy_backward(leaf->hashes + index, leaf->hashes + leaf->count, leaf->hashes + leaf->count + 1);
+		std::copy_backward(leaf->slots + index, leaf->slots + leaf->count, leaf->slots + leaf->count + 1);
+		memmove(leaf->names[index + 1], leaf->names[index], static_cast<size_t>(leaf->count - index) * FILE_NAME_LENGTH);
+		leaf->hashes[index] = key.hash;
+		leaf->slots[index] = value;
+		memcpy(leaf->names[index], key.name, FILE_NAME_LENGTH);
+		leaf->count++;
 	}
 
-	BPlusTreeNode* parent = node->parent;
-	int nodeIndex = -1;
-	for (int i = 0; i < static_cast<int>(parent->children.size()); ++i) {
-		if (parent->children[i] == node) {
-			nodeIndex = i;
-			break;
-		}
+	void insertIntoInternal(InternalPage* node, uint64_t separator, int32_t child) {
+		const int index = childIndex(node, separator);
+		std::copy_backward(node->hashes + index, node->hashes + node->count, node->hashes + node->count + 1);
+		std::copy_backward(node->children + index + 1, node->children + node->count + 1, node->children + node->count + 2);
+		node->hashes[index] = separator;
+		node->children[index + 1] = child;
+		node->count++;
 	}
 
-	if (nodeIndex > 0) {
-		BPlusTreeNode* leftSibling = parent->children[nodeIndex - 1];
-		if (static_cast<int>(leftSibling->keys.size()) > (order + 1) / 2 - 1) {
-			node->keys.insert(node->keys.begin(), leftSibling->keys.back());
-			node->children.insert(node->children.begin(), leftSibling->children.back());
-			node->children.front()->parent = node;
-			
-			leftSibling->keys.pop_back();
-			leftSibling->children.pop_back();
-			
-			parent->keys[nodeIndex - 1] = node->keys.front();
-			return;
+	// Where to split a full leaf: the boundary between two different hashes
+	// nearest the middle, so a run of equal hashes stays in one leaf. -1 when
+	// every key shares one hash.
+	int splitPoint(const LeafPage* leaf) {
+		const int mid = leaf->count / 2;
+		for (int distance = 0; distance < leaf->count; distance++) {
+			const int above = mid + distance, below = mid - distance;
+			if (above > 0 && above < leaf->count && leaf->hashes[above - 1] != leaf->hashes[above])	return above;
+			if (below > 0 && below < leaf->count && leaf->hashes[below - 1] != leaf->hashes[below])	return below;
 		}
+		return -1;
 	}
-	if (nodeIndex < static_cast<int>(parent->children.size()) - 1) {
-		BPlusTreeNode* rightSibling = parent->children[nodeIndex + 1];
-		if (static_cast<int>(rightSibling->keys.size()) > (order + 1) / 2 - 1) {
-			node->keys.push_back(rightSibling->keys.front());
-			node->children.push_back(rightSibling->children.front());
-			node->children.back()->parent = node;
-	
-			rightSibling->keys.erase(rightSibling->keys.begin());
-			rightSibling->children.erase(rightSibling->children.begin());
-	
-			parent->keys[nodeIndex] = rightSibling->keys.front();
-			return;
+}
+
+// Keeps a page pinned for the life of the object. An empty PageRef stands for
+// the parent of the root.
+class BPlusTree::PageRef {
+	private:
+		NodePool* pool = nullptr;
+		int32_t number = -1;
+		PinnedPage page;
+		bool dirty = false;
+
+	public:
+		PageRef() = default;
+		PageRef(NodePool& pool, int32_t number, bool load = true) : pool(&pool), number(number), page(pool.pin(number, load)) {}
+		~PageRef() { release(); }
+		PageRef(const PageRef&) = delete;
+		PageRef& operator=(const PageRef&) = delete;
+		PageRef& operator=(PageRef&& other) noexcept {
+			release();
+			pool = other.pool;
+			number = other.number;
+			page = other.page;
+			dirty = other.dirty;
+			other.page = {};
+			other.dirty = false;
+			return *this;
 		}
-	}
 
-	if (nodeIndex > 0) {
-		BPlusTreeNode* leftSibling = parent->children[nodeIndex - 1];
-
-		leftSibling->keys.insert(leftSibling->keys.end(), node->keys.begin(), node->keys.end());
-		leftSibling->children.insert(leftSibling->children.end(), node->children.begin(), node->children.end());
-		for (auto child : leftSibling->children)	child->parent = leftSibling;
-		
-		parent->keys.erase(parent->keys.begin() + nodeIndex - 1);
-		parent->children.erase(parent->children.begin() + nodeIndex);
-		
-		delete node;
-		
-		if (static_cast<int>(parent->keys.size()) < (order + 1) / 2 - 1)	handleInternalUnderflow(parent);
-		
-		return;
+		void release() {
+			if (page.data)	pool->unpin(number, dirty);
+			page = {};
+			dirty = false;
+		}
+
+		explicit operator bool() const { return page.data != nullptr; }
+		int32_t pageNumber() const { return number; }
+		std::atomic<uint64_t>& latch() { return *page.latch; }
+		char* data() { return page.data; }
+		bool isLeaf() const { return reinterpret_cast<const IndexPageHeader*>(page.data)->isLeaf; }
+		LeafPage* leaf() { return reinterpret_cast<LeafPage*>(page.data); }
+		InternalPage* internal() { return reinterpret_cast<InternalPage*>(page.data); }
+		void markDirty() { dirty = true; }
+};
+
+BPlusTree::BPlusTree() : pool(INDEX_POOL_PAGES) {}
+
+int32_t BPlusTree::allocatePage() {
+	const int32_t number = pageCount.fetch_add(1);
+	if (number >= blockCount) {
+		pageCount.fetch_sub(1);
+		std::cerr << "Error: The metadata index region is full.\n";
+		return -1;
 	}
-	if (nodeIndex < static_cast<int>(parent->children.size()) - 1) {
-		BPlusTreeNode* rightSibling = parent->children[nodeIndex + 1];
-		
-		node->keys.insert(node->keys.end(), rightSibling->keys.begin(), rightSibling->keys.end());
-		node->children.insert(node->children.end(), rightSibling->children.begin(), rightSibling->children.end());
-		for (auto child : rightSibling->children)	child->parent = node;
+	return number;
+}
 
-		parent->keys.erase(parent->keys.begin() + nodeIndex);
-		parent->children.erase(parent->children.begin() + nodeIndex + 1);
+bool BPlusTree::writeHeader() {
+	const IndexHeader header{INDEX_MAGIC, clean, root.load(), pageCount.load()};
+	std::vector<char> buffer(BLOCK_SIZE, 0);
+	memcpy(buffer.data(), &header, sizeof(header));
+	return disk->writeBlocks(startBlock, 1, buffer.data());
+}
 
-		delete node;
+// Starts an empty tree in the region: the header and a root leaf.
+bool BPlusTree::create(BlockDevice &disk, int64_t startBlock, int64_t blockCount) {
+	if (blockCount < 2) {
+		std::cerr << "Error: The B+ Tree region is too small.\n";
+		return false;
+	}
+	this->disk = &disk;
+	this->startBlock = startBlock;
+	this->blockCount = blockCount;
+	pool.clear();
+	pool.attach(disk, startBlock);
+
+	clean = 0;
+	root = 1;
+	pageCount = 2;
+	{
+		PageRef rootRef(pool, root, false);
+		if (!rootRef)	return false;
+		memset(rootRef.leaf(), 0, BLOCK_SIZE);
+		rootRef.leaf()->isLeaf = 1;
+		rootRef.leaf()->next = -1;
+		rootRef.markDirty();
+	}
+	return flush();
+}
 
-		if (static_cast<int>(parent->keys.size()) < (order + 1) / 2 - 1)	handleInternalUnderflow(parent);
+// Fails when the region holds no tree, or one that was not closed cleanly and
+// so may be missing pages; the caller then rebuilds it. Until close() the
+// tree on disk is marked as not clean.
+bool BPlusTree::open(BlockDevice &disk, int64_t startBlock, int64_t blockCount) {
+	if (!disk.isOpen()) {
+		std::cerr << "Error: Cannot access disk to load B+ Tree.\n";
+		return false;
+	}
+	this->disk = &disk;
+	this->startBlock = startBlock;
+	this->blockCount = blockCount;
+	pool.clear();
+	pool.attach(disk, startBlock);
 
-		return;
+	std::vector<char> buffer(BLOCK_SIZE);
+	if (!disk.readBlocks(startBlock, 1, buffer.data()))	return false;
+	IndexHeader header;
+	memcpy(&header, buffer.data(), sizeof(header));
+	if (header.magic != INDEX_MAGIC || header.pageCount < 2 || header.pageCount > blockCount || header.root < 1 || header.root >= header.pageCount) {
+		std::cerr << "\tMetadata index not found.\n";
+		return false;
 	}
-}
-void BPlusTree::handleLeafUnderflow(BPlusTreeNode* leaf) {
-	if (!leaf->parent)	return;
-	
-	BPlusTreeNode* parent = leaf->parent;
-	int leafIndex = -1;
-	for (int i = 0; i < static_cast<int>(parent->children.size()); i++) {
-		if (parent->children[i] == leaf) {
-			leafIndex = i;
-			break;
-		}
+	if (!header.clean) {
+		std::cerr << "\tMetadata index was not closed cleanly.\n";
+		return false;
 	}
+	// Emptied pages are only reclaimed by a rebuild, which packs the tree again
+	if (header.pageCount > blockCount - blockCount / 4) {
+		std::cout << "\tMetadata index is nearly full.\n";
+		return false;
+	}
+	root = header.root;
+	pageCount = header.pageCount;
+	clean = 0;
+	return writeHeader() && disk.sync();
+}
 
-	if (leafIndex > 0) {
-		BPlusTreeNode* leftSibling = parent->children[leafIndex - 1];
-		if (static_cast<int>(leftSibling->keys.size()) > (order + 1) / 2 - 1) {
-			leaf->keys.insert(leaf->keys.begin(), leftSibling->keys.back());
-			leaf->values.insert(leaf->values.begin(), leftSibling->values.back());
+bool BPlusTree::flush() {
+	if (!disk)	return false;
+	return pool.flush() && writeHeader();
+}
 
-			leftSibling->keys.pop_back();
-			leftSibling->values.pop_back();
+bool BPlusTree::close() {
+	if (!disk)	return false;
+	if (!pool.flush())	return false;
+	clean = 1;
+	return writeHeader();
+}
 
-			parent->keys[leafIndex - 1] = leaf->keys.front();
-			return;
+// Builds the tree bottom-up from entries, sorting them first: leaves packed
+// full in key order, then each level of internal nodes over the one below.
+// Replaces whatever the tree held; nothing else may use it meanwhile.
+bool BPlusTree::bulkLoad(std::vector<std::pair<IndexKey, int32_t>>& entries) {
+	if (!disk)	return false;
+	std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+		if (a.first.hash != b.first.hash)	return a.first.hash < b.first.hash;
+		return memcmp(a.first.name, b.first.name, FILE_NAME_LENGTH) < 0;
+	});
+	pool.clear();
+	pageCount = 1;
+
+	// Each node of the level just built: its page and the least hash below it
+	std::vector<std::pair<int32_t, uint64_t>> level;
+	size_t begin = 0;
+	do {
+		size_t end = std::min(entries.size(), begin + LEAF_KEYS);
+		// A run of equal hashes stays in one leaf
+		while (end < entries.size() && end > begin && entries[end - 1].first.hash == entries[end].first.hash)	end--;
+		if (end == begin && begin < entries.size()) {
+			std::cerr << "Error: Too many names share one hash.\n";
+			return false;
 		}
-	}
-	if (leafIndex < static_cast<int>(parent->children.size()) - 1) {
-		BPlusTreeNode* rightSibling = parent->children[leafIndex + 1];
-		if (static_cast<int>(rightSibling->keys.size()) > (order + 1) / 2 - 1) {
-			leaf->keys.push_back(rightSibling->keys.front());
-			leaf->values.push_back(rightSibling->values.front());
-	
-			rightSibling->keys.erase(rightSibling->keys.begin());
-			rightSibling->values.erase(rightSibling->values.begin());
-	
-			parent->keys[leafIndex] = rightSibling->keys.front();
-			return;
+		const int32_t number = allocatePage();
+		if (number == -1)	return false;
+		PageRef leafRef(pool, number, false);
+		if (!leafRef)	return false;
+		LeafPage* leaf = leafRef.leaf();
+		memset(leaf, 0, BLOCK_SIZE);
+		leaf->isLeaf = 1;
+		leaf->count = static_cast<uint16_t>(end - begin);
+		leaf->next = end < entries.size() ? number + 1 : -1; // Leaves take consecutive pages
+		for (size_t i = begin; i < end; i++) {
+			leaf->hashes[i - begin] = entries[i].first.hash;
+			leaf->slots[i - begin] = entries[i].second;
+			memcpy(leaf->names[i - begin], entries[i].first.name, FILE_NAME_LENGTH);
+		}
+		leafRef.markDirty();
+		level.emplace_back(number, begin < end ? entries[begin].first.hash : 0);
+		begin = end;
+	} while (begin < entries.size());
+
+	while (level.size() > 1) {
+		const size_t fanOut = INTERNAL_KEYS + 1;
+		const size_t nodes = (level.size() + fanOut - 1) / fanOut;
+		std::vector<std::pair<int32_t, uint64_t>> above;
+		size_t child = 0;
+		for (size_t n = 0; n < nodes; n++) {
+			// Children are spread evenly, so no node is left nearly empty
+			const size_t take = (level.size() - child) / (nodes - n);
+			const int32_t number = allocatePage();
+			if (number == -1)	return false;
+			PageRef nodeRef(pool, number, false);
+			if (!nodeRef)	return false;
+			InternalPage* node = nodeRef.internal();
+			memset(node, 0, BLOCK_SIZE);
+			node->isLeaf = 0;
+			node->count = static_cast<uint16_t>(take - 1);
+			node->next = -1;
+			for (size_t i = 0; i < take; i++) {
+				node->children[i] = level[child + i].first;
+				if (i > 0)	node->hashes[i - 1] = level[child + i].second;
+			}
+			nodeRef.markDirty();
+			above.emplace_back(number, level[child].second);
+			child += take;
 		}
+		level.swap(above);
+	}
+	root = level.front().first;
+	return flush();
+}
+
+// Follows hash down to its leaf without taking a latch. On Done the leaf is
+// pinned in leaf and version is the one its reads must be validated against.
+// Each child's version is read before its parent is validated again, so a
+// split of the child, which always changes the parent, cannot be missed.
+BPlusTree::Outcome BPlusTree::descend(uint64_t hash, PageRef& leaf, uint64_t& version) {
+	uint64_t rootVersion;
+	if (!readLatch(rootLatch, rootVersion))	return Outcome::Restart;
+	PageRef node(pool, root.load());
+	if (!node)	return Outcome::Failed;
+	if (!readLatch(node.latch(), version) || !validLatch(rootLatch, rootVersion))	return Outcome::Restart;
+
+	while (!node.isLeaf()) {
+		const int32_t child = node.internal()->children[childIndex(node.internal(), hash)];
+		if (!validLatch(node.latch(), version))	return Outcome::Restart;
+		PageRef next(pool, child);
+		if (!next)	return Outcome::Failed;
+		uint64_t nextVersion;
+		if (!readLatch(next.latch(), nextVersion) || !validLatch(node.latch(), version))	return Outcome::Restart;
+		node = std::move(next);
+		version = nextVersion;
 	}
+	leaf = std::move(node);
+	return Outcome::Done;
+}
 
-	mergeLeafNodes(leaf);
+bool BPlusTree::insert(const IndexKey& key, const int metaIndex) {
+	Outcome outcome;
+	while ((outcome = tryInsert(key, metaIndex)) == Outcome::Restart) {}
+	return outcome == Outcome::Done;
 }
-void BPlusTree::mergeLeafNodes(BPlusTreeNode* leaf) {
-	if (!leaf->parent)	return;
-
-	BPlusTreeNode* parent = leaf->parent;
-	int leafIndex = -1;
-	for (int i = 0; i < static_cast<int>(parent->children.size()); i++) {
-		if (parent->children[i] == leaf) {
-			leafIndex = i;
-			break;
+
+// Descends like descend(), keeping the parent pinned. A full internal node is
+// split on the spot, with its parent, and the insert starts over; so when the
+// leaf is reached its parent has room for one more separator.
+BPlusTree::Outcome BPlusTree::tryInsert(const IndexKey& key, int32_t metaIndex) {
+	PageRef parent;
+	std::atomic<uint64_t>* parentLatch = &rootLatch;
+	uint64_t parentVersion;
+	if (!readLatch(rootLatch, parentVersion))	return Outcome::Restart;
+	PageRef node(pool, root.load());
+	if (!node)	return Outcome::Failed;
+	uint64_t version;
+	if (!readLatch(node.latch(), version) || !validLatch(rootLatch, parentVersion))	return Outcome::Restart;
+
+	while (!node.isLeaf()) {
+		InternalPage* internal = node.internal();
+		if (internal->count >= INTERNAL_KEYS) {
+			if (!upgradeLatches(*parentLatch, parentVersion, node.latch(), version))	return Outcome::Restart;
+			const Outcome outcome = splitInternal(parent, node);
+			releaseLatch(node.latch());
+			releaseLatch(*parentLatch);
+			return outcome == Outcome::Failed ? outcome : Outcome::Restart;
 		}
+		const int32_t child = internal->children[childIndex(internal, key.hash)];
+		if (!validLatch(node.latch(), version))	return Outcome::Restart;
+		PageRef next(pool, child);
+		if (!next)	return Outcome::Failed;
+		uint64_t nextVersion;
+		if (!readLatch(next.latch(), nextVersion) || !validLatch(node.latch(), version))	return Outcome::Restart;
+		parent = std::move(node);
+		parentLatch = &parent.latch();
+		parentVersion = version;
+		node = std::move(next);
+		version = nextVersion;
 	}
 
-	if (leafIndex > 0) {
-		BPlusTreeNode* leftSibling = parent->children[leafIndex - 1];
-
-		leftSibling->keys.insert(leftSibling->keys.end(), leaf->keys.begin(), leaf->keys.end());
-		leftSibling->values.insert(leftSibling->values.end(), leaf->values.begin(), leaf->values.end());
-		leftSibling->nextLeaf = leaf->nextLeaf;
-		
-		parent->keys.erase(parent->keys.begin() + leafIndex - 1);
-		parent->children.erase(parent->children.begin() + leafIndex);
-		
-		delete leaf;
-		
-		if (static_cast<int>(parent->keys.size()) < (order + 1) / 2 - 1)	handleInternalUnderflow(parent);
-		
-		return;
+	if (node.leaf()->count < LEAF_KEYS) {
+		if (!upgradeLatch(node.latch(), version))	return Outcome::Restart;
+		insertIntoLeaf(node.leaf(), key, metaIndex);
+		node.markDirty();
+		releaseLatch(node.latch());
+		return Outcome::Done;
 	}
-	if (leafIndex < static_cast<int>(parent->children.size()) - 1) {
-		BPlusTreeNode* rightSibling = parent->children[leafIndex + 1];
-		
-		leaf->keys.insert(leaf->keys.end(), rightSibling->keys.begin(), rightSibling->keys.end());
-		leaf->values.insert(leaf->values.end(), rightSibling->values.begin(), rightSibling->values.end());
-		leaf->nextLeaf = rightSibling->nextLeaf;
-
-		parent->keys.erase(parent->keys.begin() + leafIndex);
-		parent->children.erase(parent->children.begin() + leafIndex + 1);
+	if (!upgradeLatches(*parentLatch, parentVersion, node.latch(), version))	return Outcome::Restart;
+	const Outcome outcome = splitLeaf(parent, node, key, metaIndex);
+	releaseLatch(node.latch());
+	releaseLatch(*parentLatch);
+	return outcome;
+}
 
-		delete leaf;
+// With node and its parent latched: moves the upper half of the full leaf to a
+// new page and adds key to whichever half it belongs in.
+BPlusTree::Outcome BPlusTree::splitLeaf(PageRef& parent, PageRef& node, const IndexKey& key, int32_t metaIndex) {
+	LeafPage* leaf = node.leaf();
+	const int split = splitPoint(leaf);
+	if (split == -1) {
+		std::cerr << "Error: Too many names share one hash.\n";
+		return Outcome::Failed;
+	}
+	// Every page the split needs is taken before anything is changed
+	const int32_t rightNumber = allocatePage();
+	if (rightNumber == -1)	return Outcome::Failed;
+	const int32_t newRoot = parent ? -1 : allocatePage();
+	if (!parent && newRoot == -1)	return Outcome::Failed;
+	PageRef rightRef(pool, rightNumber, false);
+	if (!rightRef)	return Outcome::Failed;
+
+	LeafPage* right = rightRef.leaf();
+	right->isLeaf = 1;
+	right->count = leaf->count - split;
+	right->next = leaf->next;
+	std::copy(leaf->hashes + split, leaf->hashes + leaf->count, right->hashes);
+	std::copy(leaf->slots + split, leaf->slots + leaf->count, right->slots);
+	memcpy(right->names[0], leaf->names[split], static_cast<size_t>(right->count) * FILE_NAME_LENGTH);
+	leaf->count = split;
+	leaf->next = rightNumber;
+
+	const uint64_t separator = right->hashes[0];
+	insertIntoLeaf(key.hash < separator ? leaf : right, key, metaIndex);
+	node.markDirty();
+	rightRef.markDirty();
+	return addSeparator(parent, newRoot, node.pageNumber(), separator, rightNumber) ? Outcome::Done : Outcome::Failed;
+}
 
-		if (static_cast<int>(parent->keys.size()) < (order + 1) / 2 - 1)	handleInternalUnderflow(parent);
+// With node and its parent latched: moves the upper half of the full internal
+// node to a new page and lifts the middle separator into the parent.
+BPlusTree::Outcome BPlusTree::splitInternal(PageRef& parent, PageRef& node) {
+	const int32_t siblingNumber = allocatePage();
+	if (siblingNumber == -1)	return Outcome::Failed;
+	const int32_t newRoot = parent ? -1 : allocatePage();
+	if (!parent && newRoot == -1)	return Outcome::Failed;
+	PageRef siblingRef(pool, siblingNumber, false);
+	if (!siblingRef)	return Outcome::Failed;
+
+	InternalPage* internal = node.internal();
+	InternalPage* sibling = siblingRef.internal();
+	const int mid = internal->count / 2;
+	const uint64_t up = internal->hashes[mid];
+	sibling->isLeaf = 0;
+	sibling->count = internal->count - mid - 1;
+	sibling->next = -1;
+	std::copy(internal->hashes + mid + 1, internal->hashes + internal->count, sibling->hashes);
+	std::copy(internal->children + mid + 1, internal->children + internal->count + 1, sibling->children);
+	internal->count = mid;
+	node.markDirty();
+	siblingRef.markDirty();
+	return addSeparator(parent, newRoot, node.pageNumber(), up, siblingNumber) ? Outcome::Done : Outcome::Failed;
+}
 
-		return;
+// Links right in after left: into the parent, which has room, or with no
+// parent into newRoot, which becomes the root.
+bool BPlusTree::addSeparator(PageRef& parent, int32_t newRoot, int32_t left, uint64_t separator, int32_t right) {
+	if (parent) {
+		insertIntoInternal(parent.internal(), separator, right);
+		parent.markDirty();
+		return true;
 	}
+	PageRef rootRef(pool, newRoot, false);
+	if (!rootRef)	return false;
+	InternalPage* page = rootRef.internal();
+	page->isLeaf = 0;
+	page->count = 1;
+	page->next = -1;
+	page->hashes[0] = separator;
+	page->children[0] = left;
+	page->children[1] = right;
+	rootRef.markDirty();
+	root.store(newRoot);
+	return true;
 }
-void BPlusTree::remove(int key) {
-	BPlusTreeNode* leaf = findLeafNode(key);
-	if (!leaf)	return;
-	int low = 0, high = leaf->keys.size() - 1, mid, index = -1;
-	while (low <= high){
-		mid = (low + high) / 2;
-		if (leaf->keys[mid] == key)	{
-			index = mid;
-			break;
-		}
-		if (leaf->keys[mid] > key)	high = mid - 1;
-		else if (leaf->keys[mid] < key)	low = mid + 1;
-	}
 
-	if (index == -1)	return;
-	leaf->keys.erase(leaf->keys.begin() + index);
-	leaf->values.erase(leaf->values.begin() + index);
+bool BPlusTree::update(const IndexKey& key, int idx) {
+	bool found = false;
+	Outcome outcome;
+	while ((outcome = tryChange(key, LeafChange::Update, idx, found)) == Outcome::Restart) {}
+	return outcome == Outcome::Done && found;
+}
 
-	if (index == 0 && leaf->parent != nullptr) {
-		BPlusTreeNode* parent = leaf->parent;
-		for (int i = 0; i < static_cast<int>(parent->keys.size()); i++){
-			if (parent->children[i] == leaf && i > 0 && !leaf->keys.empty()) {
-				parent->keys[i-1] = leaf->keys[0];
-				break;
-			}
-		}
-	}
+// Leaves are not merged: a key is taken out of its leaf and the separators
+// above still route correctly, even to a leaf left empty.
+bool BPlusTree::remove(const IndexKey& key) {
+	bool found = false;
+	Outcome outcome;
+	while ((outcome = tryChange(key, LeafChange::Remove, -1, found)) == Outcome::Restart) {}
+	return outcome == Outcome::Done && found;
+}
 
-	if (leaf != root && static_cast<int>(leaf->keys.size()) < (order + 1) / 2 - 1) {
-		handleLeafUnderflow(leaf);
+// Changes key in place, latching only its leaf.
+BPlusTree::Outcome BPlusTree::tryChange(const IndexKey& key, LeafChange change, int32_t metaIndex, bool& found) {
+	PageRef leafRef;
+	uint64_t version;
+	const Outcome outcome = descend(key.hash, leafRef, version);
+	if (outcome != Outcome::Done)	return outcome;
+	if (!upgradeLatch(leafRef.latch(), version))	return Outcome::Restart;
+
+	LeafPage* leaf = leafRef.leaf();
+	const int index = lowerBound(leaf, key);
+	found = matches(leaf, index, key);
+	if (found && change == LeafChange::Update) {
+		leaf->slots[index] = metaIndex;
 	}
-
-	if (root->keys.empty() && !root->isLeaf) {
-		root = root->children[0];
-		root->parent = nullptr;
+	else if (found) {
+		std::copy(leaf->hashes + index + 1, leaf->hashes + leaf->count, leaf->hashes + index);
+		std::copy(leaf->slots + index + 1, leaf->slots + leaf->count, leaf->slots + index);
+		memmove(leaf->names[index], leaf->names[index + 1], static_cast<size_t>(leaf->count - index - 1) * FILE_NAME_LENGTH);
+		leaf->count--;
 	}
+	if (found)	leafRef.markDirty();
+	releaseLatch(leafRef.latch());
+	return Outcome::Done;
+}
+
+int BPlusTree::search(const IndexKey& key) {
+	int result = -1;
+	Outcome outcome;
+	while ((outcome = trySearch(key, result)) == Outcome::Restart) {}
+	return outcome == Outcome::Done ? result : -1;
+}
+
+BPlusTree::Outcome BPlusTree::trySearch(const IndexKey& key, int& result) {
+	PageRef leafRef;
+	uint64_t version;
+	const Outcome outcome = descend(key.hash, leafRef, version);
+	if (outcome != Outcome::Done)	return outcome;
+	const LeafPage* leaf = leafRef.leaf();
+	const int index = lowerBound(leaf, key);
+	const int found = matches(leaf, index, key) ? leaf->slots[index] : -1;
+	if (!validLatch(leafRef.latch(), version))	return Outcome::Restart;
+	result = found;
+	return Outcome::Done;
 }
 
 void BPlusTree::printTree() {
-	if (!root) {
+	if (!disk) {
 		std::cout << "Tree is empty.\n";
 		return;
 	}
 
-	std::queue<BPlusTreeNode*> q;
-	q.push(root);
+	std::queue<int32_t> q;
+	q.push(root.load());
+	std::vector<char> copy(BLOCK_SIZE);
 
 	while (!q.empty()) {
 		int levelSize = q.size();
 		for (int i = 0; i < levelSize; i++) {
-			BPlusTreeNode* node = q.front();
+			const int32_t number = q.front();
 			q.pop();
-			if (node->isLeaf) {
-				std::cout << "[Leaf: ";
-				for (int j = 0; j < static_cast<int>(node->keys.size()); j++) std::cout << node->keys[j] << ':' << node->values[j] << ' ';
+			PageRef node(pool, number);
+			if (!node)	return;
+			// Print a copy taken while no writer held the page
+			uint64_t version;
+			do {
+				while (!readLatch(node.latch(), version)) {}
+				memcpy(copy.data(), node.data(), BLOCK_SIZE);
+			} while (!validLatch(node.latch(), version));
+
+			if (reinterpret_cast<const IndexPageHeader*>(copy.data())->isLeaf) {
+				const LeafPage* leaf = reinterpret_cast<const LeafPage*>(copy.data());
+				std::cout << "[Leaf " << number << ": ";
+				for (int j = 0; j < leaf->count; j++) std::cout << leaf->names[j] << ':' << leaf->slots[j] << ' ';
 				std::cout << "]  ";
 			}
 			else {
-				std::cout << "[Internal: ";
-				for (int key : node->keys) std::cout << key << " ";
-				std::cout << "]  ";
-
-				for (BPlusTreeNode* child : node->children) {
-					q.push(child);
+				const InternalPage* internal = reinterpret_cast<const InternalPage*>(copy.data());
+				std::cout << "[Internal " << number << ": " << internal->count << " separators ]  ";
+				for (int j = 0; j <= internal->count; j++) {
+					q.push(internal->children[j]);
 				}
 			}
 		}
 		std::cout << "\n";
 	}
 }
-
-
-int BPlusTree::searchFile(int key) {
-	BPlusTreeNode* leaf = findLeafNode(key);
-	int low = 0, high = leaf->keys.size() - 1, mid;
-	while (low <= high){
-		mid = (low + high) / 2;
-		if (leaf->keys[mid] == key)	return leaf->values[mid];
-		if (leaf->keys[mid] > key)	high = mid - 1;
-		else if (leaf->keys[mid] < key)	low = mid + 1;
-	}
-	return	-1;
-}
-int BPlusTree::searchDir(int key) {
-	BPlusTreeNode* leaf = findLeafNode(key);
-	int low = 0, high = leaf->keys.size() - 1, mid;
-	while (low <= high){
-		mid = (low + high) / 2;
-		if (leaf->keys[mid] == key)	return leaf->values[mid];
-		if (leaf->keys[mid] > key)	high = mid - 1;
-		else if (leaf->keys[mid] < key)	low = mid + 1;
-	}
-	return	-1;
-}
-
-void BPlusTree::deleteTree() {
-	std::queue<BPlusTreeNode*> q;
-	q.push(root);
-
-	while (!q.empty()) {
-		BPlusTreeNode* node = q.front();
-		q.pop();
-
-		if (!node->isLeaf) {
-			for (const auto& other : node->children) {
-				q.push(other);
-			}
-		}
-
-		delete node;
-	}
-}
\ No newline at end of file
@@ -1,21 +1,41 @@
 #include "multithreading.h"
 
-static void openFile(FileEntry* file) {
+// Counts an open only if the entry still holds name and no delete has claimed
+// it; a handle's open is also counted in handleCount. The caller holds metaMutex,
+// so the entry cannot be swapped out and freed meanwhile.
+static bool openFile(FileEntry* file, const std::string& name, int parentIndex, bool handle = false) {
 	std::unique_lock<std::mutex> lock(file->lockMutex);
-
+	if (file->deleting || file->fileName[0] == '\0' || strncmp(file->fileName, name.c_str(), FILE_NAME_LENGTH) != 0 || file->parentIndex != parentIndex || file->isDirectory)	return false;
 	file->openCount++;
+	if (handle)	file->handleCount++;
 	std::cout << "[System] File '" << file->fileName << "' opened. Open count: " << file->openCount << "\n";
+	return true;
 }
 
-static void closeFile(FileEntry* file) {
-	std::unique_lock<std::mutex> lock(file->lockMutex);
+// A deleted entry is freed by its last close, so operations still queued on its
+// lock never touch freed memory.
+static void closeFile(FileEntry* file, bool handle = false) {
+	bool release;
+	{
+		std::unique_lock<std::mutex> lock(file->lockMutex);
 
-	if (file->openCount > 0) {
-		file->openCount--;
-		std::cout << "[System] File '" << file->fileName << "' closed. Open count: " << file->openCount << "\n";
-	} else {
-		std::cerr << "[Warning] File '" << file->fileName << "' is not open.\n";
+		if (file->openCount > 0) {
+			file->openCount--;
+			if (handle)	file->handleCount--;
+			std::cout << "[System] File '" << file->fileName << "' closed. Open count: " << file->openCount << "\n";
+		} else {
+			std::cerr << "[Warning] File '" << file->fileName << "' is not open.\n";
+		}
+		release = file->deleting && file->openCount == 0;
 	}
+	if (release)	delete file;
+}
+
+// True once a delete has claimed the entry. Checked after taking the entry's
+// lock, as a delete may run while an operation waits for it.
+static bool isDeleted(FileEntry* file) {
+	std::unique_lock<std::mutex> lock(file->lockMutex);
+	return file->deleting;
 }
 
 static void acquireReadLock(FileEntry* file) {
@@ -40,11 +60,38 @@ static void releaseReadLock(FileEntry* file) {
 	std::cout << "[Reader] released read lock for file: " << file->fileName << ".\n";
 }
 
+static void acquireWriteLock(FileEntry* file) {
+	std::unique_lock<std::mutex> lock(file->lockMutex);
+		
+	file->writersWaiting++;
+	while (file->readerCount > 0 || file->isWriteLocked) {
+		file->writerCV.wait(lock);
+	}
+
+	file->writersWaiting--;
+	file->isWriteLocked = true;
+	std::cout << "[Writer] acquired write lock for file: " << file->fileName << ".\n";
+}
+
+static void releaseWriteLock(FileEntry* file) {
+	std::unique_lock<std::mutex> lock(file->lockMutex);
+	
+	file->isWriteLocked = false;
+
+	if (file->writersWaiting > 0) {
+		file->writerCV.notify_one();
+	} else {
+		file->readerCV.notify_all();
+	}
+	const char* str = file->fileName[0] == '\0' ? "[DELETED]" : file->fileName;
+	std::cout << "[Writer] released write lock for file: " << str << ".\n";
+}
+
 std::string System::readData(const std::string& fileName, ClientSession* session) {
 	session->msg.clear();
 	session->oss.str("");
 	session->oss.clear();
-	std::fstream disk(DISK_PATH, std::ios::binary | std::ios::out | std::ios::in);
+	BlockDevice& disk = device;
 	if (!disk){
 		std::string msg("Error: Disk not accessible while reading a file.\n");
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -63,8 +110,9 @@ std::string System::readData(const std::string& fileName, ClientSession* session
 	{
 		std::shared_lock<std::shared_mutex> lock(metaMutex);
 		file = metaDataTable[fileIndex];
+		if (file && !openFile(file, searchFile, session->currentDirectory))	file = nullptr;
 	}
-	if (file == nullptr || file->fileName[0] == '\0' || strncmp(file->fileName, searchFile.c_str(), FILE_NAME_LENGTH) != 0 || file->parentIndex != session->currentDirectory || file->isDirectory){
+	if (file == nullptr){
 		session->oss << "Error: Cannot read file '" << fileName << "' (file not found: 2).\n";
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -73,6 +121,7 @@ std::string System::readData(const std::string& fileName, ClientSession* session
 	}
 
 	if (!hasPermission(*file, session->user.user_id, session->user.group_id, PERMISSION_READ)){
+		closeFile(file);
 		session->oss << "Error: Permission denied to read file '" << fileName << "'.\n";
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -80,50 +129,167 @@ std::string System::readData(const std::string& fileName, ClientSession* session
 	}
 	file->accessed_at = static_cast<int>(std::time(nullptr));
 
-	openFile(file);
+	if (pendingBytes(fileIndex) > 0){
+		acquireWriteLock(file);
+		const bool flushed = flushDelayedAppend(fileIndex, file, session);
+		releaseWriteLock(file);
+		if (!flushed){
+			closeFile(file);
+			std::string msg = session->oss.str();
+			session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+			return "";
+		}
+	}
 	acquireReadLock(file);
+	if (isDeleted(file)){
+		releaseReadLock(file);
+		closeFile(file);
+		session->oss << "Error: Cannot read file '" << fileName << "' (file not found).\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return "";
+	}
 	std::string content = readFileData(disk, file, session);
 	releaseReadLock(file);
 	closeFile(file);
 
-	disk.close();
-	session->msg.insert(session->msg.end(), session->oss.str().begin(), session->oss.str().end());
+	std::string msg = session->oss.str();
+	session->msg.insert(session->msg.end(), msg.begin(), msg.end());
 	return content;
 }
 
-static void acquireWriteLock(FileEntry* file) {
-	std::unique_lock<std::mutex> lock(file->lockMutex);
-		
-	file->writersWaiting++;
-	while (file->readerCount > 0 || file->isWriteLocked) {
-		file->writerCV.wait(lock);
+std::string System::readDataAt(const std::string& fileName, int64_t offset, int64_t length, ClientSession* session) {
+	session->msg.clear();
+	session->oss.str("");
+	session->oss.clear();
+	BlockDevice& disk = device;
+	if (!disk){
+		std::string msg("Error: Disk not accessible while reading a file.\n");
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return "";
 	}
+	std::string searchFile = std::to_string(session->user.user_id) + std::to_string(session->currentDirectory) + "F_" + fileName;
+	int fileIndex = Entries->getFile(searchFile);
+	FileEntry* file = nullptr;
+	if (fileIndex != -1) {
+		std::shared_lock<std::shared_mutex> lock(metaMutex);
+		file = metaDataTable[fileIndex];
+		if (file && !openFile(file, searchFile, session->currentDirectory))	file = nullptr;
+	}
+	if (file == nullptr){
+		session->oss << "Error: Cannot read file '" << fileName << "' (file not found).\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return "";
+	}
+	if (!hasPermission(*file, session->user.user_id, session->user.group_id, PERMISSION_READ)){
+		closeFile(file);
+		session->oss << "Error: Permission denied to read file '" << fileName << "'.\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return "";
+	}
+	file->accessed_at = static_cast<int>(std::time(nullptr));
 
-	file->writersWaiting--;
-	file->isWriteLocked = true;
-	std::cout << "[Writer] acquired write lock for file: " << file->fileName << ".\n";
+	if (pendingBytes(fileIndex) > 0){
+		acquireWriteLock(file);
+		const bool flushed = flushDelayedAppend(fileIndex, file, session);
+		releaseWriteLock(file);
+		if (!flushed){
+			closeFile(file);
+			std::string msg = session->oss.str();
+			session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+			return "";
+		}
+	}
+	acquireReadLock(file);
+	if (isDeleted(file)){
+		releaseReadLock(file);
+		closeFile(file);
+		session->oss << "Error: Cannot read file '" << fileName << "' (file not found).\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return "";
+	}
+	std::string content;
+	readFileRange(disk, file, offset, length, content, session);
+	releaseReadLock(file);
+	closeFile(file);
+
+	std::string msg = session->oss.str();
+	session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+	return content;
 }
 
-static void releaseWriteLock(FileEntry* file) {
-	std::unique_lock<std::mutex> lock(file->lockMutex);
-	
-	file->isWriteLocked = false;
+// Like readData, but the content goes to stream as it is read instead of being
+// returned. Lookup errors are reported before stream.start is called.
+bool System::readDataStream(const std::string& fileName, const ReadStream& stream, ClientSession* session) {
+	session->oss.str("");
+	session->oss.clear();
+	BlockDevice& disk = device;
+	if (!disk){
+		std::string msg("Error: Disk not accessible while reading a file.\n");
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
+	std::string searchFile = std::to_string(session->user.user_id) + std::to_string(session->currentDirectory) + "F_" + fileName;
+	int fileIndex = Entries->getFile(searchFile);
+	FileEntry* file = nullptr;
+	if (fileIndex != -1) {
+		std::shared_lock<std::shared_mutex> lock(metaMutex);
+		file = metaDataTable[fileIndex];
+		if (file && !openFile(file, searchFile, session->currentDirectory))	file = nullptr;
+	}
+	if (file == nullptr){
+		session->oss << "Error: Cannot read file '" << fileName << "' (file not found).\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
+	if (!hasPermission(*file, session->user.user_id, session->user.group_id, PERMISSION_READ)){
+		closeFile(file);
+		session->oss << "Error: Permission denied to read file '" << fileName << "'.\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
+	file->accessed_at = static_cast<int>(std::time(nullptr));
 
-	if (file->writersWaiting > 0) {
-		file->writerCV.notify_one();
-	} else {
-		file->readerCV.notify_all();
+	if (pendingBytes(fileIndex) > 0){
+		acquireWriteLock(file);
+		const bool flushed = flushDelayedAppend(fileIndex, file, session);
+		releaseWriteLock(file);
+		if (!flushed){
+			closeFile(file);
+			std::string msg = session->oss.str();
+			session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+			return false;
+		}
 	}
-	const char* str = file->fileName[0] == '\0' ? "[DELETED]" : file->fileName;
-	std::cout << "[Writer] released write lock for file: " << str << ".\n";
+	acquireReadLock(file);
+	if (isDeleted(file)){
+		releaseReadLock(file);
+		closeFile(file);
+		session->oss << "Error: Cannot read file '" << fileName << "' (file not found).\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
+	const bool check = streamFileData(disk, file, stream, session);
+	releaseReadLock(file);
+	closeFile(file);
+
+	std::string msg = session->oss.str();
+	session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+	return check;
 }
 
 bool System::writeData(const std::string &fileName, const std::string &fileContent, bool append, ClientSession* session, const bool check, uint64_t timestamp, FileJournaling* entry) {
 	session->msg.clear();
 	session->oss.str("");
 	session->oss.clear();
-	std::fstream disk(DISK_PATH, std::ios::binary | std::ios::out | std::ios::in);
-	if (!disk.is_open()) {
+	BlockDevice& disk = device;
+	if (!disk.isOpen()) {
 		session->oss << "Error: Disk file is not open for writing.(writing to '" << fileName << "')\n";
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -153,22 +319,33 @@ bool System::writeData(const std::string &fileName, const std::string &fileConte
 	{
 		std::shared_lock<std::shared_mutex> lock(metaMutex);
 		file = metaDataTable[fileIndex];
+		if (file && !openFile(file, searchFile, session->currentDirectory))	file = nullptr;
 	}
-	if (file == nullptr || file->fileName[0] == '\0' || file->parentIndex != session->currentDirectory || file->isDirectory) {
+	if (file == nullptr) {
 		session->oss << "Error: File '" << fileName << "' not found in the directory.\n";
-		session->msg.insert(session->msg.end(), session->oss.str().begin(), session->oss.str().end());
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
 		// std::cerr << "\tError: File '" << fileName << "' not found in the directory.\n";
 		return false;
 	}
 	if (!hasPermission(*file, session->user.user_id, session->user.group_id, PERMISSION_WRITE)){
+		closeFile(file);
 		session->oss << "Error: Write permission denied for the file '" << fileName << "'.\n";
-		session->msg.insert(session->msg.end(), session->oss.str().begin(), session->oss.str().end());
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
 		// std::cerr << "\tError: Write permission denied for the file '" << fileName << "'.\n";
 		return false;
 	}
 
-	openFile(file);
 	acquireWriteLock(file);
+	if (isDeleted(file)){
+		releaseWriteLock(file);
+		closeFile(file);
+		session->oss << "Error: File '" << fileName << "' not found in the directory.\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
 	uint64_t time;
 	if (!check){
 		if (append)
@@ -178,7 +355,91 @@ bool System::writeData(const std::string &fileName, const std::string &fileConte
 	}
 	// std::sleep(10);
 	// std::this_thread::sleep_for(std::chrono::seconds(10));
-	writeFileData(*this, session, disk, file, fileIndex, fileContent, append);
+	if (append && !check){
+		// Delayed allocation: blocks are chosen when the buffer is flushed, and
+		// the journal entry is committed then
+		if (!bufferAppend(fileIndex, file, fileContent, time, session))
+			journalManager->markCommitted(time);
+		else if (pendingBytes(fileIndex) >= DELAYED_APPEND_FLUSH_BYTES)
+			flushDelayedAppend(fileIndex, file, session);
+		else
+			session->oss << "Data buffered for '" << fileName << "'; it reaches the disk when the buffer fills, the file is read or overwritten, or the file system unmounts.\n";
+	}
+	else {
+		flushDelayedAppend(fileIndex, file, session);
+		writeFileData(*this, session, disk, file, fileIndex, fileContent, append, 0);
+		if (!check)
+			journalManager->markCommitted(time);
+		else {
+			session->currentDirectory = 0;
+			journalManager->markCommitted(timestamp);
+		}
+	}
+	releaseWriteLock(file);
+	closeFile(file);
+
+	if (session->oss.str() != "")	{
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+	}
+	return true;
+}
+
+bool System::writeDataAt(const std::string &fileName, int64_t offset, const std::string &fileContent, ClientSession* session, const bool check, uint64_t timestamp, FileJournaling* entry) {
+	session->msg.clear();
+	session->oss.str("");
+	session->oss.clear();
+	BlockDevice& disk = device;
+	if (!disk.isOpen()) {
+		session->oss << "Error: Disk file is not open for writing.(writing to '" << fileName << "')\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
+	if (fileContent.empty() || offset < 0) {
+		session->oss << "Error: No data or invalid offset provided to write for file '" << fileName << "'.\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
+
+	if (entry)	session->currentDirectory = entry->directory;
+	
+	std::string searchFile = std::to_string(session->user.user_id) + std::to_string(session->currentDirectory) + "F_" + fileName;
+	int fileIndex = Entries->getFile(searchFile);
+	FileEntry* file = nullptr;
+	if (fileIndex != -1) {
+		std::shared_lock<std::shared_mutex> lock(metaMutex);
+		file = metaDataTable[fileIndex];
+		if (file && !openFile(file, searchFile, session->currentDirectory))	file = nullptr;
+	}
+	if (file == nullptr) {
+		session->oss << "Error: File '" << fileName << "' not found in the directory.\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
+	if (!hasPermission(*file, session->user.user_id, session->user.group_id, PERMISSION_WRITE)){
+		closeFile(file);
+		session->oss << "Error: Write permission denied for the file '" << fileName << "'.\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
+
+	acquireWriteLock(file);
+	if (isDeleted(file)){
+		releaseWriteLock(file);
+		closeFile(file);
+		session->oss << "Error: File '" << fileName << "' not found in the directory.\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
+	uint64_t time = 0;
+	if (!check)	time = journalManager->logOperation(std::string(session->user.userName), OP_WRITE_AT, searchFile, "", fileContent, file->fileSize, session->currentDirectory, offset);
+	flushDelayedAppend(fileIndex, file, session);
+	writeFileRange(*this, session, disk, file, fileIndex, offset, fileContent);
 	if (!check)
 		journalManager->markCommitted(time);
 	else {
@@ -187,8 +448,7 @@ bool System::writeData(const std::string &fileName, const std::string &fileConte
 	}
 	releaseWriteLock(file);
 	closeFile(file);
-	
-	disk.close();
+
 	if (session->oss.str() != "")	{
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -201,7 +461,7 @@ bool System::deleteDataFile(const std::string& fileName, ClientSession* session,
 	session->oss.str("");
 	session->oss.clear();
 	
-	std::fstream disk(DISK_PATH, std::ios::binary | std::ios::out | std::ios::in);
+	BlockDevice& disk = device;
 	
 	int currentIndex = session->currentDirectory;
 	std::string path(fileName);
@@ -224,8 +484,9 @@ bool System::deleteDataFile(const std::string& fileName, ClientSession* session,
 	{
 		std::shared_lock<std::shared_mutex> lock(metaMutex);
 		file = metaDataTable[fileInd];
+		if (file && !openFile(file, searchFile, currentIndex))	file = nullptr;
 	}
-	if (!file || file->parentIndex != currentIndex) {
+	if (!file) {
 		session->oss << "Error: Cannot delete file '" << fileName << "' (file not found).\n";
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -234,6 +495,7 @@ bool System::deleteDataFile(const std::string& fileName, ClientSession* session,
 	}
 
 	if (file->attributes & ATTRIBUTES_SYSTEM){
+		closeFile(file);
 		session->oss << "Error: Cannot delete file, permission denied(system critical file).\n";
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -241,17 +503,44 @@ bool System::deleteDataFile(const std::string& fileName, ClientSession* session,
 		return false;
 	}
 	if (!hasPermission(*file, session->user.user_id, session->user.group_id, PERMISSION_WRITE)){
+		closeFile(file);
 		session->oss << "Error: Cannot delete file, permission denied.\n";
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
 		// std::cerr << "\tError: Cannot delete file, permission denied.\n";
 		return false;
 	}
-
 	acquireWriteLock(file);
+	// Only handles keep a file from being deleted; operations in flight find it
+	// gone once they take its lock. Checked under the write lock, and the entry
+	// claimed in the same step, so openHandle cannot open it in between.
+	bool gone, isOpen;
+	{
+		std::unique_lock<std::mutex> lock(file->lockMutex);
+		gone = file->deleting;
+		isOpen = !gone && file->handleCount > 0 && !check;
+		if (!gone && !isOpen)	file->deleting = true;
+	}
+	if (gone){
+		releaseWriteLock(file);
+		closeFile(file);
+		session->oss << "Error: Cannot delete file '" << fileName << "' (file not found).\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
+	if (isOpen){
+		releaseWriteLock(file);
+		closeFile(file);
+		session->oss << "Error: Cannot delete file '" << newFileName << "' while it is open.\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
 	uint64_t time;
 	if (!check)
 		time = journalManager->logOperation(std::string(session->user.userName), OP_DELETE_FILE, searchFile, "", "", file->fileSize, currentIndex);
+	discardDelayedAppend(fileInd);
 	deleteFile(*this, session, disk, file, fileInd);
 	if (!check)
 		journalManager->markCommitted(time);
@@ -260,9 +549,8 @@ bool System::deleteDataFile(const std::string& fileName, ClientSession* session,
 	}
 	file->fileName[0] = '\0';
 	releaseWriteLock(file);
-	delete file;
-	
-	disk.close();
+	closeFile(file);
+
 	if (session->oss.str() != "") {
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -345,7 +633,7 @@ bool System::deleteDataDir(const std::string& fileName, ClientSession* session,
 	uint64_t time;
 	if (!check)
 		time = journalManager->logOperation(std::string(session->user.userName), OP_DELETE_DIR, searchFile, "", "", file->fileSize, currentIndex);
-	std::fstream disk(DISK_PATH, std::ios::binary | std::ios::out | std::ios::in);
+	BlockDevice& disk = device;
 	deleteFile(*this, session, disk, file, fileInd);
 	if (!check)
 		journalManager->markCommitted(time);
@@ -363,12 +651,12 @@ bool System::deleteDataDir(const std::string& fileName, ClientSession* session,
 	return true;
 }
 
-bool System::createFiles(const std::string& fileName, ClientSession* session, const int &fileSize, uint16_t permissions, const bool check, uint64_t timestamp, FileJournaling* entry) {
+bool System::createFiles(const std::string& fileName, ClientSession* session, const int64_t &fileSize, uint16_t permissions, const bool check, uint64_t timestamp, FileJournaling* entry) {
 	std::unique_lock<std::shared_mutex> lock(metaIndexMutex);
 	session->msg.clear();
 	session->oss.str("");
 	session->oss.clear();
-	std::fstream disk(DISK_PATH, std::ios::binary | std::ios::out | std::ios::in);
+	BlockDevice& disk = device;
 	if (!disk) {
 		session->oss << "Error: Cannot access disk for creating file '" << fileName  << "'.\n";
 		if (session->oss.str() != "") {
@@ -378,15 +666,15 @@ bool System::createFiles(const std::string& fileName, ClientSession* session, co
 		// std::cerr << "\tError: Cannot access disk for creating file '" << fileName  << "'.\n";
 		return false;
 	}
-	if (metaIndex >= MAX_FILES) {
+	if (metaIndex >= superblock.maxFiles) {
 		session->oss << "Error: File entry full.\n";
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
 		// std::cerr << "\tError: File entry full.\n";
 		return false;
 	}
-	int requiredBlocks = (fileSize + BLOCK_SIZE - 1)/BLOCK_SIZE;
-	if (superblock.freeBlocks < requiredBlocks){
+	int64_t requiredBlocks = (fileSize <= superblock.inlineDataCapacity()) ? 0 : (fileSize + BLOCK_SIZE - 1)/BLOCK_SIZE;
+	if (availableBlocks() < requiredBlocks){
 		session->oss << "Error: Not enough free blocks to create new file.\n";
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -407,7 +695,7 @@ bool System::createFiles(const std::string& fileName, ClientSession* session, co
 	
 	bool validParent = (currentIndex == 0);
 	if (!validParent){
-		if (currentIndex < 0 || currentIndex >= MAX_FILES){
+		if (currentIndex < 0 || currentIndex >= superblock.maxFiles){
 			session->oss << "Error: Parent index invalid.\n";
 			std::string msg = session->oss.str();
 			session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -444,8 +732,7 @@ bool System::createFiles(const std::string& fileName, ClientSession* session, co
 		journalManager->markCommitted(timestamp);
 	}
 	releaseWriteLock(newFile);
-	
-	disk.close();
+
 	if (session->oss.str() != "") {
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -473,8 +760,9 @@ bool System::renameFiles(const std::string &fileName, const std::string &newName
 	{
 		std::shared_lock<std::shared_mutex> lock(metaMutex);
 		file = metaDataTable[fileIndex];
+		if (file && !openFile(file, searchFile, session->currentDirectory))	file = nullptr;
 	}
-	if (file == nullptr || file->fileName[0] == '\0' || file->parentIndex != session->currentDirectory) {
+	if (file == nullptr) {
 		session->oss << "Error: File '" << fileName << "' not found in the directory.\n";
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -482,6 +770,7 @@ bool System::renameFiles(const std::string &fileName, const std::string &newName
 		return false;
 	}
 	if (!hasPermission(*file, session->user.user_id, session->user.group_id, PERMISSION_WRITE)){
+		closeFile(file);
 		session->oss << "Error: Write permission denied for the file '" << fileName << "'.\n";
 		std::string msg = session->oss.str();
 		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -496,6 +785,7 @@ bool System::renameFiles(const std::string &fileName, const std::string &newName
 			if (fileNameT != ""){
 				fileNameT = fileNameT.substr(static_cast<int>(std::to_string(fileT->owner_id).length() + std::to_string(fileT->parentIndex).length()) + 2);
 				if (fileT->parentIndex == file->parentIndex && fileNameT == newName) {
+					closeFile(file);
 					session->oss << "Error: File with same name already exists.\n";
 					std::string msg = session->oss.str();
 					session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -506,8 +796,15 @@ bool System::renameFiles(const std::string &fileName, const std::string &newName
 		}
 	}
 	
-	openFile(file);
 	acquireWriteLock(file);
+	if (isDeleted(file)){
+		releaseWriteLock(file);
+		closeFile(file);
+		session->oss << "Error: File '" << fileName << "' not found in the directory.\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
 	uint64_t time;
 	if (!check){
 		time = journalManager->logOperation(std::string(session->user.userName), OP_RENAME, searchFile, newName, "", file->fileSize, session->currentDirectory);
@@ -547,7 +844,7 @@ void System::list(ClientSession* session) {
 		for (const auto& entry : metaDataTable) {
 			if (entry->parentIndex == session->currentDirectory && strlen(entry->fileName) > 0 && entry->owner_id == session->user.user_id) {
 				std::string name(entry->fileName);
-				session->oss << name.erase(0, 2 + static_cast<int>(std::to_string(session->currentDirectory).length() + std::to_string(session->user.user_id).length())) << "\t" << entry->fileSize << " bytes\n";
+				session->oss << name.erase(0, 2 + static_cast<int>(std::to_string(session->currentDirectory).length() + std::to_string(session->user.user_id).length())) << "\t" << entry->fileSize + pendingBytes(entry) << " bytes\n";
 				found = true;
 			}
 		}
@@ -571,20 +868,7 @@ void System::fileMetadata(const std::string& filename, ClientSession* session) {
 
     for (const auto& entry : metaDataTable) {
         if (entry->parentIndex == session->currentDirectory && fullName == entry->fileName) {
-			time_t createdTime = static_cast<time_t>(entry->created_at);
-			std::tm* createdTimeInfo = std::localtime(&createdTime);
-			time_t modifiedTime = static_cast<time_t>(entry->modified_at);
-			std::tm* modifiedTimeInfo = std::localtime(&modifiedTime);
-			std::string name(entry->fileName);
-			int pos = static_cast<int>(std::to_string(session->user.user_id).length() + std::to_string(session->currentDirectory).length()) + 2;
-            session->oss << "Filename     : " << name.substr(pos) << "\n";
-            session->oss << "Size         : " << entry->fileSize << " bytes\n";
-            session->oss << "Created At   : " << std::asctime(createdTimeInfo);
-            session->oss << "Modified At  : " << std::asctime(modifiedTimeInfo);
-            session->oss << "Permissions  : " << permissionToString(entry) << "\n";
-            session->oss << "Attributes   : " << std::oct << entry->attributes << std::dec << "\n";
-            session->oss << "Ownder ID    : " << entry->owner_id << "\n";
-            session->oss << "Group ID     : " << entry->group_id << "\n";
+			describeFile(entry, session);
 			
 			std::string msg = session->oss.str();
 			session->msg.insert(session->msg.end(), msg.begin(), msg.end());
@@ -598,6 +882,25 @@ void System::fileMetadata(const std::string& filename, ClientSession* session) {
 	session->msg.insert(session->msg.end(), msg.begin(), msg.end());
 }
 
+// Writes the stat block for entry to session->oss. The caller holds metaMutex.
+void System::describeFile(FileEntry* entry, ClientSession* session) {
+	time_t createdTime = static_cast<time_t>(entry->created_at);
+	std::tm* createdTimeInfo = std::localtime(&createdTime);
+	time_t modifiedTime = static_cast<time_t>(entry->modified_at);
+	std::tm* modifiedTimeInfo = std::localtime(&modifiedTime);
+	std::string name(entry->fileName);
+	// Stored names are "<uid><dir>F_<name>"; skip the digits and the type tag
+	size_t pos = std::min(name.find_first_not_of("0123456789") + 2, name.size());
+	session->oss << "Filename     : " << name.substr(pos) << "\n";
+	session->oss << "Size         : " << entry->fileSize + pendingBytes(entry) << " bytes\n";
+	session->oss << "Created At   : " << std::asctime(createdTimeInfo);
+	session->oss << "Modified At  : " << std::asctime(modifiedTimeInfo);
+	session->oss << "Permissions  : " << permissionToString(entry) << "\n";
+	session->oss << "Attributes   : " << std::oct << entry->attributes << std::dec << "\n";
+	session->oss << "Ownder ID    : " << entry->owner_id << "\n";
+	session->oss << "Group ID     : " << entry->group_id << "\n";
+}
+
 bool System::recursiveDelete(const std::string& fileName, ClientSession* session) {
 	session->msg.clear();
 	session->oss.str("");
@@ -664,4 +967,156 @@ bool System::recursiveDelete(const std::string& fileName, ClientSession* session
 	deleteDataDir(fileName, session);
 
 	return true;
-}
\ No newline at end of file
+}
+int System::openHandle(const std::string& fileName, ClientSession* session) {
+	session->oss.str("");
+	session->oss.clear();
+	std::string searchFile = std::to_string(session->user.user_id) + std::to_string(session->currentDirectory) + "F_" + fileName;
+	int fileIndex = Entries->getFile(searchFile);
+	FileEntry* file = nullptr;
+	if (fileIndex != -1) {
+		std::shared_lock<std::shared_mutex> lock(metaMutex);
+		file = metaDataTable[fileIndex];
+		if (file && !openFile(file, searchFile, session->currentDirectory, true))	file = nullptr;
+	}
+	if (file == nullptr){
+		session->oss << "Error: Cannot open file '" << fileName << "' (file not found).\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return -1;
+	}
+
+	FileHandle handle;
+	handle.file = file;
+	handle.fileIndex = fileIndex;
+	handle.canRead = hasPermission(*file, session->user.user_id, session->user.group_id, PERMISSION_READ);
+	handle.canWrite = hasPermission(*file, session->user.user_id, session->user.group_id, PERMISSION_WRITE);
+	if (!handle.canRead && !handle.canWrite){
+		closeFile(file, true);
+		session->oss << "Error: Permission denied to open file '" << fileName << "'.\n";
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return -1;
+	}
+
+	int id = session->nextHandle++;
+	session->handles.emplace(id, handle);
+	return id;
+}
+
+bool System::closeHandle(int handle, ClientSession* session) {
+	auto it = session->handles.find(handle);
+	if (it == session->handles.end()) {
+		std::string msg = "Error: Invalid file handle " + std::to_string(handle) + ".\n";
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
+	closeFile(it->second.file, true);
+	session->handles.erase(it);
+	return true;
+}
+
+// Called when a client disconnects.
+void System::closeAllHandles(ClientSession* session) {
+	for (auto& [id, handle] : session->handles) {
+		closeFile(handle.file, true);
+	}
+	session->handles.clear();
+}
+
+// Resolves a handle without any name lookup. Files open through a handle cannot
+// be deleted, so the entry only changes under the handle if a failed write
+// rolled it back.
+FileHandle* System::findHandle(int handle, ClientSession* session) {
+	auto it = session->handles.find(handle);
+	if (it == session->handles.end()) {
+		std::string msg = "Error: Invalid file handle " + std::to_string(handle) + ".\n";
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return nullptr;
+	}
+	{
+		std::shared_lock<std::shared_mutex> lock(metaMutex);
+		if (metaDataTable[it->second.fileIndex] == it->second.file)	return &it->second;
+	}
+	std::string msg = "Error: File handle " + std::to_string(handle) + " is stale; close and reopen the file.\n";
+	session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+	return nullptr;
+}
+
+std::string System::readHandle(int handle, int64_t offset, int64_t length, ClientSession* session) {
+	session->oss.str("");
+	session->oss.clear();
+	FileHandle* entry = findHandle(handle, session);
+	if (!entry)	return "";
+	if (!entry->canRead){
+		std::string msg = "Error: File handle " + std::to_string(handle) + " was not opened for reading.\n";
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return "";
+	}
+	FileEntry* file = entry->file;
+	file->accessed_at = static_cast<int>(std::time(nullptr));
+
+	if (pendingBytes(entry->fileIndex) > 0){
+		acquireWriteLock(file);
+		const bool flushed = flushDelayedAppend(entry->fileIndex, file, session);
+		releaseWriteLock(file);
+		if (!flushed){
+			std::string msg = session->oss.str();
+			session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+			return "";
+		}
+	}
+	acquireReadLock(file);
+	std::string content;
+	readFileRange(device, file, offset, length, content, session);
+	releaseReadLock(file);
+
+	std::string msg = session->oss.str();
+	session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+	return content;
+}
+
+bool System::writeHandle(int handle, int64_t offset, const std::string& data, ClientSession* session) {
+	session->oss.str("");
+	session->oss.clear();
+	FileHandle* entry = findHandle(handle, session);
+	if (!entry)	return false;
+	if (!entry->canWrite){
+		std::string msg = "Error: File handle " + std::to_string(handle) + " was not opened for writing.\n";
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
+	if (data.empty() || offset < 0) {
+		std::string msg = "Error: No data or invalid offset provided to write through handle " + std::to_string(handle) + ".\n";
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+		return false;
+	}
+	FileEntry* file = entry->file;
+
+	acquireWriteLock(file);
+	// Journalled as a plain WRITEAT, so replay does not need the handle
+	uint64_t time = journalManager->logOperation(std::string(session->user.userName), OP_WRITE_AT, std::string(file->fileName), "", data, file->fileSize, file->parentIndex, offset);
+	flushDelayedAppend(entry->fileIndex, file, session);
+	writeFileRange(*this, session, device, file, entry->fileIndex, offset, data);
+	journalManager->markCommitted(time);
+	releaseWriteLock(file);
+
+	if (session->oss.str() != "")	{
+		std::string msg = session->oss.str();
+		session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+	}
+	return true;
+}
+
+void System::statHandle(int handle, ClientSession* session) {
+	session->oss.str("");
+	session->oss.clear();
+	FileHandle* entry = findHandle(handle, session);
+	if (!entry)	return;
+	{
+		std::shared_lock<std::shared_mutex> lock(metaMutex);
+		describeFile(entry->file, session);
+	}
+	std::string msg = session->oss.str();
+	session->msg.insert(session->msg.end(), msg.begin(), msg.end());
+}
@@ -0,0 +1,98 @@
+#include "nodePool.h"
+#include "blockDevice.h"
+
+#include <algorithm>
+
+NodePool::NodePool(size_t capacity) : frameCount(std::max<size_t>(capacity, 1)), frames(new Frame[frameCount]) {
+	freeFrames.reserve(frameCount);
+	for (size_t i = frameCount; i > 0; i--)	freeFrames.push_back(i - 1);
+}
+
+// Pages are numbered from the start of the region.
+void NodePool::attach(BlockDevice& device, int64_t firstBlock) {
+	std::unique_lock<std::mutex> guard(lock);
+	this->device = &device;
+	this->firstBlock = firstBlock;
+}
+
+// Caller holds lock.
+bool NodePool::writeBack(Frame& frame) {
+	if (!device->writeBlocks(firstBlock + frame.page, 1, frame.data))	return false;
+	frame.dirty = false;
+	return true;
+}
+
+// Caller holds lock.
+bool NodePool::evict() {
+	if (lru.empty())	return false;
+	const size_t victim = lru.back();
+	Frame& frame = frames[victim];
+	if (frame.dirty && !writeBack(frame))	return false;
+	lru.pop_back();
+	pageTable.erase(frame.page);
+	frame.page = -1;
+	freeFrames.push_back(victim);
+	return true;
+}
+
+// Returns the page's frame, pinned until unpin(). With load == false the page
+// is about to be fully overwritten, so a miss does not read it from the image.
+// The data is null on a read error, or when every frame is pinned.
+PinnedPage NodePool::pin(int64_t page, bool load) {
+	std::unique_lock<std::mutex> guard(lock);
+	auto it = pageTable.find(page);
+	if (it != pageTable.end()) {
+		Frame& frame = frames[it->second];
+		if (frame.pins++ == 0)	lru.erase(frame.lruPosition);
+		return {frame.data, &frame.latch};
+	}
+
+	if (freeFrames.empty() && !evict()) {
+		std::cerr << "Error: Every metadata index frame is in use.\n";
+		return {};
+	}
+	const size_t index = freeFrames.back();
+	Frame& frame = frames[index];
+	if (load && !device->readBlocks(firstBlock + page, 1, frame.data))	return {};
+	freeFrames.pop_back();
+	frame.page = page;
+	frame.dirty = false;
+	frame.pins = 1;
+	pageTable[page] = index;
+	return {frame.data, &frame.latch};
+}
+
+void NodePool::unpin(int64_t page, bool dirty) {
+	std::unique_lock<std::mutex> guard(lock);
+	auto it = pageTable.find(page);
+	if (it == pageTable.end())	return;
+	Frame& frame = frames[it->second];
+	frame.dirty = frame.dirty || dirty;
+	if (--frame.pins == 0) {
+		lru.push_front(it->second);
+		frame.lruPosition = lru.begin();
+	}
+}
+
+bool NodePool::flush() {
+	std::unique_lock<std::mutex> guard(lock);
+	bool ok = true;
+	for (size_t i = 0; i < frameCount; i++) {
+		if (frames[i].page != -1 && frames[i].dirty && !writeBack(frames[i]))	ok = false;
+	}
+	return ok;
+}
+
+// Forgets every page without writing it back; nothing may be pinned.
+void NodePool::clear() {
+	std::unique_lock<std::mutex> guard(lock);
+	pageTable.clear();
+	lru.clear();
+	freeFrames.clear();
+	for (size_t i = frameCount; i > 0; i--) {
+		frames[i - 1].page = -1;
+		frames[i - 1].dirty = false;
+		frames[i - 1].pins = 0;
+		freeFrames.push_back(i - 1);
+	}
+}
@@ -1,7 +1,15 @@
 #include "rollback.h"
 
-void System::rollbackMetadataIndex(std::fstream &disk, Superblock &originalSuperblock, int orgIndex, std::vector<int> &newlyAllocatedBlocks){
-	disk.clear();
+// Other threads allocate and free blocks meanwhile, so freeBlocks is not
+// restored from a copy: only this operation's blocks are given back. With
+// blocksCounted they were already taken off freeBlocks; any that cannot be
+// freed stay counted as used either way.
+void System::releaseRolledBackBlocks(bool blocksCounted, std::vector<int64_t> &newlyAllocatedBlocks){
+	const int64_t released = freeBitMapBlocks(newlyAllocatedBlocks);
+	adjustFreeBlocks(blocksCounted ? released : released - static_cast<int64_t>(newlyAllocatedBlocks.size()));
+}
+
+void System::rollbackMetadataIndex(BlockDevice &disk, bool blocksCounted, int orgIndex, std::vector<int64_t> &newlyAllocatedBlocks){
 	// std::cout << "\tBefore: \n";
 	std::cout << superblock.freeBlocks << '\n';
 	// if (orgIndex != -1)	std::cout << metaDataTable[orgIndex]->fileName << '\n';
@@ -9,15 +17,14 @@ void System::rollbackMetadataIndex(std::fstream &disk, Superblock &originalSuper
 		std::unique_lock<std::shared_mutex> lock(metaMutex);
 		if (orgIndex != -1)	metaDataTable[orgIndex] = new FileEntry();
 	}
-	superblock = originalSuperblock;
+	releaseRolledBackBlocks(blocksCounted, newlyAllocatedBlocks);
 	std::cout << superblock.freeBlocks << '\n';
 	// if (orgIndex != -1)	std::cout << metaDataTable[orgIndex]->fileName << '\n';
-	freeBitMapBlocks(disk, newlyAllocatedBlocks);
+	flushBitMap(disk);
 	// std::cout << "\t\tRollback completed successfully. File system state restored.\n";
 }
 
-void System::rollbackMetadataOrg(std::fstream &disk, Superblock &originalSuperblock, FileEntry* orgFileEntry, int orgIndex, std::vector<int> &newlyAllocatedBlocks){
-	disk.clear();
+void System::rollbackMetadataOrg(BlockDevice &disk, bool blocksCounted, FileEntry* orgFileEntry, int orgIndex, std::vector<int64_t> &newlyAllocatedBlocks){
 	// std::cout << "\tBefore: \n";
 	std::cout << superblock.freeBlocks << '\n';
 	// if (orgIndex != -1)	std::cout << metaDataTable[orgIndex]->fileName << '\n';
@@ -29,10 +36,10 @@ void System::rollbackMetadataOrg(std::fstream &disk, Superblock &originalSuperbl
 		if (entryToDelete)	delete entryToDelete;
 	}
 	
-	superblock = originalSuperblock;
+	releaseRolledBackBlocks(blocksCounted, newlyAllocatedBlocks);
 	
 	std::cout << superblock.freeBlocks << '\n';
 	// if (orgIndex != -1)	std::cout << metaDataTable[orgIndex]->fileName << '\n';
-	freeBitMapBlocks(disk, newlyAllocatedBlocks);
+	flushBitMap(disk);
 	// std::cout << "\t\tRollback completed successfully. File system state restored.\n";
 }
@@ -1,5 +1,63 @@
 #include "structs.h"
 
+#include <algorithm>
+#include <cstddef>
+
+// Each root directory block holds order - 1 entries.
+int Superblock::maxOrder() {
+	return BLOCK_SIZE / static_cast<int>(sizeof(SerializableFileEntry)) + 1;
+}
+
+// The entries split the block evenly; the room an entry does not use holds
+// the data of a file small enough to live inline.
+size_t Superblock::dirSlotSize() const {
+	return (BLOCK_SIZE / entriesPerDirBlock()) & ~static_cast<size_t>(7);
+}
+
+int64_t Superblock::inlineDataCapacity() const {
+	return static_cast<int64_t>(dirSlotSize() - offsetof(SerializableFileEntry, extents));
+}
+
+// Lays the regions out back to back: superblock, bitmap, B+ tree, root
+// directory, data. The bitmap is sized for maxDiskSize so the image can grow
+// online without moving the regions after it.
+bool Superblock::layout(const FormatOptions& options, std::string& error) {
+	if (options.order < 3 || options.order > maxOrder()) {
+		error = "B+ tree order must be between 3 and " + std::to_string(maxOrder()) + ".";
+		return false;
+	}
+	if (options.maxFiles < 1) {
+		error = "Maximum file count must be positive.";
+		return false;
+	}
+	const int64_t requestedBlocks = static_cast<int64_t>(options.diskSize / BLOCK_SIZE);
+	const uint64_t maxDiskSize = options.maxDiskSize ? options.maxDiskSize : options.diskSize * DEFAULT_GROWTH_FACTOR;
+	const int64_t bitsPerBlock = static_cast<int64_t>(BLOCK_SIZE) * 8;
+	const int64_t reserved = std::max(static_cast<int64_t>(maxDiskSize / BLOCK_SIZE), requestedBlocks);
+
+	magic = SUPERBLOCK_MAGIC;
+	version = SUPERBLOCK_VERSION;
+	blockSize = BLOCK_SIZE;
+	totalBlocks = requestedBlocks;
+	maxFiles = options.maxFiles;
+	order = options.order;
+	bitmapStart = SUPER_BLOCK_START + SUPER_BLOCKS;
+	bitmapBlocks = (reserved + bitsPerBlock - 1) / bitsPerBlock;
+	maxBlocks = bitmapBlocks * bitsPerBlock;
+	const int leafNodes = (maxFiles + order - 2) / (order - 1);
+	bplusTreeStart = bitmapStart + bitmapBlocks;
+	bplusTreeBlocks = leafNodes + pr::computeInternalNodes(leafNodes, order);
+	rootDirStart = bplusTreeStart + bplusTreeBlocks;
+	rootDirBlocks = (maxFiles + order - 1) / (order - 1);
+	dataStart = rootDirStart + rootDirBlocks;
+	if (dataStart >= totalBlocks) {
+		error = "Disk size is too small for " + std::to_string(maxFiles) + " files.";
+		return false;
+	}
+	freeBlocks = totalBlocks - dataStart;
+	return true;
+}
+
 SerializableFileEntry::SerializableFileEntry(const FileEntry& file) {
 	std::memcpy(fileName, file.fileName, FILE_NAME_LENGTH);
 	size = file.fileSize;
@@ -10,16 +68,18 @@ SerializableFileEntry::SerializableFileEntry(const FileEntry& file) {
 	group_id = file.group_id;
 	permissions = file.permissions;
 	attributes = file.attributes;
-	extentCount = file.numExtents;
+	extentDepth = file.hasInlineData ? EXTENT_DEPTH_INLINE : file.extentDepth;
+	extentCount = file.hasInlineData ? 0 : file.rootCount;
 	isDirectory = file.isDirectory;
 	parentIndex = file.parentIndex;
 	dirID = file.dirID;	
-	std::memcpy(extents, file.extents, sizeof(extents));
+	std::copy(file.extentRoot, file.extentRoot + INLINE_EXTENTS, extents);
 }
 
+// A tree deeper than the root is read by System::loadExtentTree, inline data
+// by System::loadDirectoryTable.
 FileEntry::FileEntry(const SerializableFileEntry& file) : fileSize(file.size) {
 	strncpy(fileName, file.fileName, FILE_NAME_LENGTH);
-	numExtents = file.extentCount;
 	isDirectory = file.isDirectory;
 	parentIndex = file.parentIndex;
 	dirID = file.dirID;
@@ -30,5 +90,102 @@ FileEntry::FileEntry(const SerializableFileEntry& file) : fileSize(file.size) {
 	group_id = file.group_id;
 	permissions = file.permissions;
 	attributes = file.attributes;
-	std::memcpy(extents, file.extents, sizeof(extents));
+	if (file.extentDepth == EXTENT_DEPTH_INLINE){
+		hasInlineData = true;
+		return;
+	}
+	extentDepth = file.extentDepth;
+	rootCount = std::min(std::max(file.extentCount, 0), INLINE_EXTENTS);
+	std::copy(file.extents, file.extents + INLINE_EXTENTS, extentRoot);
+	if (extentDepth == 0)	setExtents(std::vector<Extent>(extentRoot, extentRoot + rootCount));
+}
+
+FileEntry::FileEntry(const SerializableFileEntryV1& file) : fileSize(file.size) {
+	strncpy(fileName, file.fileName, FILE_NAME_LENGTH);
+	isDirectory = file.isDirectory;
+	parentIndex = file.parentIndex;
+	dirID = file.dirID;
+	created_at = file.created_at;
+	modified_at = file.modified_at;
+	accessed_at = file.accessed_at;
+	owner_id = file.owner_id;
+	group_id = file.group_id;
+	permissions = file.permissions;
+	attributes = file.attributes;
+	rootCount = std::min(std::max(file.extentCount, 0), INLINE_EXTENTS);
+	for (int i = 0; i < rootCount; i++)	extentRoot[i] = Extent(file.extents[i].startBlock, file.extents[i].length);
+	setExtents(std::vector<Extent>(extentRoot, extentRoot + rootCount));
+}
+
+// Binary search over the extents' first file blocks. fileBlock must be
+// below blockCount().
+size_t FileEntry::findExtent(int64_t fileBlock) const {
+	return std::upper_bound(extentStarts.begin(), extentStarts.end(), fileBlock) - extentStarts.begin() - 1;
+}
+
+// -1 past the end.
+int64_t FileEntry::physicalBlock(int64_t fileBlock) const {
+	if (fileBlock < 0 || fileBlock >= blockCount())	return -1;
+	const size_t i = findExtent(fileBlock);
+	return extents[i].startBlock + (fileBlock - extentStarts[i]);
+}
+
+// Takes the extents as stored in the extent tree.
+void FileEntry::setExtents(std::vector<Extent> newExtents) {
+	extents = std::move(newExtents);
+	extentStarts.resize(extents.size());
+	int64_t start = 0;
+	for (size_t i = 0; i < extents.size(); i++) {
+		extentStarts[i] = start;
+		start += extents[i].length;
+	}
+	storedExtents = dirtyExtent = numExtents();
+}
+
+// Appends blocks (in file order) to the end of the file, extending the last
+// extent while they stay contiguous with it.
+void FileEntry::addBlocks(const std::vector<int64_t>& blocks) {
+	if (!blocks.empty())	dirtyExtent = std::min(dirtyExtent, std::max(numExtents() - 1, 0));
+	for (const int64_t block : blocks) {
+		if (!extents.empty() && block == lastBlock() + 1) {
+			extents.back().length++;
+			continue;
+		}
+		const int64_t start = blockCount();
+		extents.emplace_back(block, 1);
+		extentStarts.push_back(start);
+	}
+	if (!blocks.empty())	extentsDirty = true;
+}
+
+// Keeps the first keepBlocks blocks and returns the ones after them.
+std::vector<int64_t> FileEntry::truncateBlocks(int64_t keepBlocks) {
+	std::vector<int64_t> released;
+	int64_t kept = 0;
+	size_t extent = 0;
+	for (; extent < extents.size() && kept < keepBlocks; extent++) {
+		const int64_t keep = std::min(extents[extent].length, keepBlocks - kept);
+		for (int64_t i = keep; i < extents[extent].length; i++)	released.push_back(extents[extent].startBlock + i);
+		extents[extent].length = keep;
+		kept += keep;
+	}
+	for (size_t i = extent; i < extents.size(); i++) {
+		for (int64_t j = 0; j < extents[i].length; j++)	released.push_back(extents[i].startBlock + j);
+	}
+	extents.resize(extent);
+	extentStarts.resize(extent);
+	if (!released.empty()) {
+		extentsDirty = true;
+		dirtyExtent = std::min(dirtyExtent, std::max(numExtents() - 1, 0));
+	}
+	return released;
+}
+
+std::vector<int64_t> FileEntry::allBlocks() const {
+	std::vector<int64_t> blocks;
+	blocks.reserve(blockCount());
+	for (const Extent& extent : extents) {
+		for (int64_t i = 0; i < extent.length; i++)	blocks.push_back(extent.startBlock + i);
+	}
+	return blocks;
 }
@@ -1,14 +1,13 @@
 #include "system.h"
 
-System::System(const std::string& diskPath) {
+System::System(const std::string& diskPath, const MountOptions& options) {
 	bool check = true;
 	journalManager = new JournalManager(this, "./journal/journal.log");
-	Entries = new MetadataManager(this, ORDER);
-	FATTABLE = std::vector<bool>(TOTAL_BLOCKS, false);
+	Entries = new MetadataManager(this);
+	formatOptions = options.format;
 	this->DISK_PATH = diskPath;
 	// user = User();
-	std::fstream disk(DISK_PATH, std::ios::binary | std::ios::in | std::ios::out);
-	if (!disk) {
+	if (!device.open(DISK_PATH)) {
 		check = formatFileSystem();
 	} else {
 		check = load();
@@ -18,6 +17,11 @@ System::System(const std::string& diskPath) {
 
 	}
 	if (!check)	exit(EXIT_FAILURE);
+	if (options.mapImage) {
+		if (device.enableMapping())	std::cout << "Disk image mapped into memory.\n";
+		else	std::cerr << "Error: Unable to map the disk image, falling back to the block cache.\n";
+	}
+	if (!device.isMapped())	device.enableCache(options.cacheBlocks, options.cacheShards);
 	std::cout << "FileSystem initialized.\n";
 };  // Constructor for init
 
@@ -31,7 +35,6 @@ System::~System() {
 		delete entry;
 	}
 	std::cout << "User data freed.\n";
-	Entries->deleteBPlusTree();
 	delete Entries;
 	delete journalManager;
 	std::cout << "Indexing data freed.\n";
@@ -61,7 +64,7 @@ bool System::create(const std::string& path, ClientSession* session) {
 	return createFiles(path, session);
 }
 
-bool System::create(const std::string& path, const int& fileSize, ClientSession* session) {
+bool System::create(const std::string& path, const int64_t& fileSize, ClientSession* session) {
 	session->msg.clear();
 	return createFiles(path, session, fileSize);
 }
@@ -72,11 +75,26 @@ std::string System::read(const std::string& path, ClientSession* session) {
 	return content;
 }
 
+std::string System::read(const std::string& path, int64_t offset, int64_t length, ClientSession* session) {
+	session->msg.clear();
+	return readDataAt(path, offset, length, session);
+}
+
+bool System::readStream(const std::string& path, const ReadStream& stream, ClientSession* session) {
+	session->msg.clear();
+	return readDataStream(path, stream, session);
+}
+
 bool System::write(const std::string& path, const std::string& data, ClientSession* session) {
 	session->msg.clear();
 	return writeData(path, data, false, session);
 }
 
+bool System::write(const std::string& path, int64_t offset, const std::string& data, ClientSession* session) {
+	session->msg.clear();
+	return writeDataAt(path, offset, data, session);
+}
+
 bool System::append(const std::string& path, const std::string& data, ClientSession* session) {
 	session->msg.clear();
 	return writeData(path, data, true, session);
@@ -92,6 +110,35 @@ bool System::rename(const std::string& oldName, const std::string& newName, Clie
 	return renameFiles(oldName, newName, session);
 }
 
+int System::open(const std::string& path, ClientSession* session) {
+	session->msg.clear();
+	return openHandle(path, session);
+}
+
+bool System::close(int handle, ClientSession* session) {
+	session->msg.clear();
+	return closeHandle(handle, session);
+}
+
+void System::closeAll(ClientSession* session) {
+	closeAllHandles(session);
+}
+
+std::string System::hread(int handle, int64_t offset, int64_t length, ClientSession* session) {
+	session->msg.clear();
+	return readHandle(handle, offset, length, session);
+}
+
+bool System::hwrite(int handle, int64_t offset, const std::string& data, ClientSession* session) {
+	session->msg.clear();
+	return writeHandle(handle, offset, data, session);
+}
+
+void System::hstat(int handle, ClientSession* session) {
+	session->msg.clear();
+	statHandle(handle, session);
+}
+
 bool System::mkdir(const std::string& path, ClientSession* session) {
 	session->msg.clear();
 	return createDirectory(path, session);
@@ -167,6 +214,16 @@ void System::tree(ClientSession* session, const std::string& path, int depth, co
 	treeM(session, path, depth, prefix);
 }
 
+void System::cacheStats(ClientSession* session) {
+	session->msg.clear();
+	cacheStatsM(session);
+}
+
+bool System::grow(int newSizeMB, ClientSession* session) {
+	session->msg.clear();
+	return growM(newSizeMB, session);
+}
+
 // LOGS
 void System::show() {
 	for (int i = 0; i <static_cast<int>(metaDataTable.size()); i++) {